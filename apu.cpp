@@ -1,262 +1,332 @@
 #include "apu.h"
-#include <SDL2/SDL.h>
-#include "cpu.h"
+#include "gameboy.h"
+#include "state.h"
 #include <iostream>
 #include <stdlib.h>
+#include <algorithm>
+#include <cmath>
 
-namespace APU
+APU::APU(GameBoy& gb)
+: gb(gb)
 {
+}
 
+float APU::noise()
+{
+    noiseTime += 1;
+    if (channel[3].volume == 0) noiseTime = 0;
 
-    Channel channel[4];
-    bool channelEnabled[4] = {true, true, true, true};
-    float channelFreq[4] = {0, 0, 0, 0};
-    float channelTime[4] = {0, 0, 0, 0};
-    float duty1 = 0, duty2 = 0;
-
-    uint8_t freqSweepTime = 0;
-    bool freqSweepDirection = false;
-    uint32_t freqSweepTimer = 0;
-    uint8_t freqSweepShift = 0;
-
-    uint8_t shiftClockFreq = 0;
-    bool counterStepWidth = false;
-    uint8_t divRatio = 0;
-    uint16_t lfsr = 1;
-    uint32_t noiseFreqTimer = 0;
-    uint32_t noiseScaler = 0;
-
-    float solevel_1 = 1, solevel_2 = 1;
-    bool playwave = false;
-    bool poweron = false;
-
-    float noise()
+    if (noiseTime * 0.02267573696d > 1000.d / noiseScaler)
     {
-        static double time = 0;
-        time += 1;
-        if (channel[3].volume == 0) time = 0;
-
-        if (time * 0.02267573696d > 1000.d / noiseScaler)
+        noiseTime = 0;
+        bool x = (lfsr & 1) ^ ((lfsr & 2) >> 1);
+        lfsr = (lfsr >> 1);
+        if (counterStepWidth)
         {
-            time = 0;
-            bool x = (lfsr & 1) ^ ((lfsr & 2) >> 1);
-            lfsr = (lfsr >> 1);
-            if (counterStepWidth)
-            {
-                lfsr &= ~0x40;
-                lfsr |= (x << 6);
-            }
-            else
-            {
-                lfsr &= ~0x4000;
-                lfsr |= (x << 14);
-            }
+            lfsr &= ~0x40;
+            lfsr |= (x << 6);
+        }
+        else
+        {
+            lfsr &= ~0x4000;
+            lfsr |= (x << 14);
         }
-
-        if (!(lfsr & 1)) return 1;
-        else return -1;
     }
 
-    /*
-        Generate samples based on channel waves
-    */
-    void generateSamples(Sint16 *stream, int length)
-    {
+    if (!(lfsr & 1)) return 1;
+    else return -1;
+}
+
+/*
+    Generate samples based on channel waves
+*/
+void APU::generateSamples(int16_t *stream, int length)
+{
 
-        for (int i = 0; i < 4; i ++) {
-            if (channel[i].restart) {
-                channelTime[i] = 0;
-                channel[i].restart = false;
-            }
-            channelTime[i] += 1.0d;
+    for (int i = 0; i < 4; i ++) {
+        if (channel[i].restart) {
+            channelTime[i] = 0;
+            channel[i].restart = false;
         }
+        channelTime[i] += 1.0d;
+    }
 
-        float lt_1 = length * channelTime[0];
-        float lt_2 = length * channelTime[1];
-        float lt_3 = length * channelTime[2];
-        float mul = M_PI / FREQUENCY;
+    float lt_1 = length * channelTime[0];
+    float lt_2 = length * channelTime[1];
+    float lt_3 = length * channelTime[2];
+    float mul = M_PI / FREQUENCY;
 
-        for(int i = 0; i < length; i+=2) {
+    for(int i = 0; i < length; i+=2) {
 
-            float wave1 = 0;
-            if (channelEnabled[0]) wave1 = square(channelFreq[0] * (lt_1 + i) * mul, duty1) * (channel[0].volume / 15.f);
+        float wave1 = 0;
+        if (channelEnabled[0]) wave1 = square(channelFreq[0] * (lt_1 + i) * mul, duty1) * (channel[0].volume / 15.f);
 
-            float wave2 = 0;
-            if (channelEnabled[1]) wave2 = square(channelFreq[1] * (lt_2 + i) * mul, duty2) * (channel[1].volume / 15.f);
+        float wave2 = 0;
+        if (channelEnabled[1]) wave2 = square(channelFreq[1] * (lt_2 + i) * mul, duty2) * (channel[1].volume / 15.f);
 
-            float wave3 = 0;
-            if (playwave && channelEnabled[2])
-                wave3 = customWave(channelFreq[2] * (lt_3 + i) * mul, &CPU::RAM[0xFF30]) * (channel[2].volume * .25f);
+        float wave3 = 0;
+        if (playwave && channelEnabled[2])
+            wave3 = customWave(channelFreq[2] * (lt_3 + i) * mul, &gb.cpu.RAM[0xFF30]) * (channel[2].volume * .25f);
 
-            float wave4 = 0;
-            if (channelEnabled[3]) wave4 = noise() * (channel[3].volume  / 15.f);
+        float wave4 = 0;
+        if (channelEnabled[3]) wave4 = noise() * (channel[3].volume  / 15.f);
 
-            float mixL = 0;
-            float mixR = 0;
+        float mixL = 0;
+        float mixR = 0;
 
-            uint8_t sout = CPU::RAM[IO_NR51];
-            if (sout & 0x01) mixL += wave1;
-            if (sout & 0x02) mixL += wave2;
-            if (sout & 0x04) mixL += wave3;
-            if (sout & 0x08) mixL += wave4;
-            if (sout & 0x10) mixR += wave1;
-            if (sout & 0x20) mixR += wave2;
-            if (sout & 0x40) mixR += wave3;
-            if (sout & 0x80) mixR += wave4;
+        uint8_t sout = gb.cpu.RAM[IO_NR51];
+        if (sout & 0x01) mixL += wave1;
+        if (sout & 0x02) mixL += wave2;
+        if (sout & 0x04) mixL += wave3;
+        if (sout & 0x08) mixL += wave4;
+        if (sout & 0x10) mixR += wave1;
+        if (sout & 0x20) mixR += wave2;
+        if (sout & 0x40) mixR += wave3;
+        if (sout & 0x80) mixR += wave4;
 
-            if (!poweron || CPU::stepmode) mixL = mixR = 0;
+        if (!poweron || gb.cpu.stepmode) mixL = mixR = 0;
 
-            stream[i] = AMPLITUDE * ( mixL ) * solevel_1;
-            stream[i + 1] = AMPLITUDE * ( mixR ) * solevel_2;
-        }
+        stream[i] = AMPLITUDE * ( mixL ) * solevel_1;
+        stream[i + 1] = AMPLITUDE * ( mixR ) * solevel_2;
     }
+}
 
-    /* SDL audio callback function */
-    void audioCallback(void*, Uint8* stream, int length)
+void APU::updateVolumeEnvelope(Channel* ch)
+{
+    if (ch->volumeSweep == 0) return;
+    if (double(ch->envelopeTimer) * (1 / 4194304.d) > (ch->volumeSweep * 0.015625d))
     {
-        generateSamples((Sint16*) stream, length/2);
-    }
+        if (ch->volumeDirection && ch->volume < 15)
+            ch->volume++;
+        else if (ch->volume > 0)
+            ch->volume--;
 
-    void init()
-    {
-        /* Initialize SDL_Audio Specifications */
-        SDL_AudioSpec desiredSpec;
-        desiredSpec.freq = FREQUENCY;
-        desiredSpec.format = AUDIO_S16SYS;
-        desiredSpec.channels = 2; // Stereo
-        desiredSpec.samples = 512;
-        desiredSpec.callback = audioCallback;
+        ch->envelopeTimer = 0;
+    }
+}
 
-        SDL_AudioSpec obtainedSpec;
+void APU::calcFreqSweep()
+{
+    uint16_t last = channel[0].freq;
 
-        SDL_OpenAudio(&desiredSpec, &obtainedSpec);
+    if (!freqSweepDirection) {
+        channel[0].freq = last + (last / (1 << freqSweepShift));
 
-        SDL_PauseAudio(0);
+        if (channel[0].freq > 2047) {
+            channel[0].freq = 0;
+            gb.cpu.RAM[IO_NR52] &= ~1;
+        }
     }
+    else {
+        channel[0].freq = last - (last / (1 << freqSweepShift));
 
-    void updateVolumeEnvelope(Channel* ch)
-    {
-        if (ch->volumeSweep == 0) return;
-        if (double(ch->envelopeTimer) * (1 / 4194304.d) > (ch->volumeSweep * 0.015625d))
-        {
-            if (ch->volumeDirection && ch->volume < 15)
-                ch->volume++;
-            else if (ch->volume > 0)
-                ch->volume--;
-
-            ch->envelopeTimer = 0;
+        if (channel[0].freq < 0) {
+            channel[0].freq = 0;
         }
     }
+}
 
-    void calcFreqSweep()
-    {
-        uint16_t last = channel[0].freq;
+void APU::updateFreqSweep()
+{
+    if (freqSweepTime == 0) {
+        freqSweepTimer = 0;
+        return;
+    }
 
-        if (!freqSweepDirection) {
-            channel[0].freq = last + (last / (1 << freqSweepShift));
+    if (float(freqSweepTimer) > (freqSweepTime * 32713.2f))
+    {
+        calcFreqSweep();
 
-            if (channel[0].freq > 2047) {
-                channel[0].freq = 0;
-                CPU::RAM[IO_NR52] &= ~1;
-            }
-        }
-        else {
-            channel[0].freq = last - (last / (1 << freqSweepShift));
+        gb.cpu.RAM[IO_NR13] = channel[0].freq & 0xFF;
+        gb.cpu.RAM[IO_NR14] &= 0xF8;
+        gb.cpu.RAM[IO_NR14] |= (channel[0].freq >> 8) & 0x7;
 
-            if (channel[0].freq < 0) {
-                channel[0].freq = 0;
-            }
-        }
+        freqSweepTimer = 0;
     }
+}
 
-    void updateFreqSweep()
+void APU::clear(int ch)
+{
+    gb.cpu.RAM[IO_NR52] &= ~(1 << ch);
+    switch(ch)
     {
-        if (freqSweepTime == 0) {
-            freqSweepTimer = 0;
-            return;
-        }
+    case 0:
+        gb.cpu.RAM[IO_NR11] &= 0xC0;
+        gb.cpu.RAM[IO_NR12] &= 0x0F;
+        break;
+    case 1:
+        gb.cpu.RAM[IO_NR21] &= 0xC0;
+        gb.cpu.RAM[IO_NR22] &= 0x0F;
+        break;
+    case 2:
+        gb.cpu.RAM[IO_NR31] = 0;
+        gb.cpu.RAM[IO_NR32] = 0;
+        break;
+    case 3:
+        gb.cpu.RAM[IO_NR41] &= 0xC0;
+        gb.cpu.RAM[IO_NR42] &= 0x0F;
+        break;
+    }
+}
 
-        if (float(freqSweepTimer) > (freqSweepTime * 32713.2f))
-        {
-            calcFreqSweep();
+void APU::updateSoundLength(int ch)
+{
+    if (!channel[ch].uselength) {
+        channel[ch].lengthTimer = 0;
+        return;
+    }
 
-            CPU::RAM[IO_NR13] = channel[0].freq & 0xFF;
-            CPU::RAM[IO_NR14] &= 0xF8;
-            CPU::RAM[IO_NR14] |= (channel[0].freq >> 8) & 0x7;
+    if (channel[ch].lengthTimer < 0) {
+        channel[ch].volume = 0;
+        channel[ch].length = 0;
+        channel[ch].lengthTimer = 0;
+        clear(ch);
+    }
+}
 
-            freqSweepTimer = 0;
-        }
+/* Catch the timers up with the CPU. Nothing runs out between two
+   steps, so all a step would have done meanwhile is hold the timers
+   of an unused sweep or length at zero. */
+void APU::sync()
+{
+    uint32_t t = gb.scheduler.catchUp(Scheduler::EVENT_APU);
+    if (t == 0) return;
+
+    for (int i = 0; i < 4; i++) {
+        channel[i].envelopeTimer += t;
+        if (channel[i].uselength)
+            channel[i].lengthTimer -= t;
+        else
+            channel[i].lengthTimer = 0;
     }
+    noiseFreqTimer += t;
+    freqSweepTimer = freqSweepTime ? freqSweepTimer + t : 0;
+}
+
+// Cycles until one of the timers checked by step() runs out
+uint32_t APU::cyclesUntilStep()
+{
+    uint32_t next = Scheduler::NEVER;
 
-    void clear(int ch)
+    if (freqSweepTime)
     {
-        CPU::RAM[IO_NR52] &= ~(1 << ch);
-        switch(ch)
-        {
-        case 0:
-            CPU::RAM[IO_NR11] &= 0xC0;
-            CPU::RAM[IO_NR12] &= 0x0F;
-            break;
-        case 1:
-            CPU::RAM[IO_NR21] &= 0xC0;
-            CPU::RAM[IO_NR22] &= 0x0F;
-            break;
-        case 2:
-            CPU::RAM[IO_NR31] = 0;
-            CPU::RAM[IO_NR32] = 0;
-            break;
-        case 3:
-            CPU::RAM[IO_NR41] &= 0xC0;
-            CPU::RAM[IO_NR42] &= 0x0F;
-            break;
-        }
+        uint32_t limit = uint32_t(freqSweepTime * 32713.2f) + 1;
+        next = std::min(next, limit > freqSweepTimer ? limit - freqSweepTimer : 0);
     }
 
-    void updateSoundLength(int ch)
+    for (int i = 0; i < 4; i++)
     {
-        if (!channel[ch].uselength) {
-            channel[ch].lengthTimer = 0;
-            return;
-        }
-
-        if (channel[ch].lengthTimer < 0) {
-            channel[ch].volume = 0;
-            channel[ch].length = 0;
-            channel[ch].lengthTimer = 0;
-            clear(ch);
-        }
+        if (channel[i].uselength)
+            next = std::min(next, channel[i].lengthTimer >= 0 ? uint32_t(channel[i].lengthTimer) + 1 : 0);
     }
 
-    void step()
+    for (int i : { 0, 1, 3 })
     {
+        if (channel[i].volumeSweep)
+        {
+            uint32_t limit = channel[i].volumeSweep * 65536 + 1;
+            next = std::min(next, limit > channel[i].envelopeTimer ? limit - channel[i].envelopeTimer : 0);
+        }
+    }
+    return next;
+}
 
-        updateFreqSweep();
+void APU::step()
+{
+    sync();
 
-        channelFreq[0] =  131072.f / (2048.f - channel[0].freq);
-        channelFreq[1] =  131072.f / (2048.f - channel[1].freq);
-        channelFreq[2] =  65536.f / (2048.f - channel[2].freq);
+    updateFreqSweep();
 
-        //channelFreq[3] =
+    channelFreq[0] =  131072.f / (2048.f - channel[0].freq);
+    channelFreq[1] =  131072.f / (2048.f - channel[1].freq);
+    channelFreq[2] =  65536.f / (2048.f - channel[2].freq);
 
-        updateSoundLength(0);
-        updateSoundLength(1);
-        updateSoundLength(2);
-        updateSoundLength(3);
+    //channelFreq[3] =
 
-        updateVolumeEnvelope(&channel[0]);
-        updateVolumeEnvelope(&channel[1]);
-        updateVolumeEnvelope(&channel[3]);
+    updateSoundLength(0);
+    updateSoundLength(1);
+    updateSoundLength(2);
+    updateSoundLength(3);
 
+    updateVolumeEnvelope(&channel[0]);
+    updateVolumeEnvelope(&channel[1]);
+    updateVolumeEnvelope(&channel[3]);
 
-        static uint32_t t = SDL_GetTicks();
-        if (SDL_GetTicks() - t >= 16)
-        {
-        //    std::cout << counterStepWidth << std::endl;
-           // std::cout << (4194304.d / (524288.d / r / (double)(1 << (shiftClockFreq + 1)))) << std::endl;
-            t = SDL_GetTicks();
-        }
-
+    gb.scheduler.schedule(Scheduler::EVENT_APU, cyclesUntilStep());
+}
 
+void APU::saveState(StateWriter& state)
+{
+    for (const Channel& ch : channel)
+    {
+        state.put8(ch.volume);
+        state.put8(ch.volumeSweep);
+        state.put8(ch.length);
+        state.put32(ch.lengthTimer);
+        state.put16(ch.freq);
+        state.putBool(ch.restart);
+        state.putBool(ch.uselength);
+        state.putBool(ch.volumeDirection);
+        state.put32(ch.envelopeTimer);
     }
+    state.putFloat(duty1);
+    state.putFloat(duty2);
+
+    state.put32(freqSweepTimer);
+    state.put8(freqSweepTime);
+    state.putBool(freqSweepDirection);
+    state.put8(freqSweepShift);
+    state.put16(frequencyShadow);
+
+    state.put8(shiftClockFreq);
+    state.putBool(counterStepWidth);
+    state.put8(divRatio);
+    state.put16(lfsr);
+    state.put32(noiseFreqTimer);
+    state.put32(noiseScaler);
+
+    state.putBool(playwave);
+    state.putBool(poweron);
+    state.putFloat(solevel_1);
+    state.putFloat(solevel_2);
+    for (float freq : channelFreq)
+        state.putFloat(freq);
+}
 
+void APU::loadState(StateReader& state)
+{
+    for (Channel& ch : channel)
+    {
+        ch.volume = state.get8();
+        ch.volumeSweep = state.get8();
+        ch.length = state.get8();
+        ch.lengthTimer = state.get32();
+        ch.freq = state.get16();
+        ch.restart = state.getBool();
+        ch.uselength = state.getBool();
+        ch.volumeDirection = state.getBool();
+        ch.envelopeTimer = state.get32();
+    }
+    duty1 = state.getFloat();
+    duty2 = state.getFloat();
+
+    freqSweepTimer = state.get32();
+    freqSweepTime = state.get8();
+    freqSweepDirection = state.getBool();
+    freqSweepShift = state.get8();
+    frequencyShadow = state.get16();
+
+    shiftClockFreq = state.get8();
+    counterStepWidth = state.getBool();
+    divRatio = state.get8();
+    lfsr = state.get16();
+    noiseFreqTimer = state.get32();
+    noiseScaler = state.get32();
+
+    playwave = state.getBool();
+    poweron = state.getBool();
+    solevel_1 = state.getFloat();
+    solevel_2 = state.getFloat();
+    for (float& freq : channelFreq)
+        freq = state.getFloat();
 }
@@ -2,6 +2,10 @@
 #define APU_H
 #include <stdint.h>
 
+class GameBoy;
+class StateWriter;
+class StateReader;
+
 inline float radToDeg(float rads)
 {
     return rads * 180.f / 3.14159265359f;
@@ -20,45 +24,46 @@ struct Channel
     uint32_t envelopeTimer;
 };
 
-namespace APU
+class APU
 {
-    const float dutyCycles[] = { .125, .25, .50, .75 };
-    const uint32_t AMPLITUDE = 3500;
-    const uint32_t FREQUENCY = 44100;
+public:
+    static constexpr float dutyCycles[] = { .125, .25, .50, .75 };
+    static const uint32_t AMPLITUDE = 3500;
+    static const uint32_t FREQUENCY = 44100;
 
-    extern Channel channel[4];
-    extern bool channelEnabled[4];
+    Channel channel[4] = {};
+    bool channelEnabled[4] = {true, true, true, true};
 
-    extern float duty1, duty2;
+    float duty1 = 0, duty2 = 0;
 
     /* Channel 1 frequency sweep variables */
-    extern uint32_t freqSweepTimer;
-    extern uint8_t freqSweepTime;
-    extern bool freqSweepDirection;
-    extern uint8_t freqSweepShift;
-    extern int16_t frequencyShadow;
+    uint32_t freqSweepTimer = 0;
+    uint8_t freqSweepTime = 0;
+    bool freqSweepDirection = false;
+    uint8_t freqSweepShift = 0;
+    int16_t frequencyShadow = 0;
 
     /* Noise data */
-    extern uint8_t shiftClockFreq;
-    extern bool counterStepWidth;
-    extern uint8_t divRatio;
-    extern uint16_t lfsr;
-    extern uint32_t noiseFreqTimer;
-    extern uint32_t noiseScaler;
+    uint8_t shiftClockFreq = 0;
+    bool counterStepWidth = false;
+    uint8_t divRatio = 0;
+    uint16_t lfsr = 1;
+    uint32_t noiseFreqTimer = 0;
+    uint32_t noiseScaler = 0;
 
     /* Output control */
-    extern bool playwave;
-    extern bool poweron;
-    extern float solevel_1, solevel_2;
+    bool playwave = false;
+    bool poweron = false;
+    float solevel_1 = 1, solevel_2 = 1;
 
-    inline float square(float x, float duty)
+    static float square(float x, float duty)
     {
         x = (int)radToDeg(x) % 360;
         if (x >= 360.f * duty) return 1;
         else return -1;
     }
 
-    inline float customWave(float x, uint8_t* data)
+    static float customWave(float x, uint8_t* data)
     {
         x = (int)radToDeg(x) % 360;
         uint32_t pos = (x / 360.f) * 32;
@@ -66,10 +71,39 @@ namespace APU
         return (val - 8) / 8.f;
     }
 
-    void init();
+    APU(GameBoy& gb);
+
+    /* Mix length / 2 stereo samples at FREQUENCY into stream. Called
+       from the frontend's audio thread */
+    void generateSamples(int16_t* stream, int length);
+    // Scheduler event: catch the timers up and update the channels
     void step();
+    // Catch the timers up before a register write changes them
+    void sync();
 
     void calcFreqSweep();
-}
+
+    /* The channels, sweep, noise and output registers. The phase of
+       the waves belongs to the audio thread and carries on as it is */
+    void saveState(StateWriter& state);
+    void loadState(StateReader& state);
+
+private:
+    GameBoy& gb;
+
+    float channelFreq[4] = {0, 0, 0, 0};
+    float channelTime[4] = {0, 0, 0, 0};
+
+    // Samples since the noise channel last shifted
+    double noiseTime = 0;
+
+    float noise();
+
+    void updateVolumeEnvelope(Channel* ch);
+    void updateFreqSweep();
+    void clear(int ch);
+    void updateSoundLength(int ch);
+    uint32_t cyclesUntilStep();
+};
 
 #endif // APU_H
@@ -0,0 +1,242 @@
+#include "batch.h"
+#include "gameboy.h"
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+#include <stdlib.h>
+
+// FNV-1a, to tell end states apart in the results
+static uint32_t hashBytes(uint32_t hash, uint8_t byte)
+{
+    return (hash ^ byte) * 16777619u;
+}
+
+bool Batch::load(std::istream& in, std::ostream& err)
+{
+    std::string text;
+    int line = 0;
+    while (std::getline(in, text))
+    {
+        line++;
+        size_t comment = text.find('#');
+        if (comment != std::string::npos)
+            text.erase(comment);
+
+        BatchJob job;
+        job.line = line;
+        std::istringstream fields(text);
+        std::string field;
+        bool empty = true;
+        while (fields >> field)
+        {
+            empty = false;
+            size_t eq = field.find('=');
+            if (eq == std::string::npos)
+            {
+                err << "Manifest line " << line << ": expected key=value, got \"" << field << "\"" << std::endl;
+                return false;
+            }
+            std::string key = field.substr(0, eq);
+            std::string value = field.substr(eq + 1);
+
+            if (key == "rom") job.rom = value;
+            else if (key == "boot") job.boot = value;
+            else if (key == "movie") job.movie = value;
+            else if (key == "screenshot") job.screenshot = value;
+            else if (key == "ram") job.ramDump = value;
+            else if (key == "save") job.save = value;
+            else if (key == "frames") job.frames = atoll(value.c_str());
+            else if (key == "max-cycles") job.maxCycles = strtoull(value.c_str(), nullptr, 10);
+            else if (key == "timing")
+            {
+                if (value != "cycle" && value != "instruction")
+                {
+                    err << "Manifest line " << line << ": timing is cycle or instruction, got \"" << value << "\"" << std::endl;
+                    return false;
+                }
+                job.timing = value == "cycle";
+            }
+            else
+            {
+                err << "Manifest line " << line << ": unknown key \"" << key << "\"" << std::endl;
+                return false;
+            }
+        }
+        if (empty)
+            continue;
+
+        if (job.rom.empty())
+        {
+            err << "Manifest line " << line << ": no rom" << std::endl;
+            return false;
+        }
+        // Nothing to stop a job without a movie but the watchdog
+        if (job.frames < 0 && job.movie.empty())
+            job.frames = 600;
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+// Next job for worker self, its own first and then one stolen
+bool Batch::take(size_t self, size_t& job)
+{
+    {
+        Worker& own = *workers[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.queue.empty())
+        {
+            job = own.queue.front();
+            own.queue.pop_front();
+            return true;
+        }
+    }
+
+    // No jobs are added once running, so finding every queue empty
+    // means the batch is done
+    for (size_t i = 1; i < workers.size(); i++)
+    {
+        Worker& victim = *workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.queue.empty())
+        {
+            job = victim.queue.back();
+            victim.queue.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void Batch::work(size_t self, std::ostream& out)
+{
+    size_t job;
+    while (take(self, job))
+        runJob(job, out);
+}
+
+void Batch::runJob(size_t index, std::ostream& out)
+{
+    const BatchJob& job = jobs[index];
+    std::unique_ptr<GameBoy> gb(new GameBoy);
+    gb->cpu.cachedInterpreter = cachedInterpreter;
+    gb->cpu.skipIdleLoops = skipIdleLoops;
+    gb->cpu.cycleAccurate = job.timing < 0 ? cycleAccurate : job.timing;
+    gb->cpu.saveInterval = saveInterval;
+    gb->cpu.savePath = job.save;
+    if (useJIT)
+        gb->cpu.useJIT = gb->jit.init();
+
+    std::ostringstream result;
+    result << "job " << job.line << " ";
+
+    // Check the files first, the core reports its own errors on stderr
+    std::string error;
+    if (!std::ifstream(job.rom))
+        error = "cannot read " + job.rom;
+    else if (!job.movie.empty() && !std::ifstream(job.movie))
+        error = "cannot read " + job.movie;
+    else
+    {
+        gb->cpu.initBootROM(job.boot.c_str());
+        if (gb->cpu.init(job.rom.c_str()))
+            error = "cannot load " + job.rom;
+        else if (!job.movie.empty() && gb->tasplayer.loadVBM(job.movie.c_str()))
+            error = "bad movie " + job.movie;
+    }
+
+    bool hung = false;
+    int64_t frames = 0;
+    uint64_t cycles = 0;
+    double seconds = 0;
+    if (error.empty())
+    {
+        uint64_t limit = job.maxCycles ? job.maxCycles : maxCycles;
+        uint64_t start = gb->scheduler.now();
+        auto began = std::chrono::steady_clock::now();
+
+        while (job.frames < 0 ? gb->tasplayer.isRunning() : frames < job.frames)
+        {
+            if (gb->scheduler.now() - start >= limit)
+            {
+                hung = true;
+                break;
+            }
+            gb->runFrame();
+            frames++;
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - began;
+        seconds = elapsed.count();
+        cycles = gb->scheduler.now() - start;
+
+        if (!job.screenshot.empty() && !gb->saveScreenshot(job.screenshot.c_str()))
+            error = "cannot write " + job.screenshot;
+        else if (!job.ramDump.empty() && !gb->dumpMemory(job.ramDump.c_str()))
+            error = "cannot write " + job.ramDump;
+    }
+
+    if (!error.empty())
+        result << "error " << error;
+    else
+    {
+        uint32_t ram = 2166136261u, screen = 2166136261u;
+        for (uint32_t loc = 0x8000; loc < 0x10000; loc++)
+            ram = hashBytes(ram, gb->cpu.read(loc));
+        for (int i = 0; i < 160 * 144; i++)
+            for (int b = 0; b < 24; b += 8)
+                screen = hashBytes(screen, gb->gpu.screen[i] >> b);
+
+        result << (hung ? "hung" : "ok")
+               << " frames=" << frames
+               << " cycles=" << cycles
+               << " fps=" << std::fixed << std::setprecision(1)
+               << (seconds > 0 ? frames / seconds : 0)
+               << std::hex << std::uppercase << std::setfill('0')
+               << " ram=" << std::setw(8) << ram
+               << " screen=" << std::setw(8) << screen;
+    }
+    result << " rom=" << job.rom << "\n";
+
+    std::lock_guard<std::mutex> guard(outputLock);
+    out << result.str() << std::flush;
+    if (!error.empty() || hung)
+        failed++;
+    totalFrames += frames;
+}
+
+size_t Batch::run(unsigned threads, std::ostream& out)
+{
+    if (threads == 0)
+        threads = 1;
+    if (threads > jobs.size())
+        threads = jobs.size() ? jobs.size() : 1;
+
+    workers.clear();
+    for (unsigned i = 0; i < threads; i++)
+        workers.emplace_back(new Worker);
+    // Deal the jobs out in manifest order
+    for (size_t i = 0; i < jobs.size(); i++)
+        workers[i % threads]->queue.push_back(i);
+
+    failed = 0;
+    totalFrames = 0;
+    auto began = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++)
+        pool.emplace_back(&Batch::work, this, i, std::ref(out));
+    work(0, out);
+    for (std::thread& thread : pool)
+        thread.join();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - began;
+    out << "batch " << jobs.size() << " jobs, " << failed << " failed, "
+        << totalFrames << " frames in " << std::fixed << std::setprecision(2)
+        << elapsed.count() << " s on " << threads << " threads, "
+        << std::setprecision(1) << (elapsed.count() > 0 ? totalFrames / elapsed.count() : 0)
+        << " fps" << std::endl;
+    return failed;
+}
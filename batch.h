@@ -0,0 +1,86 @@
+#ifndef BATCH_H
+#define BATCH_H
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <iostream>
+
+class GameBoy;
+
+// One run of a ROM, read from a line of the manifest
+struct BatchJob
+{
+    std::string rom;
+    std::string boot;
+    std::string movie;
+    std::string screenshot;     // PNG of the last frame, if set
+    std::string ramDump;        // address space at the end, if set
+    std::string save;           // save file for battery-backed RAM, if set
+    int64_t frames = -1;        // -1 runs to the end of the movie
+    int timing = -1;            // 1 for M-cycle timing, -1 takes Batch::cycleAccurate
+    uint64_t maxCycles = 0;     // watchdog, 0 takes Batch::maxCycles
+    int line = 0;
+};
+
+/* Runs many short jobs across a pool of threads, each job on its own
+   GameBoy. Every worker owns a deque of jobs: it takes from the front
+   of its own and, once that is empty, steals from the back of another.
+   A line is written for each job as it finishes.
+
+   A manifest has a job per line, as key=value pairs separated by
+   spaces, and # starts a comment:
+
+       rom=game.gb frames=600 movie=run.vbm ram=game.ram screenshot=game.png
+
+   boot= and max-cycles= are also taken, and timing=cycle runs the job
+   with M-cycle timing (timing=instruction without). save=game.sav keeps
+   the cartridge's battery-backed RAM in a file, which no two jobs
+   running at once should share. */
+class Batch
+{
+public:
+    // Applied to every job
+    bool cachedInterpreter = false;
+    bool useJIT = false;
+    bool skipIdleLoops = true;
+    // Default for jobs without timing=
+    bool cycleAccurate = false;
+    // Seconds between writebacks of save= files
+    double saveInterval = 1;
+
+    // Emulated cycles a job may run before it is stopped as hung,
+    // an hour of Game Boy time by default
+    uint64_t maxCycles = 3600ull * 4194304;
+
+    // Add the jobs of a manifest, return false on a bad line
+    bool load(std::istream& in, std::ostream& err);
+
+    size_t size() const { return jobs.size(); }
+
+    // Run every job on threads workers, writing results to out as they
+    // come in. Return the number of jobs that did not finish
+    size_t run(unsigned threads, std::ostream& out);
+
+private:
+    struct Worker
+    {
+        std::mutex lock;
+        std::deque<size_t> queue;
+    };
+
+    std::vector<BatchJob> jobs;
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    std::mutex outputLock;
+    size_t failed = 0;
+    uint64_t totalFrames = 0;
+
+    bool take(size_t self, size_t& job);
+    void work(size_t self, std::ostream& out);
+    void runJob(size_t index, std::ostream& out);
+};
+
+#endif // BATCH_H
@@ -0,0 +1,354 @@
+#include "bench.h"
+#include "gameboy.h"
+#include "statefile.h"
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <sstream>
+#include <stdio.h>
+#include <time.h>
+
+namespace Benchmark
+{
+    /* Place an instruction in work RAM and point every register
+       pair at work RAM, so memory operands and immediates never
+       reach the cartridge or I/O registers. */
+    void setup(CPU& cpu, bool cb, uint8_t opcode)
+    {
+        uint16_t pc = 0xC000;
+        if (cb) cpu.RAM[pc++] = 0xCB;
+        cpu.RAM[pc++] = opcode;
+        cpu.RAM[pc++] = 0x80; // LDH (FF80), JR -128, a16 = D080
+        cpu.RAM[pc++] = 0xD0;
+    }
+
+    inline void resetRegisters(CPU& cpu)
+    {
+        cpu.PC = 0xC000;
+        cpu.SP = 0xDFF0;
+        cpu.B = 0xD1; cpu.C = 0x80;
+        cpu.D = 0xD2; cpu.E = 0x00;
+        cpu.H = 0xD3; cpu.L = 0x00;
+    }
+
+    bool isInvalid(uint8_t opcode)
+    {
+        switch (opcode)
+        {
+        case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4:
+        case 0xEB: case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD:
+            return true;
+        }
+        return false;
+    }
+
+    double timeOpcode(CPU& cpu, bool cb, uint8_t opcode, uint32_t iterations)
+    {
+        setup(cpu, cb, opcode);
+
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            resetRegisters(cpu);
+            cpu.step();
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+    }
+
+    void printTable(CPU& cpu, const char* name, bool cb, uint32_t iterations)
+    {
+        double total = 0;
+        int count = 0;
+
+        printf("%s (ns per instruction)\n", name);
+        printf("    ");
+        for (int x = 0; x < 16; x++) printf("   x%X", x);
+        printf("\n");
+
+        for (int y = 0; y < 16; y++)
+        {
+            printf("%Xx  ", y);
+            for (int x = 0; x < 16; x++)
+            {
+                uint8_t opcode = (y << 4) | x;
+                if (!cb && (opcode == 0xCB || isInvalid(opcode)))
+                {
+                    printf("    -");
+                    continue;
+                }
+
+                double ns = timeOpcode(cpu, cb, opcode, iterations);
+                printf("%5.1f", ns);
+                total += ns;
+                count++;
+            }
+            printf("\n");
+        }
+        printf("mean %.2f ns\n\n", total / count);
+    }
+
+    // Mean of every valid opcode, without the table
+    double meanOpcodes(CPU& cpu, bool cb, uint32_t iterations)
+    {
+        double total = 0;
+        int count = 0;
+        for (int opcode = 0; opcode < 256; opcode++)
+        {
+            if (!cb && (opcode == 0xCB || isInvalid(opcode)))
+                continue;
+            total += timeOpcode(cpu, cb, opcode, iterations);
+            count++;
+        }
+        return total / count;
+    }
+
+    /* A loop of arithmetic, logic and rotates in the way a checksum
+       or multiply routine strings them together, where nearly every
+       result's flags are replaced before a branch reads them. */
+    const uint8_t aluLoop[] =
+    {
+        0x78,           // LD A, B
+        0x81,           // ADD A, C
+        0x8A,           // ADC A, D
+        0x93,           // SUB E
+        0x9B,           // SBC A, E
+        0xA1,           // AND C
+        0xAA,           // XOR D
+        0xB3,           // OR E
+        0xB8,           // CP B
+        0x4F,           // LD C, A
+        0xCB, 0x12,     // RL D
+        0xCB, 0x3B,     // SRL E
+        0x1F,           // RRA
+        0x57,           // LD D, A
+        0x0C,           // INC C
+        0x1D,           // DEC E
+        0x05,           // DEC B
+        0x20, 0xEB,     // JR NZ, -21
+        0x18, 0xE9      // JR -23
+    };
+
+    double timeALU(CPU& cpu, uint32_t iterations)
+    {
+        std::copy(aluLoop, aluLoop + sizeof(aluLoop), cpu.RAM + 0xC000);
+        resetRegisters(cpu);
+
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < iterations; i++)
+            cpu.step();
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+    }
+
+    void alu(GameBoy& gb, uint32_t iterations)
+    {
+        CPU& cpu = gb.cpu;
+        cpu.runningBootROM = false;
+        cpu.initMemoryMap();
+
+        printf("ALU loop: %.2f ns per instruction\n\n", timeALU(cpu, iterations));
+
+        cpu.cycles = 0;
+    }
+
+    // Microseconds per frame of a ROM on a new GameBoy, 0 if it won't load
+    double timeFrames(const char* rom, bool cycleAccurate, uint32_t frames)
+    {
+        std::unique_ptr<GameBoy> gb(new GameBoy);
+        gb->cpu.cycleAccurate = cycleAccurate;
+        if (gb->cpu.init(rom))
+            return 0;
+
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < frames; i++)
+            gb->runFrame();
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double, std::micro>(end - start).count() / frames;
+    }
+
+    void printTiers(const char* name, const char* unit, double instruction, double cycle)
+    {
+        printf("%-12s %9.2f %s %9.2f %s %7.2fx\n", name, instruction, unit, cycle, unit,
+               instruction > 0 ? cycle / instruction : 0);
+    }
+
+    void tiers(GameBoy& gb, uint32_t iterations, const char* rom)
+    {
+        CPU& cpu = gb.cpu;
+        cpu.runningBootROM = false;
+        cpu.initMemoryMap();
+
+        double opcodes[2], cbOpcodes[2], loop[2];
+        for (int tier = 0; tier < 2; tier++)
+        {
+            cpu.cycleAccurate = tier;
+            opcodes[tier] = meanOpcodes(cpu, false, iterations);
+            cbOpcodes[tier] = meanOpcodes(cpu, true, iterations);
+            loop[tier] = timeALU(cpu, iterations * 20);
+        }
+        cpu.cycleAccurate = false;
+        cpu.cycles = 0;
+
+        printf("Timing tiers    instruction        M-cycle    ratio\n");
+        printTiers("opcodes", "ns", opcodes[0], opcodes[1]);
+        printTiers("CB opcodes", "ns", cbOpcodes[0], cbOpcodes[1]);
+        printTiers("ALU loop", "ns", loop[0], loop[1]);
+
+        if (rom)
+        {
+            // Frames of a game also pay for the events run between accesses
+            const uint32_t frames = 600;
+            double instruction = timeFrames(rom, false, frames);
+            double cycle = instruction ? timeFrames(rom, true, frames) : 0;
+            if (!instruction)
+                printf("\nCould not load %s\n", rom);
+            else
+                printTiers("frames", "us", instruction, cycle);
+        }
+        printf("\n");
+    }
+
+    /* Load a save file clock stamped three hours ago, as a console
+       just switched on would, and check it counted the time away */
+    void clock()
+    {
+        RTC rtc;
+        uint8_t footer[RTC::SAVE_SIZE];
+        rtc.save(footer, 0);
+        uint64_t stamp = time(nullptr) - 3 * 3600;
+        for (int i = 0; i < 8; i++)
+            footer[40 + i] = stamp >> (i * 8);
+
+        RTC loaded;
+        loaded.load(footer, 1000);
+        printf("Save file clock: 3 hours away, counted %d:%02d, %s\n\n",
+               loaded.regs[RTC::HOURS], loaded.regs[RTC::MINUTES],
+               loaded.regs[RTC::HOURS] == 3 && loaded.regs[RTC::DAYS_LOW] == 0 ? "ok" : "WRONG");
+    }
+
+    void states(const char* rom)
+    {
+        std::unique_ptr<GameBoy> gb(new GameBoy);
+        if (rom && gb->cpu.init(rom))
+        {
+            printf("Could not load %s\n\n", rom);
+            return;
+        }
+        for (int i = 0; i < 60; i++)
+            gb->runFrame();
+
+        const uint32_t iterations = 2000;
+        std::vector<uint8_t> state, again;
+        gb->saveState(state);
+
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < iterations; i++)
+            gb->saveState(state);
+        auto saved = std::chrono::steady_clock::now();
+        bool loaded = true;
+        for (uint32_t i = 0; i < iterations; i++)
+            loaded &= gb->loadState(state);
+        auto end = std::chrono::steady_clock::now();
+
+        gb->saveState(again);
+        printf("Save states: %zu bytes, save %.2f us, load %.2f us, %s\n\n", state.size(),
+               std::chrono::duration<double, std::micro>(saved - start).count() / iterations,
+               std::chrono::duration<double, std::micro>(end - saved).count() / iterations,
+               !loaded ? "load FAILED" : again == state ? "round trip exact" : "round trip DIFFERS");
+
+        // A snapshot a frame, as a rewind buffer would take them
+        const uint32_t frames = 300;
+        std::vector<Snapshot> snapshots(frames);
+        double taking = 0;
+        size_t bytes = 0;
+        for (uint32_t i = 0; i < frames; i++)
+        {
+            gb->runFrame();
+            auto before = std::chrono::steady_clock::now();
+            gb->takeSnapshot(snapshots[i]);
+            taking += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - before).count();
+            if (i) bytes += snapshots[i].bytes();
+        }
+        start = std::chrono::steady_clock::now();
+        for (uint32_t i = frames; i-- > 0; )
+            loaded &= gb->restoreSnapshot(snapshots[i]);
+        end = std::chrono::steady_clock::now();
+        printf("Snapshots: %zu bytes a frame, take %.2f us, restore %.2f us%s\n\n",
+               bytes / (frames - 1), taking / frames,
+               std::chrono::duration<double, std::micro>(end - start).count() / frames,
+               loaded ? "" : ", restore FAILED");
+
+        // Rewinding a frame at a time, against the frames it adds to
+        gb->rewind.configure(64 << 20);
+        double capturing = 0;
+        for (uint32_t i = 0; i < frames; i++)
+        {
+            gb->cpu.exec(GameBoy::FRAME_CYCLES);
+            auto before = std::chrono::steady_clock::now();
+            gb->rewind.capture();
+            capturing += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - before).count();
+        }
+        size_t perFrame = gb->rewind.bytes() / (gb->rewind.states() - 1);
+        start = std::chrono::steady_clock::now();
+        uint32_t steps = 0;
+        while (gb->rewind.stepBack())
+            steps++;
+        end = std::chrono::steady_clock::now();
+        printf("Rewind: %zu bytes a frame, capture %.2f us (%.1f%% of a frame at 60 fps), step back %.2f us%s\n\n",
+               perFrame, capturing / frames,
+               capturing / frames / (1e6 / 60) * 100,
+               std::chrono::duration<double, std::micro>(end - start).count() / std::max<uint32_t>(steps, 1),
+               steps == frames - 1 ? "" : ", steps MISSING");
+
+        // Through memory, so the disk doesn't count
+        static const char* levels[] = { "store", "fast", "default", "best" };
+        printf("State files   ratio  store MB/s  load MB/s\n");
+        for (int level = StateFile::LEVEL_STORE; level <= StateFile::LEVEL_BEST; level++)
+        {
+            // Up to 20 files, or a quarter of a second of them
+            uint32_t files = 0;
+            std::string file;
+            auto start = std::chrono::steady_clock::now();
+            auto stored = start;
+            while (files < 20 && stored - start < std::chrono::milliseconds(250))
+            {
+                std::ostringstream out;
+                StateFile::write(out, state, level);
+                file = out.str();
+                files++;
+                stored = std::chrono::steady_clock::now();
+            }
+            bool read = true;
+            for (uint32_t i = 0; i < files; i++)
+            {
+                std::istringstream in(file);
+                read &= StateFile::read(in, again) && again == state;
+            }
+            auto end = std::chrono::steady_clock::now();
+
+            double megabytes = state.size() * (double)files / 1e6;
+            printf("%-10s %7.2fx %11.1f %10.1f%s\n", levels[level], (double)state.size() / file.size(),
+                   megabytes / std::chrono::duration<double>(stored - start).count(),
+                   megabytes / std::chrono::duration<double>(end - stored).count(),
+                   read ? "" : "  read FAILED");
+        }
+        printf("\n");
+    }
+
+    void opcodes(GameBoy& gb, uint32_t iterations)
+    {
+        CPU& cpu = gb.cpu;
+        cpu.runningBootROM = false;
+        cpu.initMemoryMap();
+
+        printTable(cpu, "Opcodes", false, iterations);
+        printTable(cpu, "CB opcodes", true, iterations);
+
+        cpu.cycles = 0;
+    }
+}
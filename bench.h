@@ -0,0 +1,30 @@
+#ifndef BENCH_H
+#define BENCH_H
+#include <stdint.h>
+
+class GameBoy;
+
+namespace Benchmark
+{
+    // Time every opcode through CPU::step and print
+    // the average nanoseconds per instruction
+    void opcodes(GameBoy& gb, uint32_t iterations);
+
+    // Time a loop of ALU instructions through CPU::step
+    void alu(GameBoy& gb, uint32_t iterations);
+
+    // Time the opcodes, the ALU loop and, given a ROM, frames of it
+    // with instruction and with M-cycle timing, side by side
+    void tiers(GameBoy& gb, uint32_t iterations, const char* rom);
+
+    // Time saveState and loadState on a ROM a second into running,
+    // or on no cartridge, and check that a loaded state saves the same.
+    // Then snapshots and rewind captures taken every frame, and the size
+    // and speed of state files at each level
+    void states(const char* rom);
+
+    // Check that a save file's clock counts on by the time it was away
+    void clock();
+}
+
+#endif // BENCH_H
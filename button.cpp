@@ -3,8 +3,8 @@
 #include <string.h>
 #include <SDL2/SDL.h>
 #include <iostream>
-#include "joypad.h"
-#include "cpu.h"
+#include "gameboy.h"
+#include "frontend.h"
 
 Button::Button(std::string text, int32_t x, int32_t y, int32_t w, int32_t h)
 : Component(x, y)
@@ -16,15 +16,16 @@ Button::Button(std::string text, int32_t x, int32_t y, int32_t w, int32_t h)
 
 void Button::update(Debugger* debugger)
 {
+    Frontend& frontend = debugger->frontend;
     int32_t mousex, mousey;
     SDL_GetMouseState(&mousex, &mousey);
 
-    if ((Joypad::mousedown || Joypad::mouseup) &&
+    if ((frontend.mousedown || frontend.mouseup) &&
         (mousex > x && mousey > y && mousex <= x + width && mousey <= y + height))
     {
         pressed = true;
 
-        if (Joypad::mouseup)
+        if (frontend.mouseup)
             onclick(debugger);
 
     } else pressed = false;
@@ -1,7 +1,8 @@
 #include "checkbox.h"
 #include "debug.h"
 #include <SDL2/SDL.h>
-#include "joypad.h"
+#include "gameboy.h"
+#include "frontend.h"
 
 CheckBox::CheckBox(int32_t x, int32_t y)
 : Component(x, y)
@@ -13,15 +14,16 @@ CheckBox::CheckBox(int32_t x, int32_t y)
 
 void CheckBox::update(Debugger* debugger)
 {
+    Frontend& frontend = debugger->frontend;
     int32_t mousex, mousey;
     SDL_GetMouseState(&mousex, &mousey);
 
-    if ((Joypad::mousedown || Joypad::mouseup) &&
+    if ((frontend.mousedown || frontend.mouseup) &&
         (mousex > x && mousey > y && mousex <= x + 17 && mousey <= y + 18))
     {
         pressed = true;
 
-        if (Joypad::mouseup) {
+        if (frontend.mouseup) {
             if (check)
                 *check = !(*check);
             if (oncheck)
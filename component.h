@@ -11,6 +11,7 @@ protected:
 public:
     bool pressed = false;
     Component(int32_t x, int32_t y);
+    virtual ~Component() { }
     virtual void update(Debugger*);
     virtual void draw(Debugger*);
 };
@@ -1,1250 +1,1294 @@
 #include "cpu.h"
-#include <SDL2/SDL.h>
 #include <iostream>
-#include "gpu.h"
-#include "joypad.h"
+#include "gameboy.h"
 #include <stdio.h>
-#include "mbc.h"
-#include "apu.h"
 #include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <type_traits>
 
-namespace CPU
+CPU::CPU(GameBoy& gb)
+: gb(gb)
 {
-    std::string romtitle;
-    const char* bootdir;
-    uint8_t currentROMBank = 0;
+}
 
-    Debugger debugger;
-    bool opendebugger = true;
+CPU::~CPU()
+{
+    delete[] bootrom;
+}
 
-    TAS tasplayer;
+// Point the pages of [start, end) at mem, or at the handlers
+void mapPages(uint8_t** pages, uint32_t start, uint32_t end, uint8_t* mem)
+{
+    for (uint32_t loc = start; loc < end; loc += 0x100)
+        pages[loc >> 8] = mem ? mem + (loc - start) : nullptr;
+}
 
-    // Registers
-    uint8_t A, F,
-            B, C,
-            D, E,
-            H, L;
+// Memory page of a pointer into RAM or cartridge RAM, see trackWrites()
+size_t CPU::memoryPage(const uint8_t* mem)
+{
+    if (mem >= RAM && mem < RAM + sizeof(RAM))
+        return (mem - RAM) >> 8;
+    return 0x100 + ((mem - EXTERNAL_RAM) >> 8);
+}
 
-    // Stack Pointer
-    uint16_t SP;
-    // Program Counter
-    uint16_t PC;
+// mapPages for writes, leaving pages not yet written since
+// trackWrites() to the handler
+void CPU::mapWritePages(uint32_t start, uint32_t end, uint8_t* mem)
+{
+    for (uint32_t loc = start; loc < end; loc += 0x100)
+    {
+        uint8_t* page = mem ? mem + (loc - start) : nullptr;
+        writeTargets[loc >> 8] = page;
+        writePages[loc >> 8] = page && pageWritten(memoryPage(page)) ? page : nullptr;
+    }
+}
 
+void CPU::trackWrites()
+{
+    trackingWrites = true;
+    std::fill(written.begin(), written.end(), 0);
+    // Code pages are left to their own protection
+    for (int page = 0; page < 0x100; page++)
+        if (writeTargets[page])
+            writePages[page] = nullptr;
+}
 
-    bool runningBootROM = false;
+// Mark the whole of memory written, after it changed wholesale
+void CPU::markWritten()
+{
+    written.assign(0x100 + externalRAMSize / 0x100, 1);
+}
 
-    uint8_t* ROM = nullptr;
-    uint8_t* CART_ROM;
+// Map the banks the controller selects, wrapped to the banks the
+// cartridge has
+void CPU::mapROM()
+{
+    uint16_t mask = mbc.rombanks - 1;
+    currentROMBank0 = mbc.rombank0 & mask;
+    currentROMBank = mbc.rombank & mask;
+    CART_ROM = ROM ? ROM + 0x4000 * currentROMBank : nullptr;
+
+    // The pages are only read through, the image stays read only
+    mapPages(readPages, 0x0000, 0x4000, ROM ? const_cast<uint8_t*>(ROM + 0x4000 * currentROMBank0) : nullptr);
+    mapPages(readPages, 0x4000, 0x8000, const_cast<uint8_t*>(CART_ROM));
+    if (runningBootROM)
+        readPages[0x00] = bootrom;
+
+    // The next instruction may come from another bank
+    currentBlock = nullptr;
+    gb.scheduler.wake();
+}
 
-    uint8_t RAM[0x10000];
-    uint8_t* EXTERNAL_RAM = nullptr;
-    uint8_t* RAM_BANK;
+void CPU::mapExternalRAM()
+{
+    uint8_t* bank = nullptr;
+    if (mbc.enableram && mbc.ramMapped && externalRAMSize)
+        bank = EXTERNAL_RAM + ((mbc.rambank * 0x2000) & (externalRAMSize - 1));
+    uint32_t end = 0xA000 + std::min<uint32_t>(externalRAMSize, 0x2000);
+
+    mapPages(readPages, 0xA000, 0xC000, nullptr);
+    mapWritePages(0xA000, 0xC000, nullptr);
+    mapPages(readPages, 0xA000, end, bank);
+    mapWritePages(0xA000, end, bank);
+}
 
-    bool accessOAM = true;
-    bool accessVRAM = true;
+void CPU::mapVRAM()
+{
+    uint8_t* mem = accessVRAM ? RAM + 0x8000 : nullptr;
+    mapPages(readPages, 0x8000, 0xA000, mem);
+    mapWritePages(0x8000, 0xA000, mem);
+}
 
-    // Interrupt enable
-    bool ienable = true;
-    int pendingIEnable = 0, pendingIDisable = 0;
+void CPU::mapOAM()
+{
+    uint8_t* mem = accessOAM ? RAM + 0xFE00 : nullptr;
+    readPages[0xFE] = mem;
+    mapWritePages(0xFE00, 0xFF00, mem);
+}
 
-    bool halted = false;
-    bool haltskip = false;
+void CPU::setVRAMAccess(bool b)
+{
+    if (accessVRAM == b) return;
+    accessVRAM = b;
+    mapVRAM();
+}
 
-    // Memory Bank Controller
-    MBC mbc = nrom;
+void CPU::setOAMAccess(bool b)
+{
+    if (accessOAM == b) return;
+    accessOAM = b;
+    mapOAM();
+}
 
-    bool running = true;
+/*
+    Block cache
 
-    // Steps through the program one
-    // instruction at a time
-    bool stepmode = false;
-    int takestep = 0;
+    The cached interpreter decodes straight-line code once into a
+    block of micro-ops and then runs it without fetching or decoding
+    again. Blocks are keyed by their start address and, in the
+    switchable ROM area, by the mapped bank. A block never spans two
+    pages, so code in work RAM and high RAM is tracked per page:
+    decoding there unmaps the page for writes, and a write to any
+    byte of cached code drops every block on that page.
+*/
 
-    // Clock cycles
-    uint32_t cycles = 0;
+const size_t MAX_BLOCK_OPS = 64;
 
-    // DIV timer cycles
-    uint32_t divcycles = 0;
+// Runs of a block before it is translated
+const uint32_t JIT_THRESHOLD = 16;
 
-    // TIMA cycles
-    uint32_t timercycles = 0;
+// Send writes to a page of work RAM (and its echo) through the handler
+void CPU::protectCodePage(uint8_t page)
+{
+    if (page == 0xFF) return;
+    writePages[page] = nullptr;
+    if (page < 0xDE) writePages[page + 0x20] = nullptr;
+}
 
-    // 60 fps count
-    uint32_t frameticks = 0;
+void CPU::invalidateCodePage(uint8_t page)
+{
+    for (uint32_t key : codePages[page])
+    {
+        auto it = blocks.find(key);
+        if (&it->second == currentBlock)
+        {
+            currentBlock = nullptr;
+            gb.scheduler.wake();
+        }
+        blocks.erase(it);
+    }
+    codePages[page].clear();
+    std::fill(codeBytes + (page << 8), codeBytes + (page << 8) + 0x100, false);
 
+    if (page == 0xFF) return;
+    mapWritePages(page << 8, (page + 1) << 8, RAM + (page << 8));
+    if (page < 0xDE) mapWritePages((page + 0x20) << 8, (page + 0x21) << 8, RAM + (page << 8));
+}
 
-    uint8_t getInput(uint8_t val)
-    {
-        if (!(val & 0x20))
-            return (val & 0xF0) | Joypad::getButtons();
+void CPU::flushBlockCache()
+{
+    for (int page = 0; page < 0x100; page++)
+        if (!codePages[page].empty())
+            invalidateCodePage(page);
+    blocks.clear();
+    currentBlock = nullptr;
+    gb.jit.reset();
+}
 
-        if (!(val & 0x10))
-            return (val & 0xF0) | Joypad::getDirections();
+// Build the whole memory map from the current state
+void CPU::initMemoryMap()
+{
+    flushBlockCache();
 
-        return 0xFF;
-    }
+    mapWritePages(0x0000, 0x8000, nullptr);
+    mapROM();
 
-    // Read a byte from a memory location
-    uint8_t read(uint16_t loc)
-    {
-        if (loc >= 0x4000 && loc <= 0x7FFF) {
-            return CART_ROM[loc - 0x4000];
-        }
-        else if (loc >= 0x8000 && loc < 0xA000)
-        {
-            if (accessVRAM)
-                return RAM[loc];
-            else
-                return 0xFF;
-        }
-        else if (loc >= 0xFE00 && loc < 0xFEA0)
-        {
-            if (accessOAM)
-                return RAM[loc];
-            else
-                return 0;
-        }
-        else if (loc >= 0xA000 && loc < 0xBFFF)
-        {
-            if (mbc.enableram)
-            {
-                return (RAM_BANK[loc - 0xA000]);
-            }
-        }
-        else if (loc >= 0xE000 && loc <= 0xFDFF)
-            return RAM[loc - 0x2000];
-        else if (loc >= 0xFF00)
-        {
-            switch(loc & 0xFF)
-            {
-                case IO_LY:
-                    if (CPU::RAM[IO_LCDC] & (1 << 7))
-                        return RAM[IO_LY];
-                    else
-                        return 0;
-                case IO_DMA: return 0;
-                case IO_NR13: return 0;
-                case IO_NR14: return RAM[loc] & 0x40;
-                case IO_NR23: return 0;
-                case IO_NR24: return RAM[loc] & 0x40;
-                case IO_NR30: return RAM[loc] & 0x80;
-                case IO_NR33: return 0;
-                case IO_NR34: return RAM[loc] & 0x40;
-                case IO_NR44: return RAM[loc] & 0x40;
-
-                default: return RAM[loc];
-            }
-        }
-        return RAM[loc];
-    }
+    mapVRAM();
+    mapExternalRAM();
 
-    // Write a byte to a memory location
-    void write(uint16_t loc, uint8_t byte)
-    {
-        // NEEDS MBC SUPPORT
-        if (loc < 0x8000) {
-            mbc.write(&mbc, loc, byte);
-            return;
-        }
-        else if (loc >= 0x8000 && loc < 0xA000)
-        {
-            if (accessVRAM)
-                RAM[loc] = byte;
-        }
-        else if (loc >= 0xFE00 && loc < 0xFEA0)
-        {
-            if (accessOAM)
-                RAM[loc] = byte;
-        }
-        else if (loc >= 0xA000 && loc < 0xBFFF)
-        {
-            if (mbc.enableram)
-            {
-                RAM_BANK[loc - 0xA000] = byte;
-            }
-        }
-        else if (loc >= 0xE000 && loc <= 0xFDFF)
-            RAM[loc - 0x2000] = byte;
+    mapPages(readPages, 0xC000, 0xE000, RAM + 0xC000);
+    mapWritePages(0xC000, 0xE000, RAM + 0xC000);
 
-        else if (loc >= 0xFF00)
-        {
-            switch(loc)
-            {
-                case IO_P1: {
-                    uint8_t oldP1 = RAM[IO_P1];
-                    byte = (byte & 0xF0) | (oldP1 & ~0xF0);
-                    byte = getInput(byte);
-                    if ((byte != oldP1) && ((byte & 0x0F) != 0x0F))
-                        RAM[IO_IF] |= INTERRUPT_HILO;
-                    RAM[IO_P1] = byte;
-                    } break;
-
-                case IO_LY: /* LY is reset when written to */
-                case IO_DIV: RAM[loc] = 0; break; /* DIV is reset when written to */
-                case IO_STAT: RAM[loc] =(byte & ~0x07) | (RAM[loc] & 0x07);
-
-                /* SOUND REGISTERS*/
-                case IO_NR10:
-                    if (!APU::poweron) break;
-                    APU::freqSweepTime = (byte >> 4) & 3;
-                    APU::freqSweepDirection = byte & 0x8;
-                    APU::freqSweepShift = byte & 0x7;
-                    RAM[loc] = byte;
-                    break;
-                case IO_NR11:
-                    if (!APU::poweron) break;
-                    APU::channel[0].length = byte & 0x3F;
-                    APU::channel[0].lengthTimer
-                        = (64 - APU::channel[0].length) * (1/256.f) * 4194304;
-                    APU::duty1 = APU::dutyCycles[byte >> 6];
-                    RAM[loc] = byte;
-                    break;
-                case IO_NR12:
-                    if (!APU::poweron) break;
-                    APU::channel[0].volume = byte >> 4;
-                    APU::channel[0].volumeSweep = byte & 0x7;
-                    APU::channel[0].volumeDirection = byte & 0x8;
-                    RAM[loc] = byte;
-                    break;
-                case IO_NR13:
-                    if (!APU::poweron) break;
-                    APU::channel[0].freq &= 0xFF00;
-                    APU::channel[0].freq |= byte;
-                    RAM[loc] = byte;
-                    break;
-                case IO_NR14:
-                    if (!APU::poweron) break;
-                    APU::channel[0].restart = byte & 0x80;
-                    APU::channel[0].uselength = byte & 0x40;
-                    APU::channel[0].freq &= 0xF8FF;
-                    APU::channel[0].freq |= int(byte & 0x7) << 8;
-
-                    APU::channel[0].length = RAM[IO_NR11] & 0x3F;
-                    APU::channel[0].lengthTimer
-                        = (64 - APU::channel[0].length) * (1/256.f) * 4194304;
-
-                    if (byte & 0x80)
-                    {
-                        RAM[IO_NR52] |= 1;
-
-                        APU::channel[0].volume = RAM[IO_NR12] >> 4;
-                        APU::freqSweepTime = (RAM[IO_NR10] >> 4) & 3;
-
-                        if (!(APU::freqSweepTime || APU::freqSweepShift))
-                            RAM[IO_NR52] &= ~1;
-
-                        if (APU::freqSweepShift && APU::freqSweepTime)
-                            APU::calcFreqSweep();
-
-                    }
-                    RAM[loc] = byte;
-                    break;
-
-                case IO_NR21:
-                    if (!APU::poweron) break;
-                    APU::channel[1].length = byte & 0x3F;
-                    APU::channel[1].lengthTimer
-                        = (64 - APU::channel[1].length) * (1/256.f) * 4194304;
-                    APU::duty2 = APU::dutyCycles[byte >> 6];
-                    RAM[loc] = byte;
-                    break;
-                case IO_NR22:
-                    if (!APU::poweron) break;
-                    APU::channel[1].volume = byte >> 4;
-                    APU::channel[1].volumeSweep = byte & 0x7;
-                    APU::channel[1].volumeDirection = byte & 0x8;
-                    RAM[loc] = byte;
-                    break;
-                case IO_NR23:
-                    if (!APU::poweron) break;
-                    APU::channel[1].freq &= 0xFF00;
-                    APU::channel[1].freq |= byte;
-                    RAM[loc] = byte;
-                    break;
-                case IO_NR24:
-                    if (!APU::poweron) break;
-                    APU::channel[1].restart = byte & 0x80;
-                    APU::channel[1].uselength = byte & 0x40;
-                    APU::channel[1].freq &= 0xF8FF;
-                    APU::channel[1].freq |= int(byte & 0x7) << 8;
-
-                    APU::channel[1].length = RAM[IO_NR21] & 0x3F;
-                    APU::channel[1].lengthTimer
-                        = (64 - APU::channel[1].length) * (1/256.f) * 4194304;
-
-                    if (byte & 0x80)
-                    {
-                        RAM[IO_NR52] |= 2;
-                        APU::channel[1].volume = RAM[IO_NR22] >> 4;
-                    }
-                    RAM[loc] = byte;
-                    break;
-
-                /* Free Wave Channel */
-                case IO_NR30:
-                    if (!APU::poweron) break;
-                    APU::playwave = byte & 0x80;
-                    RAM[loc] = byte;
-                    break;
-                case IO_NR31:
-                    if (!APU::poweron) break;
-                    APU::channel[2].length = byte;
-                    APU::channel[2].lengthTimer
-                        = (256 - APU::channel[2].length) * (1/256.f) * 4194304;
-                    RAM[loc] = byte;
-                    break;
-                case IO_NR32:
-                    if (!APU::poweron) break;
-                    switch((byte >> 5) & 0x3)
-                    {
-                        case 0:  APU::channel[2].volume = 0; break;
-                        case 1:  APU::channel[2].volume = 4; break;
-                        case 2:  APU::channel[2].volume = 2; break;
-                        case 3:  APU::channel[2].volume = 1; break;
-                    }
-                    RAM[loc] = byte;
-                    break;
-                case IO_NR33:
-                    if (!APU::poweron) break;
-                    APU::channel[2].freq &= 0xFF00;
-                    APU::channel[2].freq |= byte;
-                    RAM[loc] = byte;
-                    break;
-                case IO_NR34:
-                    if (!APU::poweron) break;
-                    APU::channel[2].restart = byte & 0x80;
-                    APU::channel[2].uselength = byte & 0x40;
-                    APU::channel[2].freq &= 0xF8FF;
-                    APU::channel[2].freq |= int(byte & 0x7) << 8;
-
-                    if (byte & 0x80)
-                    {
-                        RAM[IO_NR52] |= 4;
-
-                        APU::channel[2].length = RAM[IO_NR31];
-                        APU::channel[2].lengthTimer
-                        = (256 - APU::channel[2].length) * (1/256.f) * 4194304;
-
-
-                        switch((RAM[IO_NR32] >> 5) & 0x3)
-                        {
-                            case 0:  APU::channel[2].volume = 0; break;
-                            case 1:  APU::channel[2].volume = 4; break;
-                            case 2:  APU::channel[2].volume = 2; break;
-                            case 3:  APU::channel[2].volume = 1; break;
-                        }
-                    }
-                    RAM[loc] = byte;
-                    break;
-
-                /* Nose Channel */
-                case IO_NR41: // Channel 4 Sound Length
-                    if (!APU::poweron) break;
-                    APU::channel[3].length = byte & 0x3F;
-                    APU::channel[3].lengthTimer
-                        = (64 - APU::channel[3].length) * (1/256.f) * 4194304;
-                    RAM[loc] = byte;
-                    break;
-                case IO_NR42: // Channel 4 Volume Envelope
-                    if (!APU::poweron) break;
-                    APU::channel[3].volume = byte >> 4;
-                    APU::channel[3].volumeSweep = byte & 0x7;
-                    APU::channel[3].volumeDirection = byte & 0x8;
-                    RAM[loc] = byte;
-                    break;
-                case IO_NR43: // Channel 4 Polynomial Counter
-                    if (!APU::poweron) break;
-                    APU::shiftClockFreq = (byte >> 4);
-                    APU::counterStepWidth = (byte & 0x8);
-                    APU::divRatio = (byte & 0x7);
-
-                    {
-                        double r = APU::divRatio;
-                        if (r == 0) r = 0.5d;
-                        APU::noiseScaler = 524288.d / r / (double)(1 << (APU::shiftClockFreq+1));
-                    }
-
-                    RAM[loc] = byte;
-                    break;
-                case IO_NR44: // Channel 4 Counter/Consecutive; Intial
-                    if (!APU::poweron) break;
-                    APU::channel[3].restart = byte & 0x80;
-                    APU::channel[3].uselength = byte & 0x40;
-
-                    if (byte & 0x80)
-                    {
-                        RAM[IO_NR52] |= 8;
-
-                        APU::channel[3].length = RAM[IO_NR41] & 0x3F;
-                        APU::channel[3].lengthTimer
-                        = (64 - APU::channel[3].length) * (1/256.f) * 4194304;
-
-                        APU::channel[3].volume = RAM[IO_NR42] >> 4;
-                        APU::lfsr = ~0;
-                    }
-                    RAM[loc] = byte;
-                    break;
-
-                /* Sound Control Registers */
-                case IO_NR50: // Channel control / ON-OFF/ Volume
-                    if (!APU::poweron) break;
-                    APU::solevel_1 = (byte & 7) / 7.f;
-                    APU::solevel_2 = ((byte >> 4) & 7) / 7.f;
-                    RAM[loc] = byte;
-                    break;
-
-                case IO_NR51:
-                    if (!APU::poweron) break;
-                    RAM[loc] = byte;
-                    break;
-
-                // IO_NR51 (Sound Output selection)
-                // is determined during mixing
-                case IO_NR52: // Sound on/off
-                    APU::poweron = byte & 0x80;
-                    RAM[loc] &= 0x7F;
-                    RAM[loc] |= APU::poweron << 7;
-
-                    if (!APU::poweron)
-                    {
-                        for (int i = IO_NR10; i < IO_NR51; i++)
-                            CPU::RAM[i] = 0;
-                    }
-                    break;
-
-                /* DMA Transfer */
-                case IO_DMA: {
-                    RAM[loc] = byte;
-                    uint16_t start = byte << 8;
-                    for (uint16_t i = 0; i < 0xA0; i++)
-                    {
-                        RAM[OAM + i] = read(start + i);
-                    }
-                    } break;
-
-
-
-                default: RAM[loc] = byte; break;
-            }
-        }
-        else RAM[loc] = byte;
-    }
+    // Echo of work RAM
+    mapPages(readPages, 0xE000, 0xFE00, RAM + 0xC000);
+    mapWritePages(0xE000, 0xFE00, RAM + 0xC000);
 
-    // Write a word to a memory location
-    inline void writeWord(uint16_t loc, uint16_t word)
-    {
-        write(loc, word & 0xFF);
-        write(loc + 1, word >> 8);
-    }
+    mapOAM();
 
-    // Read the next byte at PC
-    inline uint8_t getImmediateByte()
+    // I/O registers and high RAM
+    readPages[0xFF] = nullptr;
+    mapWritePages(0xFF00, 0x10000, nullptr);
+    gb.io.init();
+}
+
+// Read a byte from a page without a direct mapping
+uint8_t CPU::readHandler(uint16_t loc)
+{
+    if (loc >= 0xFE00 && loc < 0xFEA0)
     {
-        return read(PC++);
+        // Locked OAM
+        return 0;
     }
-
-    // Read the next word at PC
-    inline uint16_t getImmediateWord()
+    else if (loc >= 0xFF00)
     {
-        PC += 2;
-        return (read(PC - 1) << 8) | read(PC - 2);
+        const IORegister& reg = gb.io.registers[loc & 0xFF];
+        if (reg.read)
+            return reg.read(gb);
+        return RAM[loc] | reg.unreadable;
     }
+    else if (loc >= 0xFEA0)
+        return RAM[loc];
+    else if (loc >= 0xA000 && loc < 0xC000)
+        return mbc.readRAM(mbc, EXTERNAL_RAM, loc, gb.scheduler.now());
+
+    // Locked VRAM or the ROM of no cartridge
+    return 0xFF;
+}
 
-    // Update cycles
-    inline void tick(uint32_t t)
+// Write a byte to a page without a direct mapping
+void CPU::writeHandler(uint16_t loc, uint8_t byte)
+{
+    // First write to a page since trackWrites(): mark it and map it
+    // back, unless it holds cached code
+    if (uint8_t* target = writeTargets[loc >> 8])
     {
-        cycles += t;
-        divcycles += t;
-        if (RAM[IO_TAC] & 4) timercycles += t;
-        GPU::rendercycles += t;
-
-        for (int i = 0; i < 4; i++) {
-            APU::channel[i].envelopeTimer += t;
-            APU::channel[i].lengthTimer -= t;
+        written[memoryPage(target)] = 1;
+        uint8_t page = loc >= 0xE000 && loc < 0xFE00 ? (loc >> 8) - 0x20 : loc >> 8;
+        if (codePages[page].empty())
+        {
+            writePages[loc >> 8] = target;
+            target[loc & 0xFF] = byte;
+            return;
         }
-        APU::noiseFreqTimer += t;
-        APU::freqSweepTimer += t;
     }
 
-    #define FUNC_FLAG(name, flag) \
-        inline void set## name ##Flag(bool b) \
-        { if (b) F |= flag; else F &= ~flag; }
-    FUNC_FLAG(Zero,       ZERO_FLAG);
-    FUNC_FLAG(Subtract,   SUBTRACT_FLAG);
-    FUNC_FLAG(HalfCarry,  HALF_CARRY_FLAG);
-    FUNC_FLAG(Carry,      CARRY_FLAG);
-    #undef FUNC_FLAG
-
-    // Register pair AF
-    uint16_t AF()
-    {
-        return (A << 8) | F;
+    if (loc < 0x8000) {
+        mbc.write(*this, mbc, loc, byte, gb.scheduler.now());
+        return;
     }
-
-    // Register pair BC
-    uint16_t BC()
+    else if (loc >= 0xA000 && loc < 0xC000)
     {
-        return (B << 8) | C;
+        // MBC2's RAM is only reached through here
+        if (externalRAMSize)
+            written[0x100 + (((mbc.rambank * 0x2000) + (loc - 0xA000)) & (externalRAMSize - 1)) / 0x100] = 1;
+        mbc.writeRAM(mbc, EXTERNAL_RAM, loc, byte, gb.scheduler.now());
+        return;
     }
-
-    // Register pair DE
-    uint16_t DE()
+    else if (loc >= 0xFF00)
     {
-        return (D << 8) | E;
+        if (codeBytes[loc]) invalidateCodePage(0xFF);
+
+        const IORegister& reg = gb.io.registers[loc & 0xFF];
+        if (reg.event != Scheduler::EVENT_COUNT)
+            gb.scheduler.refresh(Scheduler::Event(reg.event));
+        RAM[loc] = (RAM[loc] & ~reg.writable) | (byte & reg.writable);
+        if (reg.write)
+            reg.write(gb, byte);
+
+        // Compiled blocks look for interrupts at the next boundary
+        if (loc < 0xFF80 || loc == IO_IE)
+            gb.scheduler.wake();
     }
-
-    // Register pair HL
-    uint16_t HL()
+    else if (loc >= 0xFEA0)
+        RAM[loc] = byte;
+    else if (loc >= 0xC000 && loc < 0xFE00)
     {
-        return (H << 8) | L;
+        // Work RAM page holding cached code
+        uint16_t mem = loc >= 0xE000 ? loc - 0x2000 : loc;
+        if (codeBytes[mem]) invalidateCodePage(mem >> 8);
+        RAM[mem] = byte;
+        return;
     }
 
-    // Change HL's value
-    inline void setHL(uint16_t word)
-    {
-        H = word >> 8;
-        L = word;
-    }
+    // Locked VRAM/OAM ignore writes
+}
 
-    inline void add(uint8_t value)
-    {
-        uint16_t result = (uint16_t)A + (uint16_t)value;
-        setSubtractFlag(false);
-        setHalfCarryFlag(((A & 0xF) + (value & 0xF)) > 0x0F);
-        setCarryFlag(result > 0xFF);
-        A = result;
-        setZeroFlag(A == 0);
-    }
+// Write a word to a memory location
+template <typename Fetch>
+inline void CPU::writeWord(uint16_t loc, uint16_t word)
+{
+    Fetch::write(*this, loc, word & 0xFF);
+    Fetch::write(*this, loc + 1, word >> 8);
+}
 
-    inline void adc(uint8_t value)
-    {
-        uint16_t result = (uint16_t)A + (uint16_t)value + (uint16_t)getCarry();
-        setSubtractFlag(false);
-        setHalfCarryFlag(((A & 0xF) + (value & 0xF) + getCarry()) & 0x10);
-        setCarryFlag(result & 0x100);
-        A = result;
-        setZeroFlag(A == 0);
-    }
+// Read the next byte at PC
+inline uint8_t CPU::getImmediateByte()
+{
+    return read(PC++);
+}
 
-    inline void sub(uint8_t value)
-    {
-        uint16_t result = (uint16_t)A - (uint16_t)value;
-        setSubtractFlag(true);
-        setHalfCarryFlag((result & 0xF) > (A & 0xF));
-        setCarryFlag(result > 0xFF);
-        A = result;
-        setZeroFlag(A == 0);
-    }
+// Read the next word at PC
+inline uint16_t CPU::getImmediateWord()
+{
+    PC += 2;
+    return (read(PC - 1) << 8) | read(PC - 2);
+}
 
-    inline void sbc(uint8_t value)
+/* Where an instruction takes its operands from, and how its memory
+   accesses are timed. The interpreter reads them at PC; the cached
+   interpreter has already advanced PC past the instruction and hands
+   over the predecoded value. Both only count an instruction's cycles
+   once it is done, so everything it does happens at its first cycle. */
+struct CPU::MemoryFetch
+{
+    static uint8_t byte(CPU& cpu) { return cpu.getImmediateByte(); }
+    static uint16_t word(CPU& cpu) { return cpu.getImmediateWord(); }
+    static uint8_t read(CPU& cpu, uint16_t loc) { return cpu.read(loc); }
+    static void write(CPU& cpu, uint16_t loc, uint8_t byte) { cpu.write(loc, byte); }
+    // An M-cycle with no memory access
+    static void idle(CPU& cpu) { }
+    // Cycles the instruction takes, on top of any already run
+    static void tick(CPU& cpu, uint32_t t) { cpu.tick(t); }
+};
+
+struct CPU::DecodedFetch : MemoryFetch
+{
+    static uint8_t byte(CPU& cpu) { return cpu.decodedOperand; }
+    static uint16_t word(CPU& cpu) { return cpu.decodedOperand; }
+};
+
+/* The M-cycle accurate tier of the interpreter. Every access, opcode
+   and operand fetches included, first runs the clock on by an M-cycle
+   and any events due by then, so it sees LY, STAT, the timer and IF as
+   they are at that point of the instruction. The counts in the tables
+   still decide how long an instruction takes: tick() only runs the
+   part of them the accesses have not. */
+struct CPU::CycleFetch
+{
+    static void idle(CPU& cpu)
     {
-        uint16_t result = (uint16_t)A - (uint16_t)value - getCarry();
-        setSubtractFlag(true);
-        setHalfCarryFlag((A^value^(result & 0xFF)) & 0x10);
-        setCarryFlag(result > 0xFF);
-        A = result;
-        setZeroFlag(A == 0);
+        cpu.cycles += 4;
+        cpu.prepaid += 4;
+        if (cpu.cycles >= cpu.gb.scheduler.next)
+            cpu.gb.scheduler.run();
     }
-
-    inline void cp(uint8_t value)
+    static uint8_t read(CPU& cpu, uint16_t loc)
     {
-        uint16_t result = (uint16_t)A - value;
-        setZeroFlag((uint8_t)result == 0);
-        setSubtractFlag(true);
-        setHalfCarryFlag((result & 0xF) > (A & 0xF));
-        setCarryFlag(result > 0xFF);
+        idle(cpu);
+        return cpu.read(loc);
     }
-
-    inline void inc(uint8_t& a)
+    static void write(CPU& cpu, uint16_t loc, uint8_t byte)
     {
-        uint8_t result = a + 1;
-        setZeroFlag(result == 0);
-        setSubtractFlag(false);
-        setHalfCarryFlag(((a & 0xF) + (1 & 0xF)) & 0x10);
-        a = result;
+        idle(cpu);
+        cpu.write(loc, byte);
     }
-
-    inline void dec(uint8_t& a)
+    static uint8_t byte(CPU& cpu) { return read(cpu, cpu.PC++); }
+    static uint16_t word(CPU& cpu)
     {
-        uint8_t result = a - 1;
-        setZeroFlag(result == 0);
-        setSubtractFlag(true);
-        setHalfCarryFlag(((a & 0xF) - (1 & 0xF)) & 0x10);
-        a = result;
+        uint8_t low = byte(cpu);
+        return low | (byte(cpu) << 8);
     }
-
-    inline void addWord(uint16_t value)
+    static void tick(CPU& cpu, uint32_t t)
     {
-        uint32_t hl = HL();
-        uint32_t result = hl + (uint32_t)value;
-        setCarryFlag(result > 0xFFFF);
-        setHalfCarryFlag(((hl & 0x0FFF) + (value & 0x0FFF)) > 0x0FFF);
-        setSubtractFlag(false);
-        setHL(result);
+        uint32_t paid = std::min(t, cpu.prepaid);
+        cpu.prepaid -= paid;
+        cpu.tick(t - paid);
     }
+};
 
-    // Increment register pair
-    inline void incPair(uint8_t& h, uint8_t& l)
-    {
-        l++;
-        if (l == 0) h++;
-    }
+// Update cycles, the other timers catch up when their events run
+inline void CPU::tick(uint32_t t)
+{
+    cycles += t;
+}
 
-    // Decrement register pair
-    inline void decPair(uint8_t& h, uint8_t& l)
-    {
-        l--;
-        if (l == 0xFF) h--;
-    }
+#define FUNC_FLAG(name, flag) \
+    inline void CPU::set## name ##Flag(bool b) \
+    { if (b) F |= flag; else F &= ~flag; }
+FUNC_FLAG(Zero,       ZERO_FLAG);
+FUNC_FLAG(Subtract,   SUBTRACT_FLAG);
+FUNC_FLAG(HalfCarry,  HALF_CARRY_FLAG);
+FUNC_FLAG(Carry,      CARRY_FLAG);
+#undef FUNC_FLAG
+
+// Register pair AF
+uint16_t CPU::AF()
+{
+    return (A << 8) | F;
+}
 
-    inline void pushWord(uint16_t val)
-    {
-        SP -= 2;
-        writeWord(SP, val);
-    }
+// Register pair BC
+uint16_t CPU::BC()
+{
+    return (B << 8) | C;
+}
 
-    inline uint16_t popWord()
-    {
-        uint16_t val = read(SP) | (read(SP + 1) << 8);
-        SP += 2;
-        return val;
-    }
+// Register pair DE
+uint16_t CPU::DE()
+{
+    return (D << 8) | E;
+}
 
-    // Jump relative IF
-    inline void JRIF(bool b)
-    {
-        int8_t val = getImmediateByte();
-        if (b)
-        {
-            PC += (int16_t)val;
-            tick(4);
-        }
-    }
+// Register pair HL
+uint16_t CPU::HL()
+{
+    return (H << 8) | L;
+}
 
-    // Return IF
-    inline void RETIF(bool b)
-    {
-        if (b)
-        {
-            PC = popWord();
-            tick(12);
-        }
-    }
+// Change HL's value
+inline void CPU::setHL(uint16_t word)
+{
+    H = word >> 8;
+    L = word;
+}
 
-    // Jump IF
-    inline void JPIF(bool b)
-    {
-        uint16_t val = getImmediateWord();
-        if (b)
-        {
-            PC = val;
-            tick(4);
-        }
-    }
+inline void CPU::add(uint8_t value)
+{
+    uint16_t result = (uint16_t)A + (uint16_t)value;
+    setSubtractFlag(false);
+    setHalfCarryFlag(((A & 0xF) + (value & 0xF)) > 0x0F);
+    setCarryFlag(result > 0xFF);
+    A = result;
+    setZeroFlag(A == 0);
+}
 
-    // Call IF
-    inline void CALLIF(bool b)
-    {
-        uint16_t val = getImmediateWord();
-        if (b)
-        {
-            pushWord(PC);
-            PC = val;
-            tick(12);
-        }
-    }
+inline void CPU::adc(uint8_t value)
+{
+    uint16_t result = (uint16_t)A + (uint16_t)value + (uint16_t)getCarry();
+    setSubtractFlag(false);
+    setHalfCarryFlag(((A & 0xF) + (value & 0xF) + getCarry()) & 0x10);
+    setCarryFlag(result & 0x100);
+    A = result;
+    setZeroFlag(A == 0);
+}
 
-    inline void RST(uint8_t pos)
-    {
-        pushWord(PC);
-        PC = 0x0000 + pos;
-    }
+inline void CPU::sub(uint8_t value)
+{
+    uint16_t result = (uint16_t)A - (uint16_t)value;
+    setSubtractFlag(true);
+    setHalfCarryFlag((result & 0xF) > (A & 0xF));
+    setCarryFlag(result > 0xFF);
+    A = result;
+    setZeroFlag(A == 0);
+}
 
-    inline uint8_t getReg(uint8_t r)
-    {
-        switch(r)
-        {
-            case 0: return B;
-            case 1: return C;
-            case 2: return D;
-            case 3: return E;
-            case 4: return H;
-            case 5: return L;
-            case 6: tick(4); return read(HL());
-            case 7: return A;
-        }
-        return 0;
-    }
+inline void CPU::sbc(uint8_t value)
+{
+    uint16_t result = (uint16_t)A - (uint16_t)value - getCarry();
+    setSubtractFlag(true);
+    setHalfCarryFlag((A^value^(result & 0xFF)) & 0x10);
+    setCarryFlag(result > 0xFF);
+    A = result;
+    setZeroFlag(A == 0);
+}
 
-    // STOP
-    inline void stop()
-    {
+inline void CPU::cp(uint8_t value)
+{
+    uint16_t result = (uint16_t)A - value;
+    setZeroFlag((uint8_t)result == 0);
+    setSubtractFlag(true);
+    setHalfCarryFlag((result & 0xF) > (A & 0xF));
+    setCarryFlag(result > 0xFF);
+}
 
-    }
+inline void CPU::inc(uint8_t& a)
+{
+    uint8_t result = a + 1;
+    setZeroFlag(result == 0);
+    setSubtractFlag(false);
+    setHalfCarryFlag(((a & 0xF) + (1 & 0xF)) & 0x10);
+    a = result;
+}
 
-    // Enable interrupts
-    inline void EI()
-    {
-        pendingIEnable = 1;
-    }
+inline void CPU::dec(uint8_t& a)
+{
+    uint8_t result = a - 1;
+    setZeroFlag(result == 0);
+    setSubtractFlag(true);
+    setHalfCarryFlag(((a & 0xF) - (1 & 0xF)) & 0x10);
+    a = result;
+}
 
-    // Disable interrupts
-    inline void DI()
-    {
-        pendingIDisable = 1;
-    }
+inline void CPU::addWord(uint16_t value)
+{
+    uint32_t hl = HL();
+    uint32_t result = hl + (uint32_t)value;
+    setCarryFlag(result > 0xFFFF);
+    setHalfCarryFlag(((hl & 0x0FFF) + (value & 0x0FFF)) > 0x0FFF);
+    setSubtractFlag(false);
+    setHL(result);
+}
 
-    // Rotate left
-    inline void rlc(uint8_t& reg)
-    {
-        setCarryFlag(reg >> 7);
-        reg = (reg >> 7) | (reg << 1);
-        setZeroFlag(reg == 0);
-        setSubtractFlag(false);
-        setHalfCarryFlag(false);
-    }
+// Increment register pair
+inline void CPU::incPair(uint8_t& h, uint8_t& l)
+{
+    l++;
+    if (l == 0) h++;
+}
 
-    // Rotate right
-    inline void rrc(uint8_t& reg)
-    {
-        setCarryFlag(reg & 1);
-        reg = (reg >> 1) | (reg << 7);
-        setZeroFlag(reg == 0);
-        setSubtractFlag(false);
-        setHalfCarryFlag(false);
-    }
+// Decrement register pair
+inline void CPU::decPair(uint8_t& h, uint8_t& l)
+{
+    l--;
+    if (l == 0xFF) h--;
+}
 
-    // Rotate left through carry
-    inline void rl(uint8_t& reg)
-    {
-        uint8_t temp = reg & 0x80;
-        reg = (reg << 1) | getCarry();
-        setCarryFlag(temp);
-        setZeroFlag(reg == 0);
-        setSubtractFlag(false);
-        setHalfCarryFlag(false);
-    }
+// PUSH, CALL, RST and interrupts all spend an M-cycle before writing
+template <typename Fetch>
+inline void CPU::pushWord(uint16_t val)
+{
+    Fetch::idle(*this);
+    Fetch::write(*this, --SP, val >> 8);
+    Fetch::write(*this, --SP, val & 0xFF);
+}
 
-    // Rotate right through carry
-    inline void rr(uint8_t& reg)
-    {
-        uint8_t temp = reg & 1;
-        reg = (getCarry() << 7) | (reg >> 1);
-        setCarryFlag(temp);
-        setZeroFlag(reg == 0);
-        setSubtractFlag(false);
-        setHalfCarryFlag(false);
-    }
+template <typename Fetch>
+inline uint16_t CPU::popWord()
+{
+    uint8_t low = Fetch::read(*this, SP++);
+    return low | (Fetch::read(*this, SP++) << 8);
+}
 
-    // Shift left into Carry
-    inline void sla(uint8_t& reg)
+// Jump relative IF
+template <typename Fetch>
+inline void CPU::JRIF(bool b)
+{
+    int8_t val = Fetch::byte(*this);
+    if (b)
     {
-        setCarryFlag(reg & 0x80);
-        reg <<= 1;
-        setZeroFlag(reg == 0);
+        PC += (int16_t)val;
+        Fetch::tick(*this, 4);
     }
+}
 
-    // Shift right into Carry
-    inline void sra(uint8_t& reg)
+// Return IF
+template <typename Fetch>
+inline void CPU::RETIF(bool b)
+{
+    if (b)
     {
-        setCarryFlag(reg & 0x1);
-        reg >>= 1;
-        setZeroFlag(reg == 0);
+        PC = popWord<Fetch>();
+        Fetch::tick(*this, 12);
     }
+}
 
-    inline void swap(uint8_t& reg)
+// Jump IF
+template <typename Fetch>
+inline void CPU::JPIF(bool b)
+{
+    uint16_t val = Fetch::word(*this);
+    if (b)
     {
-        reg = (reg >> 4) | (reg << 4);
-        setZeroFlag(reg == 0);
-        setSubtractFlag(false);
-        setHalfCarryFlag(false);
-        setCarryFlag(false);
+        PC = val;
+        Fetch::tick(*this, 4);
     }
+}
 
-    // Shift right into Carry
-    inline void srl(uint8_t& reg)
+// Call IF
+template <typename Fetch>
+inline void CPU::CALLIF(bool b)
+{
+    uint16_t val = Fetch::word(*this);
+    if (b)
     {
-        setCarryFlag(reg & 1);
-        reg >>= 1;
-        setZeroFlag(reg == 0);
-        setSubtractFlag(false);
-        setHalfCarryFlag(false);
+        pushWord<Fetch>(PC);
+        PC = val;
+        Fetch::tick(*this, 12);
     }
+}
 
-    void printStatus()
-    {
-        printf("PC : %4X\n", PC);
-        printf("SP : %4X\n", SP);
-        printf("AF : %4X\n", AF());
-        printf("BC : %4X\n", BC());
-        printf("DE : %4X\n", DE());
-        printf("HL : %4X\n", HL());
-    }
+template <typename Fetch>
+inline void CPU::RST(uint8_t pos)
+{
+    pushWord<Fetch>(PC);
+    PC = 0x0000 + pos;
+}
 
-    void initBootROM(const char* filename)
-    {
-        runningBootROM = true;
+// STOP
+inline void CPU::stop()
+{
 
-        if (!bootdir) bootdir = filename;
-        static uint8_t* bootrom = (uint8_t*)readFileBytes(filename);
-        for (int i = 0; i <= 0xFF; i++) {
-            RAM[i] = bootrom[i];
-        }
+}
 
-        PC = 0x00;
-    }
+// Enable interrupts
+inline void CPU::EI()
+{
+    pendingIEnable = 1;
+}
 
-    // Initialize the CPU
-    int init(const char* filename)
-    {
-        /* Retrieve the rom from the file if it exists */
-        uint8_t* newrom = (uint8_t*)readFileBytes(filename);
-        if (newrom == nullptr)
-        {
-            std::cout << "Error (File \"" << filename << "\" not found)";
-            return 1;
-        }
+// Disable interrupts
+inline void CPU::DI()
+{
+    pendingIDisable = 1;
+}
 
-        if (ROM) {
-            delete[] ROM;
-            ROM = nullptr;
-        }
+// Rotate left
+inline void CPU::rlc(uint8_t& reg)
+{
+    setCarryFlag(reg >> 7);
+    reg = (reg >> 7) | (reg << 1);
+    setZeroFlag(reg == 0);
+    setSubtractFlag(false);
+    setHalfCarryFlag(false);
+}
 
-        ROM = newrom;
+// Rotate right
+inline void CPU::rrc(uint8_t& reg)
+{
+    setCarryFlag(reg & 1);
+    reg = (reg >> 1) | (reg << 7);
+    setZeroFlag(reg == 0);
+    setSubtractFlag(false);
+    setHalfCarryFlag(false);
+}
 
-        GPU::raise();
-        hardreset();
+// Rotate left through carry
+inline void CPU::rl(uint8_t& reg)
+{
+    uint8_t temp = reg & 0x80;
+    reg = (reg << 1) | getCarry();
+    setCarryFlag(temp);
+    setZeroFlag(reg == 0);
+    setSubtractFlag(false);
+    setHalfCarryFlag(false);
+}
 
-        return 0;
-    }
+// Rotate right through carry
+inline void CPU::rr(uint8_t& reg)
+{
+    uint8_t temp = reg & 1;
+    reg = (getCarry() << 7) | (reg >> 1);
+    setCarryFlag(temp);
+    setZeroFlag(reg == 0);
+    setSubtractFlag(false);
+    setHalfCarryFlag(false);
+}
 
-    /* Initialize cartridge specific things */
-    void hardreset()
-    {
-        if (EXTERNAL_RAM) {
-            delete[] EXTERNAL_RAM;
-            EXTERNAL_RAM = nullptr;
-        }
+// Shift left into Carry
+inline void CPU::sla(uint8_t& reg)
+{
+    setCarryFlag(reg & 0x80);
+    reg <<= 1;
+    setZeroFlag(reg == 0);
+    setSubtractFlag(false);
+    setHalfCarryFlag(false);
+}
 
-        romtitle = "";
+// Shift right into Carry, keeping the sign bit
+inline void CPU::sra(uint8_t& reg)
+{
+    setCarryFlag(reg & 0x1);
+    reg = (reg & 0x80) | (reg >> 1);
+    setZeroFlag(reg == 0);
+    setSubtractFlag(false);
+    setHalfCarryFlag(false);
+}
 
-        /* Title */
-        for (int i = 0x134; i < 0x142 && ROM[i] != 0; i++)
-            romtitle += (char)ROM[i];
+inline void CPU::swap(uint8_t& reg)
+{
+    reg = (reg >> 4) | (reg << 4);
+    setZeroFlag(reg == 0);
+    setSubtractFlag(false);
+    setHalfCarryFlag(false);
+    setCarryFlag(false);
+}
 
-        /* Get cart info */
-        switch (ROM[0x147])
-        {
+// Shift right into Carry
+inline void CPU::srl(uint8_t& reg)
+{
+    setCarryFlag(reg & 1);
+    reg >>= 1;
+    setZeroFlag(reg == 0);
+    setSubtractFlag(false);
+    setHalfCarryFlag(false);
+}
 
-        case 0x01:
-            mbc = mbc1;
-            break;
+void CPU::printStatus(std::ostream& out)
+{
+    char status[96];
+    snprintf(status, sizeof(status), "PC : %4X\nSP : %4X\nAF : %4X\nBC : %4X\nDE : %4X\nHL : %4X\n",
+             PC, SP, AF(), BC(), DE(), HL());
+    out << status;
+}
 
-        case 0x03:
-            mbc = mbc1;
-            break;
-        }
+char* readFileBytes(const char *name, uint32_t* length)
+{
+    std::ifstream fl(name, std::ios::binary);
+    if (!fl) return nullptr;
+    fl.seekg(0, std::ios::end);
+    size_t len = fl.tellg();
+    if (length) *length = len;
+    char *ret = new char[len];
+    fl.seekg(0, std::ios::beg);
+    fl.read(ret, len);
+    fl.close();
+    return ret;
+}
 
-        switch(ROM[0x148])
-        {
-            case 0: mbc.rombanks = 2; break;
-            case 1: mbc.rombanks = 4; break;
-            case 2: mbc.rombanks = 8; break;
-            case 3: mbc.rombanks = 16; break;
-            case 4: mbc.rombanks = 32; break;
-            case 5: mbc.rombanks = 64; break;
-            case 6: mbc.rombanks = 128; break;
-        }
+void CPU::initBootROM(const char* filename)
+{
+    if (!bootdir) bootdir = filename;
+    if (!bootrom) bootrom = (uint8_t*)readFileBytes(filename);
+    if (!bootrom) return;
 
-        mbc.ramsize = ROM[0x149];
-        if (mbc.ramsize != 0)
-        {
-            uint32_t kb_ramsize = 0;
-            if (mbc.ramsize == 1)
-                kb_ramsize = 0x800;
-            else if (mbc.ramsize == 2)
-                kb_ramsize = 0x2000;
-            else if (mbc.ramsize == 3)
-                kb_ramsize = 0x8000;
-            else if (mbc.ramsize == 4)
-                kb_ramsize = 0x20000;
-
-            EXTERNAL_RAM = new uint8_t[kb_ramsize];
-            RAM_BANK = EXTERNAL_RAM;
-        }
+    // Overlay the boot ROM on the first page until it finishes
+    runningBootROM = true;
+    readPages[0x00] = bootrom;
 
-        reset();
+    PC = 0x00;
+}
+
+// Initialize the CPU
+int CPU::init(const char* filename)
+{
+    /* Map the rom, or share it with another instance running it */
+    std::shared_ptr<const ROMImage> image = ROMStore::load(filename);
+    if (!image)
+    {
+        std::cerr << "Error (File \"" + std::string(filename) + "\" not found)\n";
+        return 1;
     }
 
-    /* Initialize variables */
-    void reset()
+    rom = image;
+    ROM = rom->data();
+    romBanks = rom->banks();
+
+    hardreset();
+
+    return 0;
+}
+
+/* Initialize cartridge specific things */
+void CPU::hardreset()
+{
+    closeSave();
+    EXTERNAL_RAM = nullptr;
+    externalRAMSize = 0;
+
+    romtitle = "";
+
+    /* Title */
+    for (int i = 0x134; i < 0x142 && ROM[i] != 0; i++)
+        romtitle += (char)ROM[i];
+
+    /* Get cart info */
+    mbc = MBC();
+    mbc.init(ROM[0x147], ROM[0x149], gb.scheduler.now());
+
+    /* A battery keeps the RAM in the save file, followed by the clock
+       if there is one. Games write it through the page map directly */
+    bool persist = mbc.battery && !savePath.empty();
+    uint32_t clock = persist && mbc.hasRTC ? RTC::SAVE_SIZE : 0;
+    uint8_t* ram = saveRAM.open(persist ? savePath : "", mbc.ramsize + clock);
+    if (mbc.ramsize != 0)
     {
-        tasplayer.stop();
+        EXTERNAL_RAM = ram;
+        externalRAMSize = mbc.ramsize;
+    }
+    if (clock && saveRAM.stored() == saveRAM.size())
+        mbc.rtc.load(ram + mbc.ramsize, gb.scheduler.now());
+    nextFlush = std::chrono::steady_clock::now();
 
-        ienable = true;
-        halted = false;
-        haltskip = false;
-        cycles = 0;
-        divcycles = 0;
-        timercycles = 0;
-        frameticks = 0;
-
-        for (int i = 0x8000; i <= 0xFFFF; i++)
-            RAM[i] = rand();
-        for (int i = 0xA000; i < 0xC000; i++)
-            RAM[i] = 0xFF;
-        for (int i = 0xFF00; i < 0xFF80; i++)
-            RAM[i] = 0xFF;
-
-        PC = 0x0100;
-        SP = 0xFFFE;
-
-        A = 0x01;
-        F = 0xB0;
-        B = 0x00;
-        C = 0x13;
-        D = 0x00;
-        E = 0xD8;
-        H = 0x01;
-        L = 0x4D;
-        RAM[0xFF05] = 0x00;
-        RAM[0xFF06] = 0x00;
-        RAM[0xFF07] = 0x00;
-        RAM[0xFF10] = 0x80;
-        RAM[0xFF11] = 0xBF;
-        RAM[0xFF12] = 0xF3;
-        RAM[0xFF14] = 0xBF;
-        RAM[0xFF16] = 0x3F;
-        RAM[0xFF17] = 0x00;
-        RAM[0xFF19] = 0xBF;
-        RAM[0xFF1A] = 0x7F;
-        RAM[0xFF1B] = 0xFF;
-        RAM[0xFF1C] = 0x9F;
-        RAM[0xFF1E] = 0xBF;
-        RAM[0xFF20] = 0xFF;
-        RAM[0xFF21] = 0x00;
-        RAM[0xFF22] = 0x00;
-        RAM[0xFF23] = 0xBF;
-        RAM[0xFF24] = 0x77;
-        RAM[0xFF25] = 0xF3;
-        RAM[0xFF26] = 0xF1;
-        RAM[0xFF40] = 0x91;
-        RAM[0xFF42] = 0x00;
-        RAM[0xFF43] = 0x00;
-        RAM[0xFF45] = 0x00;
-        RAM[0xFF47] = 0xFC;
-        RAM[0xFF48] = 0xFF;
-        RAM[0xFF49] = 0xFF;
-        RAM[0xFF4A] = 0x00;
-        RAM[0xFF4B] = 0x00;
-        RAM[0xFFFF] = 0x00;
-
-        // Copy ROM Bank #0 into RAM
-        for(uint32_t i = 0; i < 0x4000; i++)
-            RAM[i] = ROM[i];
-
-        /* Points to ROM Bank # 1 */
-        CART_ROM = ROM + 0x4000;
-
-        initBootROM(bootdir);
+    reset();
+}
+
+void CPU::flushSave()
+{
+    if (!saveRAM.persistent())
+        return;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now < nextFlush)
+        return;
+    nextFlush = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(saveInterval));
+
+    if (mbc.hasRTC)
+        mbc.rtc.save(saveRAM.data() + mbc.ramsize, gb.scheduler.now());
+    saveRAM.flush();
+}
+
+void CPU::closeSave()
+{
+    if (saveRAM.persistent() && mbc.hasRTC)
+        mbc.rtc.save(saveRAM.data() + mbc.ramsize, gb.scheduler.now());
+    saveRAM.close();
+}
+
+/* Initialize variables */
+void CPU::reset()
+{
+    gb.tasplayer.stop();
+
+    ienable = true;
+    halted = false;
+    haltskip = false;
+    // The cycles run so far go into the scheduler's base, so now()
+    // keeps counting up for the clock
+    gb.scheduler.rebase(cycles);
+    cycles = 0;
+    frameticks = 0;
+
+    for (int i = 0x8000; i <= 0xFFFF; i++)
+        RAM[i] = noise();
+    for (int i = 0xA000; i < 0xC000; i++)
+        RAM[i] = 0xFF;
+    for (int i = 0xFF00; i < 0xFF80; i++)
+        RAM[i] = 0xFF;
+    markWritten();
+
+    PC = 0x0100;
+    SP = 0xFFFE;
+
+    A = 0x01;
+    F = 0xB0;
+    B = 0x00;
+    C = 0x13;
+    D = 0x00;
+    E = 0xD8;
+    H = 0x01;
+    L = 0x4D;
+    RAM[0xFF05] = 0x00;
+    RAM[0xFF06] = 0x00;
+    RAM[0xFF07] = 0x00;
+    RAM[0xFF10] = 0x80;
+    RAM[0xFF11] = 0xBF;
+    RAM[0xFF12] = 0xF3;
+    RAM[0xFF14] = 0xBF;
+    RAM[0xFF16] = 0x3F;
+    RAM[0xFF17] = 0x00;
+    RAM[0xFF19] = 0xBF;
+    RAM[0xFF1A] = 0x7F;
+    RAM[0xFF1B] = 0xFF;
+    RAM[0xFF1C] = 0x9F;
+    RAM[0xFF1E] = 0xBF;
+    RAM[0xFF20] = 0xFF;
+    RAM[0xFF21] = 0x00;
+    RAM[0xFF22] = 0x00;
+    RAM[0xFF23] = 0xBF;
+    RAM[0xFF24] = 0x77;
+    RAM[0xFF25] = 0xF3;
+    RAM[0xFF26] = 0xF1;
+    RAM[0xFF40] = 0x91;
+    RAM[0xFF42] = 0x00;
+    RAM[0xFF43] = 0x00;
+    RAM[0xFF45] = 0x00;
+    RAM[0xFF47] = 0xFC;
+    RAM[0xFF48] = 0xFF;
+    RAM[0xFF49] = 0xFF;
+    RAM[0xFF4A] = 0x00;
+    RAM[0xFF4B] = 0x00;
+    RAM[0xFFFF] = 0x00;
+
+    // The controller starts over with the console, its clock runs on
+    MBC cart;
+    cart.init(ROM[0x147], ROM[0x149], gb.scheduler.now());
+    cart.rombanks = romBanks;
+    cart.rtc = mbc.rtc;
+    mbc = cart;
+
+    runningBootROM = false;
+    initMemoryMap();
+    initBootROM(bootdir);
+    gb.scheduler.reset();
+    gb.timer.restore(0);
+}
+
+void CPU::saveState(StateWriter& state)
+{
+    state.put64(rom ? rom->hash() : 0);
+    state.put32(externalRAMSize);
+
+    state.put8(A); state.put8(F);
+    state.put8(B); state.put8(C);
+    state.put8(D); state.put8(E);
+    state.put8(H); state.put8(L);
+    state.put16(SP);
+    state.put16(PC);
+
+    state.putBool(runningBootROM);
+    state.putBool(accessOAM);
+    state.putBool(accessVRAM);
+    state.putBool(ienable);
+    state.put32(pendingIEnable);
+    state.put32(pendingIDisable);
+    state.putBool(halted);
+    state.putBool(haltskip);
+    state.put32(cycles);
+    state.put32(frameticks);
+    state.put32(noiseState);
+    state.putMemory(RAM, sizeof(RAM));
+
+    state.put8(mbc.mode);
+    state.putBool(mbc.enableram);
+    state.put16(mbc.rombank0);
+    state.put16(mbc.rombank);
+    state.put8(mbc.rambank);
+    state.putBool(mbc.ramMapped);
+    state.put8(mbc.bank1);
+    state.put8(mbc.bank2);
+    state.put8(mbc.rtcSelect);
+    state.putBytes(mbc.rtc.regs, 5);
+    state.putBytes(mbc.rtc.latched, 5);
+    state.put64(mbc.rtc.synced);
+    state.put32(mbc.rtc.subsecond);
+    state.put8(mbc.rtc.latch);
+    state.putMemory(EXTERNAL_RAM, externalRAMSize);
+}
+
+bool CPU::matchesState(StateReader& state)
+{
+    return state.get64() == (rom ? rom->hash() : 0) && state.get32() == externalRAMSize;
+}
+
+bool CPU::loadState(StateReader& state)
+{
+    if (!matchesState(state))
+        return false;
+
+    A = state.get8(); F = state.get8();
+    B = state.get8(); C = state.get8();
+    D = state.get8(); E = state.get8();
+    H = state.get8(); L = state.get8();
+    SP = state.get16();
+    PC = state.get16();
+
+    runningBootROM = state.getBool() && bootrom;
+    accessOAM = state.getBool();
+    accessVRAM = state.getBool();
+    ienable = state.getBool();
+    pendingIEnable = state.get32();
+    pendingIDisable = state.get32();
+    halted = state.getBool();
+    haltskip = state.getBool();
+    cycles = state.get32();
+    frameticks = state.get32();
+    noiseState = state.get32();
+    state.getMemory(RAM, sizeof(RAM));
+
+    mbc.mode = state.get8();
+    mbc.enableram = state.getBool();
+    mbc.rombank0 = state.get16();
+    mbc.rombank = state.get16();
+    mbc.rambank = state.get8();
+    mbc.ramMapped = state.getBool();
+    mbc.bank1 = state.get8();
+    mbc.bank2 = state.get8();
+    mbc.rtcSelect = state.get8();
+    state.getBytes(mbc.rtc.regs, 5);
+    state.getBytes(mbc.rtc.latched, 5);
+    mbc.rtc.synced = state.get64();
+    mbc.rtc.subsecond = state.get32();
+    mbc.rtc.latch = state.get8();
+    state.getMemory(EXTERNAL_RAM, externalRAMSize);
+
+    // A snapshot restores memory itself, page by page
+    if (state.hasMemory())
+        markWritten();
+
+    // Whatever was being run or watched belongs to the old state
+    probe.active = false;
+    prepaid = 0;
+    return true;
+}
+
+/*
+    Opcode tables
+
+    Both instruction tables are generated at compile time from the layout
+    of the opcode matrix. An opcode splits into the fields
+
+        x = bits 7-6, y = bits 5-3, z = bits 2-0, p = y >> 1, q = y & 1
+
+    where y and z select one of B, C, D, E, H, L, (HL), A and p selects a
+    register pair. Every handler is a template instantiated for a single
+    opcode, so the operand decoding folds away and each table entry is a
+    straight-line function. Cycle counts come from the same description.
+*/
+
+constexpr uint8_t opX(uint8_t op) { return op >> 6; }
+constexpr uint8_t opY(uint8_t op) { return (op >> 3) & 7; }
+constexpr uint8_t opZ(uint8_t op) { return op & 7; }
+constexpr uint8_t opP(uint8_t op) { return (op >> 4) & 3; }
+constexpr uint8_t opQ(uint8_t op) { return (op >> 3) & 1; }
+
+// 8-bit register operand (r = 6 is (HL))
+template <uint8_t r>
+inline uint8_t& CPU::reg()
+{
+    static_assert(r != 6 && r < 8, "not a register operand");
+    if constexpr (r == 0) return B;
+    else if constexpr (r == 1) return C;
+    else if constexpr (r == 2) return D;
+    else if constexpr (r == 3) return E;
+    else if constexpr (r == 4) return H;
+    else if constexpr (r == 5) return L;
+    else return A;
+}
+
+template <uint8_t r, typename Fetch>
+inline uint8_t CPU::getOperand()
+{
+    if constexpr (r == 6) return Fetch::read(*this, HL());
+    else return reg<r>();
+}
+
+template <uint8_t r, typename Fetch>
+inline void CPU::setOperand(uint8_t value)
+{
+    if constexpr (r == 6) Fetch::write(*this, HL(), value);
+    else reg<r>() = value;
+}
+
+// Read, modify and write back an 8-bit operand
+template <uint8_t r, void (CPU::*func)(uint8_t&), typename Fetch>
+inline void CPU::modifyOperand()
+{
+    if constexpr (r == 6)
+    {
+        uint16_t loc = HL();
+        uint8_t value = Fetch::read(*this, loc);
+        (this->*func)(value);
+        Fetch::write(*this, loc, value);
     }
+    else (this->*func)(reg<r>());
+}
+
+// Register pair BC, DE, HL, SP
+template <uint8_t p>
+inline uint16_t CPU::getPair()
+{
+    if constexpr (p == 0) return BC();
+    else if constexpr (p == 1) return DE();
+    else if constexpr (p == 2) return HL();
+    else return SP;
+}
+
+template <uint8_t p>
+inline void CPU::setPair(uint16_t word)
+{
+    if constexpr (p == 0) { B = word >> 8; C = word; }
+    else if constexpr (p == 1) { D = word >> 8; E = word; }
+    else if constexpr (p == 2) setHL(word);
+    else SP = word;
+}
+
+// Register pair BC, DE, HL, AF (PUSH / POP)
+template <uint8_t p>
+inline uint16_t CPU::getStackPair()
+{
+    if constexpr (p == 3) return AF();
+    else return getPair<p>();
+}
 
-    void setBank(uint8_t bank)
+template <uint8_t p>
+inline void CPU::setStackPair(uint16_t word)
+{
+    if constexpr (p == 3) { A = word >> 8; F = word & 0xF0; }
+    else setPair<p>(word);
+}
+
+// Branch condition NZ, Z, NC, C
+template <uint8_t cc>
+inline bool CPU::condition()
+{
+    if constexpr (cc == 0) return !getZero();
+    else if constexpr (cc == 1) return getZero();
+    else if constexpr (cc == 2) return !getCarry();
+    else return getCarry();
+}
+
+// ADD, ADC, SUB, SBC, AND, XOR, OR, CP
+template <uint8_t y>
+inline void CPU::alu(uint8_t value)
+{
+    if constexpr (y == 0) add(value);
+    else if constexpr (y == 1) adc(value);
+    else if constexpr (y == 2) sub(value);
+    else if constexpr (y == 3) sbc(value);
+    else if constexpr (y == 7) cp(value);
+    else
     {
-        if (bank == 0) bank = 1;
-        currentROMBank = bank;
-        if (bank > mbc.rombanks)
-            std::cout << "Error: RAM Bank #" << (int)bank << " does not exist!" << std::endl;
-        CART_ROM = ROM + 0x4000 * bank;
+        if constexpr (y == 4) A &= value;
+        else if constexpr (y == 5) A ^= value;
+        else A |= value;
+        setZeroFlag(A == 0);
+        setSubtractFlag(false);
+        setHalfCarryFlag(y == 4);
+        setCarryFlag(false);
     }
+}
 
-    void prefixCB();
+// RLC, RRC, RL, RR, SLA, SRA, SWAP, SRL
+template <uint8_t y>
+inline void CPU::rotate(uint8_t& reg)
+{
+    if constexpr (y == 0) rlc(reg);
+    else if constexpr (y == 1) rrc(reg);
+    else if constexpr (y == 2) rl(reg);
+    else if constexpr (y == 3) rr(reg);
+    else if constexpr (y == 4) sla(reg);
+    else if constexpr (y == 5) sra(reg);
+    else if constexpr (y == 6) swap(reg);
+    else srl(reg);
+}
 
+template <uint8_t bit>
+inline void CPU::resetBit(uint8_t& reg) { reg &= ~(1 << bit); }
 
-    // Execute a single instructiOn
-    void step()
+template <uint8_t bit>
+inline void CPU::setBit(uint8_t& reg) { reg |= (1 << bit); }
+
+void CPU::invalidOpcode(uint8_t opcode)
+{
+    // Whole, in one write, as other instances may be reporting too
+    std::ostringstream report;
+    report << "Error (Invalid Opcode): " << std::hex << (int)opcode << "\n";
+    printStatus(report);
+    std::cerr << report.str();
+}
+
+// Base cycles of an unprefixed opcode, before any taken branch
+constexpr uint8_t opcodeCycles(uint8_t op)
+{
+    const uint8_t y = opY(op), z = opZ(op), p = opP(op), q = opQ(op);
+    switch (opX(op))
     {
-        if (runningBootROM && PC == 0x100)
+    case 0:
+        switch (z)
         {
-            runningBootROM = false;
-            for (int i = 0; i <= 0xFF; i++)
-                RAM[i] = ROM[i];
-            return;
+        case 0: return y == 1 ? 20 : y == 3 ? 12 : y >= 4 ? 8 : 4;
+        case 1: return q ? 8 : 12;
+        case 2: case 3: return 8;
+        case 4: case 5: return y == 6 ? 12 : 4;
+        case 6: return y == 6 ? 12 : 8;
+        default: return 4;
         }
+    case 1: return (op != 0x76 && (y == 6 || z == 6)) ? 8 : 4;
+    case 2: return z == 6 ? 8 : 4;
+    default:
+        switch (z)
+        {
+        case 0: return y < 4 ? 8 : y == 5 ? 16 : 12;
+        case 1: return !q ? 12 : p == 2 ? 4 : p == 3 ? 8 : 16;
+        case 2: return y < 4 ? 12 : (y == 4 || y == 6) ? 8 : 16;
+        case 3: return y == 0 ? 16 : 4;
+        case 4: return 12;
+        case 5: return q ? 24 : 16;
+        case 6: return 8;
+        default: return 16;
+        }
+    }
+}
 
-        uint8_t temp;
-        uint16_t temp16;
-
-        uint8_t opcode = getImmediateByte();
-
-        // If interrupts are disabled and a HALT
-        // is executed, then stop updating the PC
-        // for ONE instruction.
-        if (haltskip)
+// Length of an unprefixed opcode, with its operands
+constexpr uint8_t opcodeLength(uint8_t op)
+{
+    const uint8_t y = opY(op), z = opZ(op), p = opP(op), q = opQ(op);
+    switch (opX(op))
+    {
+    case 0:
+        if (z == 0) return y == 1 ? 3 : y >= 3 ? 2 : 1;
+        if (z == 1) return q ? 1 : 3;
+        return z == 6 ? 2 : 1;
+    case 3:
+        switch (z)
         {
-            PC--;
-            haltskip = false;
+        case 0: return y < 4 ? 1 : 2;
+        case 2: return (y < 4 || y == 5 || y == 7) ? 3 : 1;
+        case 3: return y == 0 ? 3 : y == 1 ? 2 : 1;
+        case 4: return y < 4 ? 3 : 1;
+        case 5: return (q && p == 0) ? 3 : 1;
+        case 6: return 2;
+        default: return 1;
         }
+    default: return 1;
+    }
+}
 
-        switch(opcode)
+// Whether an opcode can leave straight-line code
+constexpr bool endsBlock(uint8_t op)
+{
+    const uint8_t y = opY(op), z = opZ(op), p = opP(op), q = opQ(op);
+    switch (opX(op))
+    {
+    case 0: return z == 0 && y >= 2;    // STOP, JR
+    case 1: return op == 0x76;          // HALT
+    case 2: return false;
+    default:
+        switch (z)
         {
-            /* NOP */
-            case 0x00: tick(4); break;
-
-            /* LD BC, d16 */
-            case 0x01:
-                C = getImmediateByte();
-                B = getImmediateByte();
-                tick(12);
-                break;
-
-            /* LD (BC), A */
-            case 0x02:
-                write(BC(), A);
-                tick(8);
-                break;
-
-            /* INC BC */
-            case 0x03:
-                incPair(B, C);
-                tick(8);
-                break;
-
-            /* INC B */
-            case 0x04:
-                inc(B);
-                tick(4);
-                break;
+        case 0: return y < 4;           // RET cc
+        case 1: return q && p != 3;     // RET, RETI, JP (HL)
+        case 2: return y < 4;           // JP cc
+        case 3: return y != 1 && y < 6; // JP, invalid
+        case 5: return q;               // CALL, invalid
+        case 6: return false;
+        default: return true;           // CALL cc, RST
+        }
+    }
+}
 
-            /* DEC B */
-            case 0x05:
-                dec(B);
-                tick(4);
-                break;
+// Cycles of a CB opcode, on top of the 4 for the prefix itself
+constexpr uint8_t prefixCBCycles(uint8_t op)
+{
+    if (opZ(op) != 6) return 4;
+    return opX(op) == 1 ? 8 : 12;
+}
 
-            /* LD B, d8 */
-            case 0x06:
-                B = getImmediateByte();
-                tick(8);
-                break;
+// Unprefixed instruction
+template <uint8_t op, typename Fetch>
+void CPU::instruction()
+{
+    constexpr uint8_t x = opX(op), y = opY(op), z = opZ(op), p = opP(op), q = opQ(op);
 
+    if constexpr (x == 0)
+    {
+        if constexpr (z == 0)
+        {
+            /* NOP */
+            if constexpr (y == 0) { }
+            /* LD (a16), SP */
+            else if constexpr (y == 1) writeWord<Fetch>(Fetch::word(*this), SP);
+            /* STOP 0 */
+            else if constexpr (y == 2) stop();
+            /* JR r8 */
+            else if constexpr (y == 3)
+            {
+                int8_t offset = Fetch::byte(*this);
+                PC += (int16_t)offset;
+            }
+            /* JR cc, r8 */
+            else JRIF<Fetch>(condition<y - 4>());
+        }
+        else if constexpr (z == 1)
+        {
+            /* LD rr, d16 */
+            if constexpr (q == 0) setPair<p>(Fetch::word(*this));
+            /* ADD HL, rr */
+            else addWord(getPair<p>());
+        }
+        else if constexpr (z == 2)
+        {
+            /* LD (BC), A / LD (DE), A / LD (HL+), A / LD (HL-), A */
+            constexpr uint8_t pair = p == 3 ? 2 : p;
+            if constexpr (q == 0) Fetch::write(*this, getPair<pair>(), A);
+            /* LD A, (BC) / LD A, (DE) / LD A, (HL+) / LD A, (HL-) */
+            else A = Fetch::read(*this, getPair<pair>());
+
+            if constexpr (p == 2) incPair(H, L);
+            else if constexpr (p == 3) decPair(H, L);
+        }
+        /* INC rr / DEC rr */
+        else if constexpr (z == 3) setPair<p>(getPair<p>() + (q ? -1 : 1));
+        /* INC x */
+        else if constexpr (z == 4) modifyOperand<y, &CPU::inc, Fetch>();
+        /* DEC x */
+        else if constexpr (z == 5) modifyOperand<y, &CPU::dec, Fetch>();
+        /* LD x, d8 */
+        else if constexpr (z == 6) setOperand<y, Fetch>(Fetch::byte(*this));
+        else
+        {
             /* RLCA */
-            case 0x07:
+            if constexpr (y == 0)
+            {
                 setCarryFlag(A >> 7);
                 A = (A >> 7) | (A << 1);
-                setZeroFlag(false);
-                setSubtractFlag(false);
-                setHalfCarryFlag(false);
-                tick(4);
-                break;
-
-            /* LD (a16), SP */
-            case 0x08:
-                writeWord(getImmediateWord(), SP);
-                tick(20);
-                break;
-
-            /* ADD HL, BC */
-            case 0x09:
-                addWord(BC());
-                tick(8);
-                break;
-
-            /* LD A, (BC) */
-            case 0x0A:
-                A = read(BC());
-                tick(8);
-                break;
-
-            /* DEC BC */
-            case 0x0B:
-                decPair(B, C);
-                tick(8);
-                break;
-
-            /* INC C */
-            case 0x0C:
-                inc(C);
-                tick(4);
-                break;
-
-            /* DEC C */
-            case 0x0D:
-                dec(C);
-                tick(4);
-                break;
-
-            /* LD C, d8 */
-            case 0x0E:
-                C = getImmediateByte();
-                tick(8);
-                break;
-
+            }
             /* RRCA */
-            case 0x0F:
+            else if constexpr (y == 1)
+            {
                 setCarryFlag(A & 1);
                 A = (A << 7) | (A >> 1);
-                setZeroFlag(false);
-                setSubtractFlag(false);
-                setHalfCarryFlag(false);
-                tick(4);
-                break;
-
-            /* STOP 0 */
-            case 0x10:
-                stop();
-                tick(4);
-                break;
-
-            /* LD DE, d16 */
-            case 0x11:
-                E = getImmediateByte();
-                D = getImmediateByte();
-                tick(12);
-                break;
-
-            /* LD (DE), A */
-            case 0x12:
-                write(DE(), A);
-                tick(8);
-                break;
-
-            /* INC DE */
-            case 0x13:
-                incPair(D, E);
-                tick(8);
-                break;
-
-            /* INC D */
-            case 0x14:
-                inc(D);
-                tick(4);
-                break;
-
-            /* DEC D */
-            case 0x15:
-                dec(D);
-                tick(4);
-                break;
-
-            /* LD D, d8 */
-            case 0x16:
-                D = getImmediateByte();
-                tick(8);
-                break;
-
+            }
             /* RLA */
-            case 0x17:
-                temp = A >> 7;
+            else if constexpr (y == 2)
+            {
+                uint8_t temp = A >> 7;
                 A = getCarry() | (A << 1);
                 setCarryFlag(temp);
-                setZeroFlag(false);
-                setSubtractFlag(false);
-                setHalfCarryFlag(false);
-                tick(4);
-                break;
-
-            /* JR r8 */
-            case 0x18:
-                temp = getImmediateByte();
-                PC += (int16_t)int8_t(temp);
-                tick(12);
-                break;
-
-            /* ADD HL, DE */
-            case 0x19:
-                addWord(DE());
-                tick(8);
-                break;
-
-            /* LD A, (DE) */
-            case 0x1A:
-                A = read(DE());
-                tick(8);
-                break;
-
-            /* DEC DE */
-            case 0x1B:
-                decPair(D, E);
-                tick(8);
-                break;
-
-            /* INC E */
-            case 0x1C:
-                inc(E);
-                tick(4);
-                break;
-
-            /* DEC E */
-            case 0x1D:
-                dec(E);
-                tick(4);
-                break;
-
-            /* LD E, d8 */
-            case 0x1E:
-                E = getImmediateByte();
-                tick(8);
-                break;
-
+            }
             /* RRA */
-            case 0x1F:
-                temp = A & 1;
+            else if constexpr (y == 3)
+            {
+                uint8_t temp = A & 1;
                 A = ((int)getCarry() << 7) | (A >> 1);
                 setCarryFlag(temp);
-                setZeroFlag(false);
-                setSubtractFlag(false);
-                setHalfCarryFlag(false);
-                tick(4);
-                break;
-
-            /* JR NZ, r8 */
-            case 0x20:
-                JRIF(!getZero());
-                tick(8);
-                break;
-
-            /* LD HL, d16 */
-            case 0x21:
-                L = getImmediateByte();
-                H = getImmediateByte();
-                tick(12);
-                break;
-
-            /* LD (HL+), A */
-            case 0x22:
-                write(HL(), A);
-                incPair(H, L);
-                tick(8);
-                break;
-
-            /* INC HL */
-            case 0x23:
-                incPair(H, L);
-                tick(8);
-                break;
-
-            /* INC H */
-            case 0x24:
-                inc(H);
-                tick(4);
-                break;
-
-            /* DEC H */
-            case 0x25:
-                dec(H);
-                tick(4);
-                break;
-
-            /* LD H, d8 */
-            case 0x26:
-                H = getImmediateByte();
-                tick(8);
-                break;
-
+            }
             /* DAA */
-            case 0x27:
-                temp16 = A;
+            else if constexpr (y == 4)
+            {
+                uint16_t temp16 = A;
                 if (!getSubtract())
                 {
                     if ((temp16 & 0x0F) > 0x09 || getHalfCarry()) temp16 += 0x06;
@@ -1264,1560 +1308,787 @@ namespace CPU
                 setZeroFlag(temp16 == 0);
                 setHalfCarryFlag(false);
                 A = temp16;
-                tick(4);
-                break;
-
-            /* JR Z, r8 */
-            case 0x28:
-                JRIF(getZero());
-                tick(8);
-                break;
-
-            /* ADD HL, HL */
-            case 0x29:
-                addWord(HL());
-                tick(8);
-                break;
-
-            /* LD A, (HL+) */
-            case 0x2A:
-                A = read(HL());
-                incPair(H, L);
-                tick(8);
-                break;
-
-            /* DEC HL */
-            case 0x2B:
-                decPair(H, L);
-                tick(8);
-                break;
-
-            /* INC L */
-            case 0x2C:
-                inc(L);
-                tick(4);
-                break;
-
-            /* DEC L */
-            case 0x2D:
-                dec(L);
-                tick(4);
-                break;
-
-            /* LD L, d8 */
-            case 0x2E:
-                L = getImmediateByte();
-                tick(8);
-                break;
-
+                return;
+            }
             /* CPL */
-            case 0x2F:
+            else if constexpr (y == 5)
+            {
                 A = ~A;
                 setSubtractFlag(true);
                 setHalfCarryFlag(true);
-                tick(4);
-                break;
-
-            /* JR NC, r8 */
-            case 0x30:
-                JRIF(!getCarry());
-                tick(8);
-                break;
-
-            /* LD SP, d16 */
-            case 0x31:
-                SP = getImmediateWord();
-                tick(12);
-                break;
-
-            /* LD (HL-), A */
-            case 0x32:
-                write(HL(), A);
-                decPair(H, L);
-                tick(8);
-                break;
-
-            /* INC SP */
-            case 0x33:
-                SP++;
-                tick(8);
-                break;
-
-            /* INC (HL) */
-            case 0x34:
-                temp16 = HL();
-                temp = read(temp16);
-                inc(temp);
-                write(temp16, temp);
-                tick(12);
-                break;
-
-            /* DEC (HL) */
-            case 0x35:
-                temp16 = HL();
-                temp = read(temp16);
-                dec(temp);
-                write(temp16, temp);
-                tick(12);
-                break;
-
-            /* LD (HL), d8 */
-            case 0x36:
-                write(HL(), getImmediateByte());
-                tick(12);
-                break;
-
+                return;
+            }
             /* SCF */
-            case 0x37:
-                setCarryFlag(true);
-                setSubtractFlag(false);
-                setHalfCarryFlag(false);
-                tick(4);
-                break;
-
-            /* JR C, r8 */
-            case 0x38:
-                JRIF(getCarry());
-                tick(8);
-                break;
-
-            /* ADD HL, SP */
-            case 0x39:
-                addWord(SP);
-                tick(8);
-                break;
-
-            /* LD A, (HL-) */
-            case 0x3A:
-                A = read(HL());
-                decPair(H, L);
-                tick(8);
-                break;
-
-            /* DEC SP */
-            case 0x3B:
-                SP--;
-                tick(8);
-                break;
-
-            /* INC A */
-            case 0x3C:
-                inc(A);
-                tick(4);
-                break;
-
-            /* DEC A */
-            case 0x3D:
-                dec(A);
-                tick(4);
-                break;
-
-            /* LD A, d8 */
-            case 0x3E:
-                A = getImmediateByte();
-                tick(8);
-                break;
-
+            else if constexpr (y == 6) setCarryFlag(true);
             /* CCF */
-            case 0x3F:
-                setCarryFlag(!getCarry());
-                setSubtractFlag(false);
-                setHalfCarryFlag(false);
-                tick(4);
-                break;
-
-            /* LD B, x */
-            case 0x40: case 0x41: case 0x42: case 0x43:
-            case 0x44: case 0x45: case 0x46: case 0x47:
-                B = getReg(opcode & 7);
-                tick(4);
-                break;
-
-            /* LD C, x */
-            case 0x48: case 0x49: case 0x4A: case 0x4B:
-            case 0x4C: case 0x4D: case 0x4E: case 0x4F:
-                C = getReg(opcode & 7);
-                tick(4);
-                break;
-
-            /* LD D, x */
-            case 0x50: case 0x51: case 0x52: case 0x53:
-            case 0x54: case 0x55: case 0x56: case 0x57:
-                D = getReg(opcode & 7);
-                tick(4);
-                break;
-
-            /* LD E, x */
-            case 0x58: case 0x59: case 0x5A: case 0x5B:
-            case 0x5C: case 0x5D: case 0x5E: case 0x5F:
-                E = getReg(opcode & 7);
-                tick(4);
-                break;
-
-            /* LD H, x */
-            case 0x60: case 0x61: case 0x62: case 0x63:
-            case 0x64: case 0x65: case 0x66: case 0x67:
-                H = getReg(opcode & 7);
-                tick(4);
-                break;
-
-            /* LD L, x */
-            case 0x68: case 0x69: case 0x6A: case 0x6B:
-            case 0x6C: case 0x6D: case 0x6E: case 0x6F:
-                L = getReg(opcode & 7);
-                tick(4);
-                break;
-
-            /* LD (HL), x */
-            case 0x70: case 0x71: case 0x72: case 0x73:
-            case 0x74: case 0x75: case 0x77:
-                write(HL(), getReg(opcode & 7));
-                tick(8);
-                break;
-
-            /* HALT */
-            case 0x76:
-                if (ienable)
-                    halted = true;
-                else
-                    haltskip = true;
-                tick(4);
-                break;
-
-            /* LD A, x */
-            case 0x78: case 0x79: case 0x7A: case 0x7B:
-            case 0x7C: case 0x7D: case 0x7E: case 0x7F:
-                A = getReg(opcode & 7);
-                tick(4);
-                break;
-
-            /* ADD A, x */
-            case 0x80: case 0x81: case 0x82: case 0x83:
-            case 0x84: case 0x85: case 0x86: case 0x87:
-                add(getReg(opcode & 7));
-                tick(4);
-                break;
-
-            /* ADC A, x */
-            case 0x88: case 0x89: case 0x8A: case 0x8B:
-            case 0x8C: case 0x8D: case 0x8E: case 0x8F:
-                adc(getReg(opcode & 7));
-                tick(4);
-                break;
-
-            /* SUB x */
-            case 0x90: case 0x91: case 0x92: case 0x93:
-            case 0x94: case 0x95: case 0x96: case 0x97:
-                sub(getReg(opcode & 7));
-                tick(4);
-                break;
-
-            /* SBC x */
-            case 0x98: case 0x99: case 0x9A: case 0x9B:
-            case 0x9C: case 0x9D: case 0x9E: case 0x9F:
-                sbc(getReg(opcode & 7));
-                tick(4);
-                break;
-
-            /* AND x */
-            case 0xA0: case 0xA1: case 0xA2: case 0xA3:
-            case 0xA4: case 0xA5: case 0xA6: case 0xA7:
-                A &= getReg(opcode & 7);
-                setZeroFlag(A == 0);
-                setSubtractFlag(false);
-                setHalfCarryFlag(true);
-                setCarryFlag(false);
-                tick(4);
-                break;
-
-            /* XOR x */
-            case 0xA8: case 0xA9: case 0xAA: case 0xAB:
-            case 0xAC: case 0xAD: case 0xAE: case 0xAF:
-                A ^= getReg(opcode & 7);
-                setZeroFlag(A == 0);
-                setSubtractFlag(false);
-                setHalfCarryFlag(false);
-                setCarryFlag(false);
-                tick(4);
-                break;
-
-            /* OR x */
-            case 0xB0: case 0xB1: case 0xB2: case 0xB3:
-            case 0xB4: case 0xB5: case 0xB6: case 0xB7:
-                A |= getReg(opcode & 7);
-                setZeroFlag(A == 0);
-                setSubtractFlag(false);
-                setHalfCarryFlag(false);
-                setCarryFlag(false);
-                tick(4);
-                break;
-
-            /* CP x */
-            case 0xB8: case 0xB9: case 0xBA: case 0xBB:
-            case 0xBC: case 0xBD: case 0xBE: case 0xBF:
-                cp(getReg(opcode & 7));
-                tick(4);
-                break;
-
-            /* RET NZ */
-            case 0xC0:
-                RETIF(!getZero());
-                tick(8);
-                break;
-
-            /* POP BC */
-            case 0xC1:
-                temp16 = popWord();
-                B = temp16 >> 8;
-                C = temp16;
-                tick(12);
-                break;
-
-            /* JP NZ, a16 */
-            case 0xC2:
-                JPIF(!getZero());
-                tick(12);
-                break;
-
-            /* JP a16 */
-            case 0xC3:
-                PC = getImmediateWord();
-                tick(16);
-                break;
-
-            /* CALL NZ, a16 */
-            case 0xC4:
-                CALLIF(!getZero());
-                tick(12);
-                break;
-
-            /* PUSH BC */
-            case 0xC5:
-                pushWord(BC());
-                tick(16);
-                break;
-
-            /* ADD A, d8 */
-            case 0xC6:
-                add(getImmediateByte());
-                tick(8);
-                break;
-
-            /* RST 00H */
-            case 0xC7:
-                RST(0x00);
-                tick(16);
-                break;
-
-            /* RET Z */
-            case 0xC8:
-                RETIF(getZero());
-                tick(8);
-                break;
-
-            /* RET */
-            case 0xC9:
-                PC = popWord();
-                tick(16);
-                break;
-
-            /* JP Z, a16 */
-            case 0xCA:
-                JPIF(getZero());
-                tick(12);
-                break;
-
-            /* PREFIX CB */
-            case 0xCB:
-                prefixCB();
-                tick(4);
-                return;
-
-            /* CALL Z, a16 */
-            case 0xCC:
-                CALLIF(getZero());
-                tick(12);
-                break;
-
-            /* CALL a16 */
-            case 0xCD:
-                pushWord(PC + 2);
-                PC = getImmediateWord();
-                tick(24);
-                break;
-
-            /* ADC A, d8 */
-            case 0xCE:
-                adc(getImmediateByte());
-                tick(8);
-                break;
-
-            /* RST 08H */
-            case 0xCF:
-                RST(8);
-                tick(16);
-                break;
-
-            /* RET NC */
-            case 0xD0:
-                RETIF(!getCarry());
-                tick(8);
-                break;
-
-            /* POP DE */
-            case 0xD1:
-                temp16 = popWord();
-                D = temp16 >> 8;
-                E = temp16;
-                tick(12);
-                break;
-
-            /* JP NC, a16 */
-            case 0xD2:
-                JPIF(!getCarry());
-                tick(12);
-                break;
-
-            /* CALL NC, 16 */
-            case 0xD4:
-                CALLIF(!getCarry());
-                tick(12);
-                break;
-
-            /* PUSH DE */
-            case 0xD5:
-                pushWord(DE());
-                tick(16);
-                break;
-
-            /* SUB d8 */
-            case 0xD6:
-                sub(getImmediateByte());
-                tick(8);
-                break;
-
-            /* RST 10H */
-            case 0xD7:
-                RST(0x10);
-                tick(16);
-                break;
-
-            /* RET C */
-            case 0xD8:
-                RETIF(getCarry());
-                tick(8);
-                break;
-
-            /* RETI */
-            case 0xD9:
-                PC = popWord();
-                ienable = true;
-                tick(16);
-                break;
-
-            /* JP C, a16 */
-            case 0xDA:
-                JPIF(getCarry());
-                tick(12);
-                break;
-
-            /* CALL C, a16 */
-            case 0xDC:
-                CALLIF(getCarry());
-                tick(12);
-                break;
-
-            /* SBC A, d8 */
-            case 0xDE:
-                sbc(getImmediateByte());
-                tick(8);
-                break;
-
-            /* RST 18H */
-            case 0xDF:
-                RST(0x18);
-                tick(16);
-                break;
+            else setCarryFlag(!getCarry());
 
+            if constexpr (y < 4) setZeroFlag(false);
+            setSubtractFlag(false);
+            setHalfCarryFlag(false);
+        }
+    }
+    else if constexpr (x == 1)
+    {
+        /* HALT */
+        if constexpr (op == 0x76)
+        {
+            if (ienable)
+                halted = true;
+            else
+                haltskip = true;
+        }
+        /* LD x, x */
+        else setOperand<y, Fetch>(getOperand<z, Fetch>());
+    }
+    /* ALU A, x */
+    else if constexpr (x == 2) alu<y>(getOperand<z, Fetch>());
+    else
+    {
+        if constexpr (z == 0)
+        {
+            /* RET cc */
+            if constexpr (y < 4) RETIF<Fetch>(condition<y>());
             /* LDH (a8), A */
-            case 0xE0:
-                write(0xFF00 + getImmediateByte(), A);
-                tick(12);
-                break;
-
-            /* POP HL */
-            case 0xE1:
-                temp16 = popWord();
-                H = temp16 >> 8;
-                L = temp16;
-                tick(12);
-                break;
-
-            /* LD (C), A */
-            case 0xE2:
-                write(0xFF00 + C, A);
-                tick(8);
-                break;
-
-            /* PUSH HL */
-            case 0xE5:
-                pushWord(HL());
-                tick(16);
-                break;
-
-            /* AND d8 */
-            case 0xE6:
-                A &= getImmediateByte();
-                setZeroFlag(A == 0);
-                setSubtractFlag(false);
-                setHalfCarryFlag(true);
-                setCarryFlag(false);
-                tick(8);
-                break;
-
-            /* RST 20H */
-            case 0xE7:
-                RST(0x20);
-                tick(16);
-                break;
-
-            /* ADD SP, r8 */
-            case 0xE8:
-                temp16 = int16_t(int8_t(getImmediateByte()));
+            else if constexpr (y == 4) Fetch::write(*this, 0xFF00 + Fetch::byte(*this), A);
+            /* LDH A, (a8) */
+            else if constexpr (y == 6) A = Fetch::read(*this, 0xFF00 + Fetch::byte(*this));
+            /* ADD SP, r8 / LD HL, SP + r8 */
+            else
+            {
+                uint16_t temp16 = int16_t(int8_t(Fetch::byte(*this)));
                 setZeroFlag(false);
                 setSubtractFlag(false);
                 setHalfCarryFlag(((SP & 0x0F) + (temp16 & 0x0F)) > 0x0F);
                 setCarryFlag(((SP & 0xFF) + (temp16 & 0xFF)) > 0xFF);
-                SP += temp16;
-                tick(16);
-                break;
-
+                if constexpr (y == 5) SP += temp16;
+                else setHL(SP + temp16);
+            }
+        }
+        else if constexpr (z == 1)
+        {
+            /* POP rr */
+            if constexpr (q == 0) setStackPair<p>(popWord<Fetch>());
+            /* RET */
+            else if constexpr (p == 0) PC = popWord<Fetch>();
+            /* RETI */
+            else if constexpr (p == 1)
+            {
+                PC = popWord<Fetch>();
+                ienable = true;
+            }
             /* JP (HL) */
-            case 0xE9:
-                PC = HL();
-                tick(4);
-                break;
-
-            /* LD (a16), A */
-            case 0xEA:
-                write(getImmediateWord(), A);
-                tick(16);
-                break;
-
-            /* XOR d8 */
-            case 0xEE:
-                A ^= getImmediateByte();
-                setZeroFlag(A == 0);
-                setSubtractFlag(false);
-                setHalfCarryFlag(false);
-                setCarryFlag(false);
-                tick(8);
-                break;
-
-            /* RST 28H */
-            case 0xEF:
-                RST(0x28);
-                tick(16);
-                break;
-
-            /* LDH A, (a8) */
-            case 0xF0:
-                A = read(0xFF00 + getImmediateByte());
-                tick(12);
-                break;
-
-            /* POP AF */
-            case 0xF1:
-                temp16 = popWord();
-                A = temp16 >> 8;
-                F = temp16 & 0xF0;
-                tick(12);
-                break;
-
-            /* LD A, (C) */
-            case 0xF2:
-                A = read(0xFF00 + C);
-                tick(8);
-                break;
-
-            /* DI */
-            case 0xF3:
-                DI();
-                break;
-
-            /* PUSH AF */
-            case 0xF5:
-                pushWord(AF());
-                tick(16);
-                break;
-
-            /* OR d8 */
-            case 0xF6:
-                A |= getImmediateByte();
-                setZeroFlag(A == 0);
-                setSubtractFlag(false);
-                setHalfCarryFlag(false);
-                setCarryFlag(false);
-                tick(8);
-                break;
-
-            /* RST 30H */
-            case 0xF7:
-                RST(0x30);
-                tick(16);
-                break;
-
-            /* LD HL, SP + r8 */
-            case 0xF8:
-                temp16 = int16_t(int8_t(getImmediateByte()));
-                setHL(SP + temp16);
-                setHalfCarryFlag(((SP & 0x0F) + (temp16 & 0x0F)) > 0x0F);
-                setCarryFlag(((SP & 0xFF) + (temp16 & 0xFF)) > 0xFF);
-                setZeroFlag(false);
-                setSubtractFlag(false);
-                tick(12);
-                break;
-
+            else if constexpr (p == 2) PC = HL();
             /* LD SP, HL */
-            case 0xF9:
-                SP = HL();
-                tick(8);
-                break;
-
-            /* LD A, (a16) */
-            case 0xFA:
-                A = read(getImmediateWord());
-                tick(16);
-                break;
-
-            /* EI */
-            case 0xFB:
-                EI();
-                tick(4);
-                break;
-
-            /* CP d8 */
-            case 0xFE:
-                cp(getImmediateByte());
-                tick(8);
-                break;
-
-            /* RST 38H */
-            case 0xFF:
-                RST(0x38);
-                tick(16);
-                break;
-
-            default:
-                std::cout << "Error (Invalid Opcode): " << std::hex << (int)opcode << std::endl;
-                printStatus();
-                break;
+            else SP = HL();
         }
-    }
-
-    void prefixCB()
-    {
-        uint8_t temp;
-        uint16_t temp16;
-
-        uint8_t opcode = getImmediateByte();
-        switch(opcode)
+        else if constexpr (z == 2)
         {
+            /* JP cc, a16 */
+            if constexpr (y < 4) JPIF<Fetch>(condition<y>());
+            /* LD (C), A */
+            else if constexpr (y == 4) Fetch::write(*this, 0xFF00 + C, A);
+            /* LD (a16), A */
+            else if constexpr (y == 5) Fetch::write(*this, Fetch::word(*this), A);
+            /* LD A, (C) */
+            else if constexpr (y == 6) A = Fetch::read(*this, 0xFF00 + C);
+            /* LD A, (a16) */
+            else A = Fetch::read(*this, Fetch::word(*this));
+        }
+        else if constexpr (z == 3)
+        {
+            /* JP a16 */
+            if constexpr (y == 0) PC = Fetch::word(*this);
+            /* PREFIX CB */
+            else if constexpr (y == 1) prefixCB<Fetch>();
+            /* DI */
+            else if constexpr (y == 6) DI();
+            /* EI */
+            else if constexpr (y == 7) EI();
+            else invalidOpcode(op);
+        }
+        /* CALL cc, a16 */
+        else if constexpr (z == 4)
+        {
+            if constexpr (y < 4) CALLIF<Fetch>(condition<y>());
+            else invalidOpcode(op);
+        }
+        else if constexpr (z == 5)
+        {
+            /* PUSH rr */
+            if constexpr (q == 0) pushWord<Fetch>(getStackPair<p>());
+            /* CALL a16 */
+            else if constexpr (p == 0)
+            {
+                uint16_t target = Fetch::word(*this);
+                pushWord<Fetch>(PC);
+                PC = target;
+            }
+            else invalidOpcode(op);
+        }
+        /* ALU A, d8 */
+        else if constexpr (z == 6) alu<y>(Fetch::byte(*this));
+        /* RST n */
+        else RST<Fetch>(y * 8);
+    }
+}
 
-        /* RLC B */
-        case 0x00: rlc(B); tick(8); break;
-
-        /* RLC C */
-        case 0x01: rlc(C); tick(8); break;
-
-        /* RLC D */
-        case 0x02: rlc(D); tick(8); break;
-
-        /* RLC E */
-        case 0x03: rlc(E); tick(8); break;
-
-        /* RLC (HL) */
-        case 0x06:
-            temp = read(HL());
-            rlc(temp);
-            write(HL(), temp);
-            tick(16);
-            break;
-
-        /* RLC A */
-        case 0x07: rlc(A); tick(8); break;
-
-        /* RRC B */
-        case 0x08: rrc(B); tick(8); break;
-
-        /* RRC C */
-        case 0x09: rrc(C); tick(8); break;
-
-        /* RRC E */
-        case 0x0B: rrc(E); tick(8); break;
-
-        /* RRC L */
-        case 0x0D: rrc(L); tick(8); break;
-
-        /* RRC (HL) */
-        case 0x0E:
-            temp = read(HL());
-            rrc(temp);
-            write(HL(), temp);
-            tick(16);
-            break;
-
-        /* RL B */
-        case 0x10: rl(B); tick(8); break;
-
-        /* RL C */
-        case 0x11: rl(C); tick(8); break;
-
-        /* RL D */
-        case 0x12: rl(D); tick(8); break;
-
-        /* RL E */
-        case 0x13: rl(E); tick(8); break;
-
-        /* RL H */
-        case 0x14: rl(H); tick(8); break;
-
-        /* RL L */
-        case 0x15: rl(L); tick(8); break;
-
-        /* RL (HL) */
-        case 0x16:
-            temp = read(HL());
-            rl(temp);
-            write(HL(), temp);
-            tick(16);
-            break;
-
-        /* RL A */
-        case 0x17: rl(A); tick(8); break;
-
-        /* RR B */
-        case 0x18: rr(B); tick(8); break;
-
-        /* RR C */
-        case 0x19: rr(C); tick(8); break;
-
-        /* RR D */
-        case 0x1A: rr(D); tick(8); break;
-
-        /* RR E */
-        case 0x1B: rr(E); tick(8); break;
-
-        /* RR H */
-        case 0x1C: rr(H); tick(8); break;
-
-         /* RR L */
-        case 0x1D: rr(L); tick(8); break;
-
-         /* RR A */
-        case 0x1F: rr(A); tick(8); break;
-
-        /* SLA B */
-        case 0x20: sla(B); tick(8); break;
-
-        /* SLA C */
-        case 0x21: sla(C); tick(8); break;
-
-        /* SLA D */
-        case 0x22: sla(D); tick(8); break;
-
-        /* SLA E */
-        case 0x23: sla(E); tick(8); break;
-
-        /* SLA H */
-        case 0x24: sla(H); tick(8); break;
-
-        /* SLA L */
-        case 0x25: sla(L); tick(8); break;
-
-        /* SLA (HL) */
-        case 0x26:
-            temp = read(HL());
-            sla(temp);
-            write(HL(), temp);
-            tick(16);
-            break;
-
-        /* SLA A */
-        case 0x27: sla(A); tick(8); break;
-
-        /* SRA B */
-        case 0x28: sra(B); tick(8); break;
-
-        /* SRA C */
-        case 0x29: sra(C); tick(8); break;
-
-        /* SRA D */
-        case 0x2A: sra(D); tick(8); break;
-
-        /* SRA E */
-        case 0x2B: sra(E); tick(8); break;
-
-        /* SRA (HL) */
-        case 0x2E:
-            temp = read(HL());
-            sra(temp);
-            write(HL(), temp);
-            tick(16);
-            break;
-
-        /* SRA A */
-        case 0x2F: sra(A); tick(8); break;
-
-        /* SWAP B */
-        case 0x30: swap(B); tick(8); break;
-
-        /* SWAP C */
-        case 0x31: swap(C); tick(8); break;
-
-        /* SWAP E */
-        case 0x33: swap(E); tick(8); break;
-
-        /* SWAP L */
-        case 0x35: swap(L); tick(8); break;
-
-        /* SWAP (HL)*/
-        case 0x36:
-            temp = read(HL());
-            swap(temp);
-            write(HL(), temp);
-            tick(16);
-            break;
-
-        /* SWAP A */
-        case 0x37: swap(A); tick(8); break;
-
-
-        /* SRL B */
-        case 0x38: srl(B); tick(8); break;
-
-        /* SRL C */
-        case 0x39: srl(C); tick(8); break;
-
-        /* SRL D */
-        case 0x3A: srl(D); tick(8); break;
-
-        /* SRL E */
-        case 0x3B: srl(E); tick(8); break;
-
-        /* SRL H */
-        case 0x3C: srl(H); tick(8); break;
-
-        /* SRL L */
-        case 0x3D: srl(L); tick(8); break;
-
-        /* SRL A*/
-        case 0x3F: srl(A); tick(8); break;
-
-        /* BIT 0, x */
-        case 0x40: case 0x41: case 0x42: case 0x43:
-        case 0x44: case 0x45: case 0x46: case 0x47:
-            setZeroFlag((getReg(opcode & 7) & (1 << 0)) == 0);
-            setSubtractFlag(false);
-            setHalfCarryFlag(true);
-            tick(8);
-            if (opcode == 0x76) tick(4); // Extra 4 ticks for [HL]
-            break;
-
-        /* BIT 1, x */
-        case 0x48: case 0x49: case 0x4A: case 0x4B:
-        case 0x4C: case 0x4D: case 0x4E: case 0x4F:
-            setZeroFlag((getReg(opcode & 7) & (1 << 1)) == 0);
-            setSubtractFlag(false);
-            setHalfCarryFlag(true);
-            tick(8);
-            if (opcode == 0x6E) tick(4); // Extra 4 ticks for [HL]
-            break;
-
-        /* BIT 2, x */
-        case 0x50: case 0x51: case 0x52: case 0x53:
-        case 0x54: case 0x55: case 0x56: case 0x57:
-            setZeroFlag((getReg(opcode & 7) & (1 << 2)) == 0);
-            setSubtractFlag(false);
-            setHalfCarryFlag(true);
-            tick(8);
-            if (opcode == 0x76) tick(4); // Extra 4 ticks for [HL]
-            break;
-
-        /* BIT 3, x */
-        case 0x58: case 0x59: case 0x5A: case 0x5B:
-        case 0x5C: case 0x5D: case 0x5E: case 0x5F:
-            setZeroFlag((getReg(opcode & 7) & (1 << 3)) == 0);
-            setSubtractFlag(false);
-            setHalfCarryFlag(true);
-            tick(8);
-            if (opcode == 0x6E) tick(4); // Extra 4 ticks for [HL]
-            break;
-
-        /* BIT 4, x */
-        case 0x60: case 0x61: case 0x62: case 0x63:
-        case 0x64: case 0x65: case 0x66: case 0x67:
-            setZeroFlag((getReg(opcode & 7) & (1 << 4)) == 0);
-            setSubtractFlag(false);
-            setHalfCarryFlag(true);
-            tick(8);
-            if (opcode == 0x76) tick(4); // Extra 4 ticks for [HL]
-            break;
-
-
-        /* BIT 5, x */
-        case 0x68: case 0x69: case 0x6A: case 0x6B:
-        case 0x6C: case 0x6D: case 0x6E: case 0x6F:
-            setZeroFlag((getReg(opcode & 7) & (1 << 5)) == 0);
-            setSubtractFlag(false);
-            setHalfCarryFlag(true);
-            tick(8);
-            if (opcode == 0x6E) tick(4); // Extra 4 ticks for [HL]
-            break;
-
-        /* BIT 6, x */
-        case 0x70: case 0x71: case 0x72: case 0x73:
-        case 0x74: case 0x75: case 0x76: case 0x77:
-            setZeroFlag((getReg(opcode & 7) & (1 << 6)) == 0);
-            setSubtractFlag(false);
-            setHalfCarryFlag(true);
-            tick(8);
-            if (opcode == 0x76) tick(4); // Extra 4 ticks for [HL]
-            break;
-
-        /* BIT 7, x */
-        case 0x78: case 0x79: case 0x7A: case 0x7B:
-        case 0x7C: case 0x7D: case 0x7E: case 0x7F:
-            setZeroFlag((getReg(opcode & 7) & (1 << 7)) == 0);
-            setSubtractFlag(false);
-            setHalfCarryFlag(true);
-            tick(8);
-            if (opcode == 0x7E) tick(4); // Extra 4 ticks for [HL]
-            break;
-
-        /* RES 0, B */
-        case 0x80:
-            B = B & ~1;
-            tick(8);
-            break;
-
-        /* RES 0, (HL) */
-        case 0x86:
-            temp16 = HL();
-            write(temp16, read(temp16) & ~1);
-            tick(16);
-            break;
-
-        /* RES 0, A */
-        case 0x87:
-            A = A & ~1;
-            tick(8);
-            break;
-
-        /* RES 1, B */
-        case 0x88:
-            B = B & ~(1 << 1);
-            tick(8);
-            break;
-
-        /* RES 1, (HL) */
-        case 0x8E:
-            temp16 = HL();
-            write(temp16, read(temp16) & ~(1 << 1));
-            tick(16);
-            break;
-
-        /* RES 1, A */
-        case 0x8F:
-            A = A & ~(1 << 1);
-            tick(8);
-            break;
-
-        /* RES 2, B */
-        case 0x90:
-            B = B & ~(1 << 2);
-            tick(8);
-            break;
-
-        /* RES 2, H */
-        case 0x94:
-            H = H & ~(1 << 2);
-            tick(8);
-            break;
-
-        /* RES 2, L */
-        case 0x95:
-            L = L & ~(1 << 2);
-            tick(8);
-            break;
-
-        /* RES 2, (HL) */
-        case 0x96:
-            temp16 = HL();
-            write(temp16, read(temp16) & ~(1 << 2));
-            tick(16);
-            break;
-
-        /* RES 2, A */
-        case 0x97:
-            A = A & ~(1 << 2);
-            tick(8);
-            break;
-
-        /* RES 3, B */
-        case 0x98:
-            B = B & ~(1 << 3);
-            tick(8);
-            break;
-
-        /* RES 3, (HL) */
-        case 0x9E:
-            temp16 = HL();
-            write(temp16, read(temp16) & ~(1 << 3));
-            tick(16);
-            break;
-
-        /* RES 3, A */
-        case 0x9F:
-            A = A & ~(1 << 3);
-            tick(8);
-            break;
-
-        /* RES 4, B */
-        case 0xA0:
-            B = B & ~(1 << 4);
-            tick(8);
-            break;
+// CB prefixed instruction
+template <uint8_t op, typename Fetch>
+void CPU::prefixCBInstruction()
+{
+    constexpr uint8_t x = opX(op), y = opY(op), z = opZ(op);
 
-        /* RES 4, (HL) */
-        case 0xA6:
-            temp16 = HL();
-            write(temp16, read(temp16) & ~(1 << 4));
-            tick(16);
-            break;
+    /* RLC/RRC/RL/RR/SLA/SRA/SWAP/SRL x */
+    if constexpr (x == 0) modifyOperand<z, &CPU::rotate<y>, Fetch>();
+    /* BIT n, x */
+    else if constexpr (x == 1)
+    {
+        setZeroFlag((getOperand<z, Fetch>() & (1 << y)) == 0);
+        setSubtractFlag(false);
+        setHalfCarryFlag(true);
+    }
+    /* RES n, x */
+    else if constexpr (x == 2) modifyOperand<z, &CPU::resetBit<y>, Fetch>();
+    /* SET n, x */
+    else modifyOperand<z, &CPU::setBit<y>, Fetch>();
+}
 
-        /* RES 4, A */
-        case 0xA7:
-            A = A & ~(1 << 4);
-            tick(8);
-            break;
+template <typename Fetch, size_t... ops>
+constexpr std::array<CPU::OpEntry, 256> CPU::makeOpcodeTable(std::index_sequence<ops...>)
+{
+    return {{ { &execute<ops, Fetch>, opcodeCycles(ops) }... }};
+}
 
-        /* RES 5, B */
-        case 0xA8:
-            B = B & ~(1 << 5);
-            tick(8);
-            break;
+template <typename Fetch, size_t... ops>
+constexpr std::array<CPU::OpEntry, 256> CPU::makePrefixCBTable(std::index_sequence<ops...>)
+{
+    return {{ { &executeCB<ops, Fetch>, prefixCBCycles(ops) }... }};
+}
 
-        /* RES 5, (HL) */
-        case 0xAE:
-            temp16 = HL();
-            write(temp16, read(temp16) & ~(1 << 5));
-            tick(16);
-            break;
+const std::array<CPU::OpEntry, 256> CPU::opcodeTable = makeOpcodeTable<MemoryFetch>(std::make_index_sequence<256>());
+const std::array<CPU::OpEntry, 256> CPU::decodedOpcodeTable = makeOpcodeTable<DecodedFetch>(std::make_index_sequence<256>());
+const std::array<CPU::OpEntry, 256> CPU::cycleOpcodeTable = makeOpcodeTable<CycleFetch>(std::make_index_sequence<256>());
+const std::array<CPU::OpEntry, 256> CPU::prefixCBTable = makePrefixCBTable<MemoryFetch>(std::make_index_sequence<256>());
+const std::array<CPU::OpEntry, 256> CPU::cyclePrefixCBTable = makePrefixCBTable<CycleFetch>(std::make_index_sequence<256>());
 
-        /* RES 5, A */
-        case 0xAF:
-            A = A & ~(1 << 5);
-            tick(8);
-            break;
+// The tables of the interpreter's tiers
+template <typename Fetch>
+inline const std::array<CPU::OpEntry, 256>& CPU::opcodes()
+{
+    if constexpr (std::is_same<Fetch, CycleFetch>::value) return cycleOpcodeTable;
+    else return opcodeTable;
+}
 
-        /* RES 6, B */
-        case 0xB0:
-            B = B & ~(1 << 6);
-            tick(8);
-            break;
+template <typename Fetch>
+inline const std::array<CPU::OpEntry, 256>& CPU::prefixCBOpcodes()
+{
+    if constexpr (std::is_same<Fetch, CycleFetch>::value) return cyclePrefixCBTable;
+    else return prefixCBTable;
+}
 
-        /* RES 6, H */
-        case 0xB4:
-            H = H & ~(1 << 6);
-            tick(8);
-            break;
+// Execute a single instruction
+void CPU::step()
+{
+    if (cycleAccurate)
+        stepWith<CycleFetch>();
+    else
+        stepWith<MemoryFetch>();
+}
 
-        /* RES 6, (HL) */
-        case 0xB6:
-            temp16 = HL();
-            write(temp16, read(temp16) & ~(1 << 6));
-            tick(16);
-            break;
+template <typename Fetch>
+void CPU::stepWith()
+{
+    if (runningBootROM && PC == 0x100)
+    {
+        runningBootROM = false;
+        readPages[0x00] = const_cast<uint8_t*>(ROM + 0x4000 * currentROMBank0);
+        return;
+    }
 
-        /* RES 6, A */
-        case 0xB7:
-            A = A & ~(1 << 6);
-            tick(8);
-            break;
+    uint8_t opcode = Fetch::byte(*this);
 
-        /* RES 7, B */
-        case 0xB8:
-            B = B & ~(1 << 7);
-            tick(8);
-            break;
+    // If interrupts are disabled and a HALT
+    // is executed, then stop updating the PC
+    // for ONE instruction.
+    if (haltskip)
+    {
+        PC--;
+        haltskip = false;
+    }
 
-        /* RES 7, C */
-        case 0xB9:
-            C = C & ~(1 << 7);
-            tick(8);
-            break;
+    const OpEntry& entry = opcodes<Fetch>()[opcode];
+    entry.execute(*this);
+    Fetch::tick(*this, entry.cycles);
+}
 
-        /* RES 7, D */
-        case 0xBA:
-            D = D & ~(1 << 7);
-            tick(8);
-            break;
+template <typename Fetch>
+void CPU::prefixCB()
+{
+    const OpEntry& entry = prefixCBOpcodes<Fetch>()[Fetch::byte(*this)];
+    entry.execute(*this);
+    Fetch::tick(*this, entry.cycles);
+}
 
-        /* RES 7, E */
-        case 0xBB:
-            E = E & ~(1 << 7);
-            tick(8);
-            break;
+inline uint32_t CPU::blockKey(uint16_t pc)
+{
+    if (pc < 0x4000)
+        return (currentROMBank0 << 16) | pc;
+    if (pc < 0x8000)
+        return (currentROMBank << 16) | pc;
+    return pc;
+}
 
-        /* RES 7, H */
-        case 0xBC:
-            H = H & ~(1 << 7);
-            tick(8);
-            break;
+// Decode the straight-line code at start into a new block
+CPU::Block* CPU::decodeBlock(uint16_t start)
+{
+    Block block;
+    uint16_t pc = start;
+    while (block.ops.size() < MAX_BLOCK_OPS)
+    {
+        uint8_t opcode = read(pc);
+        uint8_t length = opcodeLength(opcode);
 
-        /* RES 7, L */
-        case 0xBD:
-            L = L & ~(1 << 7);
-            tick(8);
+        // Stay on one page, and clear of IE after high RAM
+        uint32_t last = pc + length - 1;
+        if ((last >> 8) != (start >> 8) || last == 0xFFFF)
             break;
 
-        /* RES 7, (HL) */
-        case 0xBE:
-            temp16 = HL();
-            write(temp16, read(temp16) & ~(1 << 7));
-            tick(16);
-            break;
+        MicroOp op;
+        if (opcode == 0xCB)
+        {
+            uint8_t cb = read(pc + 1);
+            const OpEntry& entry = prefixCBTable[cb];
+            op = { entry.execute, cb, opcode, length, uint8_t(opcodeCycles(opcode) + entry.cycles) };
+        }
+        else
+        {
+            const OpEntry& entry = decodedOpcodeTable[opcode];
+            uint16_t operand = 0;
+            if (length == 2) operand = read(pc + 1);
+            else if (length == 3) operand = read(pc + 1) | (read(pc + 2) << 8);
+            op = { entry.execute, operand, opcode, length, entry.cycles };
+        }
+        block.ops.push_back(op);
 
-        /* RES 7, A */
-        case 0xBF:
-            A = A & ~(1 << 7);
-            tick(8);
-            break;
+        if (start >= 0x8000)
+            std::fill(codeBytes + pc, codeBytes + last + 1, true);
 
-        /* SET 0, B */
-        case 0xC0:
-            B |= (1 << 0);
-            tick(8);
-            break;
+        pc += length;
+        if (endsBlock(opcode)) break;
+    }
 
-        /* SET 0, C */
-        case 0xC1:
-            C |= (1 << 0);
-            tick(8);
-            break;
+    if (block.ops.empty())
+        return nullptr;
 
-        /* SET 0, D */
-        case 0xC2:
-            D |= (1 << 0);
-            tick(8);
-            break;
+    uint32_t key = blockKey(start);
+    if (start >= 0x8000)
+    {
+        uint8_t page = start >> 8;
+        if (codePages[page].empty()) protectCodePage(page);
+        codePages[page].push_back(key);
+    }
 
-        /* SET 0, L */
-        case 0xC5:
-            L |= (1 << 0);
-            tick(8);
-            break;
+    Block& cached = blocks[key];
+    cached = std::move(block);
+    return &cached;
+}
 
-        /* SET 0, (HL) */
-        case 0xC6:
-            temp16 = HL();
-            write(temp16, read(temp16) | (1 << 0));
-            tick(16);
-            break;
+// Look up the block at pc, decoding it on first use
+CPU::Block* CPU::findBlock(uint16_t pc)
+{
+    // Only ROM, work RAM and high RAM are cached
+    if (!(pc < 0x8000 || (pc >= 0xC000 && pc < 0xE000) || (pc >= 0xFF80 && pc < 0xFFFF)))
+        return nullptr;
+
+    auto it = blocks.find(blockKey(pc));
+    if (it != blocks.end())
+        return &it->second;
+    return decodeBlock(pc);
+}
 
-        /* SET 0, A */
-        case 0xC7:
-            A |= (1 << 0);
-            tick(8);
-            break;
+// Execute a single instruction from the block cache
+void CPU::stepCached()
+{
+    // The boot ROM overlay and the HALT bug go through the interpreter
+    if (runningBootROM || haltskip)
+    {
+        currentBlock = nullptr;
+        stepWith<MemoryFetch>();
+        return;
+    }
 
-        /* SET 1, B */
-        case 0xC8:
-            B |= (1 << 1);
-            tick(8);
-            break;
+    if (!currentBlock || PC != nextPC)
+    {
+        currentBlock = findBlock(PC);
+        currentOpIndex = 0;
+        if (!currentBlock)
+        {
+            stepWith<MemoryFetch>();
+            return;
+        }
+    }
 
-        /* SET 1, E */
-        case 0xCB:
-            E |= (1 << 1);
-            tick(8);
-            break;
+    // Copied, since writing to its own code drops the block
+    const MicroOp op = currentBlock->ops[currentOpIndex++];
+    if (currentOpIndex == currentBlock->ops.size())
+        currentBlock = nullptr;
 
-        /* SET 1, (HL) */
-        case 0xCE:
-            temp16 = HL();
-            write(temp16, read(temp16) | (1 << 1));
-            tick(16);
-            break;
+    PC += op.length;
+    nextPC = PC;
+    decodedOperand = op.operand;
+    op.execute(*this);
+    tick(op.cycles);
+}
 
-        /* SET 1, A */
-        case 0xCF:
-            A |= (1 << 1);
-            tick(8);
-            break;
+/*
+    Idle loops
 
-        /* SET 2, B */
-        case 0xD0:
-            B |= (1 << 2);
-            tick(8);
-            break;
+    A short loop that branches back to its own start, writes nothing
+    and only reads from addresses it cannot change is waiting for an
+    event: the registers it reads (LY, STAT, IF, ...) only change when
+    the scheduler runs one. If an iteration with no event in it ends
+    in the state it started from, every further iteration up to the
+    next event does the same, so they are skipped by adding their
+    cycles. DIV and TIMA change between events and are never skipped.
+*/
 
-        /* SET 2, L */
-        case 0xD5:
-            L |= (1 << 2);
-            tick(8);
-            break;
+const int MAX_LOOP_OPS = 8;
 
-        /* SET 2, (HL) */
-        case 0xD6:
-            temp16 = HL();
-            write(temp16, read(temp16) | (1 << 2));
-            tick(16);
-            break;
+// Registers by operand index, as bits of IdleLoop::written
+enum { REG_B = 1, REG_C = 2, REG_D = 4, REG_E = 8, REG_H = 16, REG_L = 32 };
+const uint8_t regBits[8] = { REG_B, REG_C, REG_D, REG_E, REG_H, REG_L, 0, 0 };
+const uint8_t pairBits[4] = { REG_B | REG_C, REG_D | REG_E, REG_H | REG_L, 0 };
 
-        /* SET 2, A */
-        case 0xD7:
-            A |= (1 << 2);
-            tick(8);
-            break;
+// Fold one instruction of a loop body into loop, false when it
+// has side effects or leaves the loop without branching to head
+bool CPU::analyzeLoopOp(IdleLoop& loop, uint16_t& pc, uint16_t head, bool& closed)
+{
+    uint8_t op = read(pc);
+    uint8_t length = opcodeLength(op);
+    uint16_t next = pc + length;
+    uint8_t x = op >> 6, y = (op >> 3) & 7, z = op & 7, p = y >> 1, q = y & 1;
 
-        /* SET 3, B */
-        case 0xD8:
-            B |= (1 << 3);
-            tick(8);
-            break;
+    auto fixedRead = [&](uint16_t loc)
+    {
+        if (loop.fixedReads == MAX_LOOP_READS) return false;
+        loop.reads[loop.fixedReads++] = loc;
+        return true;
+    };
+
+    bool ok = true;
+    if (op == 0x00 || (x == 0 && z == 7) || (x == 3 && z == 6))
+        ;                                               // NOP, A/flag ops, ALU A,d8
+    else if (op == 0x18 || (x == 0 && z == 0 && y >= 4)) // JR (cc), e
+        closed = uint16_t(next + int8_t(read(pc + 1))) == head;
+    else if (op == 0xC3 || (x == 3 && z == 2 && y < 4)) // JP (cc), a16
+        closed = uint16_t(read(pc + 1) | (read(pc + 2) << 8)) == head;
+    else if (x == 0 && z == 1 && q == 0)                // LD rr, d16
+        loop.written |= pairBits[p];
+    else if (op == 0x0A || op == 0x1A)                  // LD A, (BC)/(DE)
+        loop.readFrom |= pairBits[p];
+    else if (x == 0 && z == 3)                          // INC/DEC rr
+        loop.written |= pairBits[p];
+    else if (x == 0 && (z == 4 || z == 5 || z == 6) && y != 6)
+        loop.written |= regBits[y];                     // INC/DEC r, LD r, d8
+    else if (x == 1 && y != 6)                          // LD r, r
+    {
+        loop.written |= regBits[y];
+        if (z == 6) loop.readFrom |= REG_H | REG_L;
+    }
+    else if (x == 2)                                    // ALU A, r
+    {
+        if (z == 6) loop.readFrom |= REG_H | REG_L;
+    }
+    else if (op == 0xF0)                                // LDH A, (a8)
+        ok = fixedRead(0xFF00 | read(pc + 1));
+    else if (op == 0xFA)                                // LD A, (a16)
+        ok = fixedRead(read(pc + 1) | (read(pc + 2) << 8));
+    else if (op == 0xF2)                                // LD A, (C)
+        loop.readFrom |= REG_C;
+    else if (op == 0xCB)
+    {
+        uint8_t cb = read(pc + 1);
+        if ((cb & 7) == 6)
+        {
+            ok = (cb >> 6) == 1;                        // only BIT reads (HL)
+            loop.readFrom |= REG_H | REG_L;
+        }
+        else if ((cb >> 6) != 1)
+            loop.written |= regBits[cb & 7];
+    }
+    else ok = false;
+
+    if (closed)
+        loop.end = pc;
+    else if (endsBlock(op))
+        ok = false;
+    pc = next;
+    return ok;
+}
 
-        /* SET 3, L */
-        case 0xDD:
-            L |= (1 << 3);
-            tick(8);
-            break;
+// Look up or analyze the loop starting at head
+const CPU::IdleLoop& CPU::findIdleLoop(uint16_t head)
+{
+    uint32_t key = blockKey(head);
+    IdleLoop& loop = idleLoops[(key ^ (key >> 10)) & 0x3FF];
+    if (loop.key == key)
+        return loop;
+
+    loop = IdleLoop();
+    loop.key = key;
+    loop.idle = false;
+
+    uint16_t pc = head;
+    bool closed = false;
+    for (int i = 0; i < MAX_LOOP_OPS && !closed; i++)
+        if (!analyzeLoopOp(loop, pc, head, closed) || pc > 0x8000)
+            return loop;
+
+    loop.idle = closed && !(loop.readFrom & loop.written);
+    return loop;
+}
 
-        /* SET 3, (HL) */
-        case 0xDE:
-            temp16 = HL();
-            write(temp16, read(temp16) | (1 << 3));
-            tick(16);
-            break;
+// Reads whose value can change without an event
+inline bool timerRead(uint16_t loc)
+{
+    return loc == IO_DIV || loc == IO_TIMA;
+}
 
-        /* SET 3, A */
-        case 0xDF:
-            A |= (1 << 3);
-            tick(8);
-            break;
+inline void CPU::saveProbeState()
+{
+    uint8_t regs[8] = { A, F, B, C, D, E, H, L };
+    std::copy(regs, regs + 8, probe.regs);
+    probe.SP = SP;
+    probe.start = cycles;
+    probe.next = gb.scheduler.next;
+}
 
-        /* SET 4, B */
-        case 0xE0:
-            B |= (1 << 4);
-            tick(8);
-            break;
+inline bool CPU::sameProbeState()
+{
+    uint8_t regs[8] = { A, F, B, C, D, E, H, L };
+    return std::equal(regs, regs + 8, probe.regs) && SP == probe.SP;
+}
 
-        /* SET 4, D */
-        case 0xE2:
-            D |= (1 << 4);
-            tick(8);
-            break;
+// Whether the debugger has to see every instruction, which keeps
+// compiled blocks and skipped idle loops out of the way
+template <typename Policy>
+inline bool CPU::watched()
+{
+    return (Policy::stepping && stepmode) ||
+        (Policy::breakpoints && (rununtil & 0x10000) == 0) ||
+        (Policy::tracing && trace);
+}
 
-        /* SET 4, (HL) */
-        case 0xE6:
-            temp16 = HL();
-            write(temp16, read(temp16) | (1 << 4));
-            tick(16);
-            break;
+/* Called at a boundary after a backward jump from the instruction
+   or compiled block at from, with PC at what may be the head of an
+   idle loop. The first time there the state is saved. Coming back
+   through the loop's own branch it is compared and the loop skipped.
+   Any other way back to the head (an interrupt, an outer loop)
+   starts over. */
+template <typename Policy>
+void CPU::checkIdleLoop(uint16_t from, uint32_t maxcycles)
+{
+    if (watched<Policy>() || runningBootROM || PC >= 0x8000 ||
+        pendingIEnable || pendingIDisable)
+    {
+        probe.active = false;
+        return;
+    }
 
-        /* SET 4, A */
-        case 0xE7:
-            A |= (1 << 4);
-            tick(8);
-            break;
+    bool quiet = cycles < gb.scheduler.next && !(ienable && (RAM[IO_IE] & RAM[IO_IF]));
 
-        /* SET 5, (HL) */
-        case 0xEE:
-            temp16 = HL();
-            write(temp16, read(temp16) | (1 << 5));
-            tick(16);
-            break;
+    const IdleLoop& loop = findIdleLoop(PC);
+    bool closing = from == PC || from == loop.end;
 
-        /* SET 5, A */
-        case 0xEF:
-            A |= (1 << 5);
-            tick(8);
-            break;
+    /* One iteration left everything as it was. An event during it
+       would have happened at a cycle past probe.next, so none did. */
+    if (probe.active && probe.head == PC && closing && quiet &&
+        gb.scheduler.next == probe.next && sameProbeState())
+    {
+        uint32_t length = cycles - probe.start;
+        uint32_t skipped = (std::min(gb.scheduler.next, maxcycles) - cycles) / length * length;
+        cycles += skipped;
+        idleLoopCycles[blockKey(PC)] += skipped;
+        saveProbeState();
+        return;
+    }
 
-        /* SET 6, B */
-        case 0xF0:
-            B |= (1 << 6);
-            tick(8);
-            break;
+    probe.active = false;
+    if (!quiet || !loop.idle)
+        return;
 
-        /* SET 6, C */
-        case 0xF1:
-            C |= (1 << 6);
-            tick(8);
-            break;
+    for (int i = 0; i < loop.fixedReads; i++)
+        if (timerRead(loop.reads[i]))
+            return;
+    if (((loop.readFrom & REG_H) && timerRead(HL())) ||
+        ((loop.readFrom & REG_B) && timerRead(BC())) ||
+        ((loop.readFrom & REG_D) && timerRead(DE())) ||
+        ((loop.readFrom & REG_C) && timerRead(0xFF00 | C)))
+        return;
+
+    probe.active = true;
+    probe.head = PC;
+    saveProbeState();
+}
 
-        /* SET 6, D */
-        case 0xF2:
-            D |= (1 << 6);
-            tick(8);
-            break;
+void CPU::reportIdleLoops(std::ostream& out)
+{
+    for (auto& loop : idleLoopCycles)
+    {
+        out << std::hex << std::uppercase << "Idle loop " << (loop.first >> 16) << ":"
+            << (loop.first & 0xFFFF) << std::dec << " skipped " << loop.second << " cycles" << std::endl;
+    }
+}
 
-        /* SET 6, E */
-        case 0xF3:
-            E |= (1 << 6);
-            tick(8);
-            break;
+void CPU::interrupt(uint16_t pos)
+{
+    halted = false;
+    probe.active = false;
+    pushWord<MemoryFetch>(PC);
+    PC = pos;
+    ienable = false;
+}
 
-        /* SET 6, H */
-        case 0xF4:
-            H |= (1 << 6);
-            tick(8);
-            break;
+void CPU::handleInterrupt()
+{
 
-        /* SET 6, L */
-        case 0xF5:
-            L |= (1 << 6);
-            tick(8);
-            break;
+    uint8_t intr = RAM[IO_IE] & RAM[IO_IF];
+    if (!intr) return;
+    tick(5);
 
-        /* SET 6, (HL) */
-        case 0xF6:
-            temp16 = HL();
-            write(temp16, read(temp16) | (1 << 6));
-            tick(16);
-            break;
+    if (intr & INTERRUPT_VBLANK)
+    {
+        RAM[IO_IF] &= ~INTERRUPT_VBLANK;
+        interrupt(0x40);
+    }
+    else if (intr & INTERRUPT_LCDC)
+    {
+        RAM[IO_IF] &= ~INTERRUPT_LCDC;
+        interrupt(0x48);
+    }
+    else if (intr & INTERRUPT_TIMER)
+    {
+        RAM[IO_IF] &= ~INTERRUPT_TIMER;
+        interrupt(0x50);
+    }
+    else if (intr & INTERRUPT_HILO)
+    {
+        RAM[IO_IF] &= ~INTERRUPT_HILO;
+        interrupt(0x60);
+    }
+}
 
-        /* SET 6, A */
-        case 0xF7:
-            A |= (1 << 6);
-            tick(8);
-            break;
+// EI and DI take effect after the next instruction
+inline void CPU::updatePendingInterrupts()
+{
+    if (pendingIEnable)
+    {
+        if (pendingIEnable == 2)
+        {
+            ienable = true;
+            pendingIEnable = 0;
+        }
+        else pendingIEnable++;
+    }
 
-        /* SET 7, B */
-        case 0xF8:
-            B |= (1 << 7);
-            tick(8);
-            break;
+    if (pendingIDisable)
+    {
+        if (pendingIDisable == 2)
+        {
+            ienable = false;
+            pendingIDisable = 0;
+        }
+        else pendingIDisable++;
+    }
+}
 
-        /* SET 7, C */
-        case 0xF9:
-            C |= (1 << 7);
-            tick(8);
-            break;
+// Compiled blocks skip jitPoll() while this is false
+inline bool CPU::needsPoll()
+{
+    return pendingIEnable || pendingIDisable ||
+        (ienable && (RAM[IO_IE] & RAM[IO_IF]));
+}
 
-        /* SET 7, D */
-        case 0xFA:
-            D |= (1 << 7);
-            tick(8);
-            break;
+/* Everything exec() does between two instructions, for compiled
+   blocks. They only call it once gb.scheduler.next is reached, which
+   is also how anything that needs a look at the next boundary (an
+   IO write, a dropped block) gets one: gb.scheduler.wake(). It stops
+   the block when exec() would have stopped, or when the next
+   instruction is not the one the block continues with: a taken
+   branch, an interrupt, HALT, or the block itself being dropped by
+   a write or a bank switch. */
+int CPU::jitPoll(uint16_t next)
+{
+    updatePendingInterrupts();
+    if (ienable)
+        handleInterrupt();
 
-        /* SET 7, E */
-        case 0xFB:
-            E |= (1 << 7);
-            tick(8);
-            break;
+    if (cycles >= execLimit)
+        return JIT::EXIT;
 
-        /* SET 7, H */
-        case 0xFC:
-            H |= (1 << 7);
-            tick(8);
-            break;
+    if (cycles >= gb.scheduler.next)
+        gb.scheduler.run();
+    if (needsPoll())
+        gb.scheduler.wake();
 
-        /* SET 7, L */
-        case 0xFD:
-            L |= (1 << 7);
-            tick(8);
-            break;
+    if (halted || PC != next || !currentBlock)
+        return JIT::EXIT;
+    return JIT::CONTINUE;
+}
 
-        /* SET 7, (HL) */
-        case 0xFE:
-            temp16 = HL();
-            write(temp16, read(temp16) | (1 << 7));
-            tick(16);
-            break;
+// Drop all translated code when the code buffer runs out
+void CPU::resetCompiledBlocks()
+{
+    for (auto& block : blocks)
+        block.second.code = nullptr;
+    gb.jit.reset();
+}
 
-        /* SET 7, A */
-        case 0xFF:
-            A |= (1 << 7);
-            tick(8);
-            break;
+// Translated code for the block at PC, translating it once it is hot
+template <typename Policy>
+CPU::Code CPU::compiledBlock()
+{
+    if (!useJIT || runningBootROM || haltskip || watched<Policy>())
+        return nullptr;
 
+    // Part way through a block of the cached interpreter
+    if (currentBlock && PC == nextPC)
+        return nullptr;
 
+    Block* block = findBlock(PC);
+    currentBlock = block;
+    currentOpIndex = 0;
+    nextPC = PC;
+    if (!block)
+        return nullptr;
 
-        default:
-            std::cout << std::hex << "CB : " << (int) opcode << " at " << PC << std::endl;
+    if (!block->code && ++block->hits == JIT_THRESHOLD)
+    {
+        block->code = gb.jit.compile(block->ops.data(), block->ops.size(), PC);
+        if (!block->code)
+        {
+            resetCompiledBlocks();
+            block->code = gb.jit.compile(block->ops.data(), block->ops.size(), PC);
         }
     }
+    return block->code;
+}
+
+// A line per instruction, with the registers and the bytes at PC
+void CPU::traceInstruction()
+{
+    char line[96];
+    snprintf(line, sizeof line,
+             "A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X SP:%04X PC:%04X PCMEM:%02X,%02X,%02X,%02X\n",
+             A, F, B, C, D, E, H, L, SP, PC,
+             read(PC), read(PC + 1), read(PC + 2), read(PC + 3));
+    *trace << line;
+}
 
-    void interrupt(uint16_t pos)
+void CPU::exec(uint32_t maxcycles)
+{
+    // The debugger opening or closing and a change of tier take effect
+    // here, between frames
+    if (cycleAccurate)
     {
-        halted = false;
-        pushWord(PC);
-        PC = pos;
-        ienable = false;
+        if (debugging)
+            execWith<DebugPolicy, CycleFetch>(maxcycles);
+        else
+            execWith<FastPolicy, CycleFetch>(maxcycles);
     }
+    else if (debugging)
+        execWith<DebugPolicy, MemoryFetch>(maxcycles);
+    else
+        execWith<FastPolicy, MemoryFetch>(maxcycles);
+}
 
-    void handleInterrupt()
+template <typename Policy, typename Fetch>
+void CPU::execWith(uint32_t maxcycles)
+{
+    // Predecoded and compiled blocks only come with instruction timing
+    constexpr bool blocks = std::is_same<Fetch, MemoryFetch>::value;
+
+    execLimit = maxcycles;
+    gb.scheduler.schedule(Scheduler::EVENT_EXEC_END, maxcycles - cycles);
+    probe.active = false;
+
+    while(cycles < maxcycles)
     {
+        if (cycles >= gb.scheduler.next)
+            gb.scheduler.run();
 
-        uint8_t intr = CPU::RAM[IO_IE] & CPU::RAM[IO_IF];
-        if (!intr) return;
-        tick(5);
+        uint16_t from = PC;
 
-        if (intr & INTERRUPT_VBLANK)
-        {
-            RAM[IO_IF] &= ~INTERRUPT_VBLANK;
-            interrupt(0x40);
-        }
-        else if (intr & INTERRUPT_LCDC)
+        // Step Mode control
+        if (Policy::stepping && stepmode)
         {
-            RAM[IO_IF] &= ~INTERRUPT_LCDC;
-            interrupt(0x48);
+            if (!takestep)
+            {
+                return;
+            } else takestep--;
         }
-        else if (intr & INTERRUPT_TIMER)
+
+        if (halted)
         {
-            RAM[IO_IF] &= ~INTERRUPT_TIMER;
-            interrupt(0x50);
+            /* Only an event can raise an interrupt while halted, so
+               skip the 4 cycle passes up to the first one that would
+               see the next event or the end of this exec() */
+            uint32_t until = std::min(gb.scheduler.next, maxcycles);
+            if (!(Policy::stepping && stepmode) && until > cycles &&
+                !(ienable && (RAM[IO_IE] & RAM[IO_IF])))
+                tick((until - cycles + 3) & ~3);
+            else
+                tick(4);
         }
-        else if (intr & INTERRUPT_HILO)
+        else if (Code code = blocks ? compiledBlock<Policy>() : nullptr)
         {
-            RAM[IO_IF] &= ~INTERRUPT_HILO;
-            interrupt(0x60);
+            // An interrupt due after the first instruction
+            if (needsPoll())
+                gb.scheduler.wake();
+            code();
+            currentBlock = nullptr;
+            if (skipIdleLoops && PC <= from)
+                checkIdleLoop<Policy>(from, maxcycles);
+            continue;
         }
-    }
-
-    void exec(uint32_t maxcycles)
-    {
-        const uint32_t timerSpeeds[4] = { 1024, 16, 64, 256 };
-        while(cycles < maxcycles)
+        else
         {
-            GPU::step();
-
-            // Step Mode control
-            if (stepmode)
-            {
-                if (!takestep)
-                {
-                    return;
-                } else takestep--;
-            }
+            if (Policy::tracing && trace)
+                traceInstruction();
 
-            APU::step();
-
-            if (halted)
-            {
-                tick(4);
-            }
+            if (blocks && (cachedInterpreter || useJIT))
+                stepCached();
             else
+                stepWith<Fetch>();
+
+            // Only EI and DI set these, so one test covers both
+            if (pendingIEnable | pendingIDisable)
+                updatePendingInterrupts();
+
+            /* If the "don't run-until flag" isn't set,
+            which means we're running until PC equals
+            rununtil & 0xFFFF, enable stepmode
+            until we reach it. OR in the stop-running-until
+            flag and return, paused. */
+            if (Policy::breakpoints && (rununtil & 0x10000) == 0)
             {
-                step();
-                if (pendingIEnable)
-                {
-                    if (pendingIEnable == 2)
-                    {
-                        ienable = true;
-                        pendingIEnable = 0;
-                    }
-                    else pendingIEnable++;
-                }
-
-                if (pendingIDisable)
-                {
-                    if (pendingIDisable == 2)
-                    {
-                        ienable = false;
-                        pendingIDisable = 0;
-                    }
-                    else pendingIDisable++;
-                }
-
-                /* If the "don't run-until flag" isn't set,
-                which means we're running until PC equals
-                debugger.rununtil & 0xFFFF, enable stepmode
-                until we reach it. OR in the stop-running-until
-                flag and return, paused. */
-                if (!debugger.closed && (debugger.rununtil & 0x10000) == 0)
-                {
-                    if (PC == debugger.rununtil)
-                    {
-                        stepmode = true;
-                        debugger.rununtil |= 0x10000;
-                        return;
-                    }
-                }
-            }
-
-            if (ienable)
-                handleInterrupt();
-
-            // Update DIV timer
-            if (divcycles >= 256)
-            {
-                RAM[IO_DIV]++;
-                divcycles = 0;
-            }
-
-            // Update timer
-            if ((RAM[IO_TAC] & 4) && timercycles >= timerSpeeds[RAM[IO_TAC] & 3])
-            {
-                RAM[IO_TIMA]++;
-                timercycles = 0;
-                if (RAM[IO_TIMA] == 0)
+                if (PC == rununtil)
                 {
-                    RAM[IO_TIMA] = RAM[IO_TMA];
-                    RAM[IO_IF] |= INTERRUPT_TIMER;
+                    stepmode = true;
+                    rununtil |= 0x10000;
+                    return;
                 }
             }
-
         }
-        cycles -= maxcycles;
-    }
-
-    void run()
-    {
-
-        //uint32_t sec = SDL_GetTicks();
-        while (running)
-        {
-            uint32_t time = SDL_GetTicks();
-
-            exec(69905);
-
-            Joypad::update();
-
-            if (!debugger.closed)
-            {
-                debugger.update();
-                debugger.draw();
-            }
-
-            if (Joypad::pressed[SDL_SCANCODE_ESCAPE])
-            {
-
-                Joypad::pressed[SDL_SCANCODE_ESCAPE] = false;
-                if (debugger.closed)
-                    debugger.init();
-                else
-                    debugger.close();
-
-            }
 
+        if (ienable)
+            handleInterrupt();
 
-
-            frameticks++;
-            while(SDL_GetTicks() - time < 16);
-
-            /*
-            if (SDL_GetTicks() - sec >= 1000) {
-                sec = SDL_GetTicks();
-            }
-            */
-        }
-    }
-
-    void quit()
-    {
-        running = false;
+        if (skipIdleLoops && PC <= from && !halted)
+            checkIdleLoop<Policy>(from, maxcycles);
     }
+    cycles -= maxcycles;
+    gb.scheduler.rebase(maxcycles);
 }
+
@@ -1,9 +1,18 @@
 #ifndef CPU_H
 #define CPU_H
 #include <stdint.h>
-#include "debug.h"
-#include "tas.h"
 #include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <array>
+#include <utility>
+#include <memory>
+#include <chrono>
+#include "mbc.h"
+#include "romstore.h"
+#include "saveram.h"
+#include "state.h"
 
 const int ZERO_FLAG         = 0x80;
 const int SUBTRACT_FLAG     = 0x40;
@@ -59,60 +68,130 @@ const uint8_t INTERRUPT_TIMER   = 0x4;
 
 const uint8_t INTERRUPT_HILO    = 0x10;
 
-class Debugger;
+class GameBoy;
 
-namespace CPU
+class CPU
 {
-    extern std::string romtitle;
-    extern uint8_t currentROMBank;
+public:
+    std::string romtitle;
+    uint16_t currentROMBank = 0;
 
-    extern Debugger debugger;
-    extern bool opendebugger;
+    uint8_t A = 0, F = 0,
+            B = 0, C = 0,
+            D = 0, E = 0,
+            H = 0, L = 0;
 
-    extern TAS tasplayer;
+    uint16_t SP = 0;
+    uint16_t PC = 0;
 
-    extern uint8_t  A, F,
-                    B, C,
-                    D, E,
-                    H, L;
+    bool runningBootROM = false;
 
-    extern uint16_t SP;
-    extern uint16_t PC;
+    uint8_t RAM[0x10000] = {};
 
-    extern bool runningBootROM;
+    bool stepmode = false;
+    int takestep = 0;
 
-    extern uint8_t RAM[];
+    // Enter step mode once PC reaches the low 16 bits, unless bit 16 is set
+    uint32_t rununtil = 0x10000;
 
-    extern bool stepmode;
-    extern int takestep;
+    /* Run with the debug policy, which is the only one that looks at
+       stepmode, rununtil and trace. Taken up at the next exec(), so
+       a change shows from the next frame on. */
+    bool debugging = false;
+    // Log each instruction run to, while debugging
+    std::ostream* trace = nullptr;
 
-    extern bool accessOAM;
-    extern bool accessVRAM;
+    bool accessOAM = true;
+    bool accessVRAM = true;
 
-    /* These 4 timers get saved in save states */
-    extern uint32_t cycles;
-    extern uint32_t divcycles;
-    extern uint32_t timercycles;
-    extern uint32_t frameticks;
+    /* These timers get saved in save states, with the divider */
+    uint32_t cycles = 0;
+    uint32_t frameticks = 0;
 
-    void doVBlank();
+    CPU(GameBoy& gb);
+    ~CPU();
+    CPU(const CPU&) = delete;
+    CPU& operator=(const CPU&) = delete;
 
     uint16_t AF();
     uint16_t BC();
     uint16_t DE();
     uint16_t HL();
 
-    inline bool getZero() { return F & ZERO_FLAG; }
-    inline bool getSubtract() { return F & SUBTRACT_FLAG; }
-    inline bool getHalfCarry() { return F & HALF_CARRY_FLAG; }
-    inline bool getCarry() { return F & CARRY_FLAG; }
+    bool getZero() { return F & ZERO_FLAG; }
+    bool getSubtract() { return F & SUBTRACT_FLAG; }
+    bool getHalfCarry() { return F & HALF_CARRY_FLAG; }
+    bool getCarry() { return F & CARRY_FLAG; }
 
-    uint8_t read(uint16_t loc);
-    void write(uint16_t loc, uint8_t byte);
+    uint8_t read(uint16_t loc)
+    {
+        uint8_t* page = readPages[loc >> 8];
+        if (page)
+            return page[loc & 0xFF];
+        return readHandler(loc);
+    }
 
-    void setBank(uint8_t bank);
+    void write(uint16_t loc, uint8_t byte)
+    {
+        uint8_t* page = writePages[loc >> 8];
+        if (page)
+            page[loc & 0xFF] = byte;
+        else
+            writeHandler(loc, byte);
+    }
 
-    extern uint32_t frameticks;
+    // Build the memory map from the current cartridge state
+    void initMemoryMap();
+
+    // Remap the ROM banks after the controller switched them
+    void mapROM();
+
+    // Remap pages after their access rules change
+    void setVRAMAccess(bool b);
+    void setOAMAccess(bool b);
+    void mapExternalRAM();
+
+    // Execute a single instruction
+    void step();
+
+    /* Give every memory access of the interpreter its own M-cycle, for
+       ROMs that race the PPU or the timer within an instruction. Slower,
+       and runs without predecoded or compiled blocks. */
+    bool cycleAccurate = false;
+
+    // Run until cycles reaches maxcycles, then wind cycles back by it
+    void exec(uint32_t maxcycles);
+
+    // Run predecoded blocks instead of the plain interpreter
+    bool cachedInterpreter = false;
+    // Translate hot blocks to host code
+    bool useJIT = false;
+    // Drop every predecoded block
+    void flushBlockCache();
+
+    // Skip iterations of loops that only wait for an event
+    bool skipIdleLoops = true;
+    // Print the cycles skipped in each idle loop
+    void reportIdleLoops(std::ostream& out);
+
+    // One predecoded instruction of a block
+    struct MicroOp
+    {
+        void (*execute)(CPU& cpu);
+        uint16_t operand;
+        uint8_t opcode;     // 0xCB with the CB opcode as operand
+        uint8_t length;
+        uint8_t cycles;
+    };
+
+    /* Used by translated code */
+    uint16_t decodedOperand = 0;
+    uint8_t* readPages[0x100] = {};
+    uint8_t* writePages[0x100] = {};
+
+    // The work of exec() between two instructions of a compiled
+    // block, returning a JIT::Exit
+    int jitPoll(uint16_t next);
 
     void initBootROM(const char* filename);
     // Return 1 on bad filename
@@ -120,10 +199,283 @@ namespace CPU
     void hardreset();
     void reset();
 
-    void run();
+    /* Save file of a battery-backed cartridge, opened by hardreset().
+       Left empty, cartridge RAM only lasts as long as the instance */
+    std::string savePath;
+    // Seconds between starting writebacks of the save file
+    double saveInterval = 1;
+
+    // Start writing the save file back once saveInterval has passed
+    void flushSave();
+    // Write the save file back and wait for it, before it is let go
+    void closeSave();
+
+    // The registers, a line each
+    void printStatus(std::ostream& out);
+
+    /* The CPU's part of a save state: the cartridge it is for, the
+       registers, RAM, the controller and cartridge RAM. Loading returns
+       false, having changed nothing, if the state is for another
+       cartridge. The memory map is rebuilt after every part is loaded */
+    void saveState(StateWriter& state);
+    bool loadState(StateReader& state);
+    // Read the cartridge at the start of a state, return whether it's this one
+    bool matchesState(StateReader& state);
+
+    /* Pages written, for snapshots. Memory pages are the 256 of RAM
+       followed by those of cartridge RAM. Once trackWrites() is called,
+       the first write to each page after it goes through writeHandler,
+       which marks the page and maps it back. Until then, every page
+       counts as written. Bulk changes (a reset, loading a state) mark
+       every page */
+    void trackWrites();
+    bool pageWritten(size_t page) const { return !trackingWrites || written[page]; }
+    uint8_t* cartridgeRAM() { return EXTERNAL_RAM; }
+    uint32_t cartridgeRAMSize() const { return externalRAMSize; }
+
+private:
+    GameBoy& gb;
+
+    const char* bootdir = nullptr;
+    uint8_t* bootrom = nullptr;
+
+    // Shared with every other instance running the same ROM
+    std::shared_ptr<const ROMImage> rom;
+    const uint8_t* ROM = nullptr;
+    const uint8_t* CART_ROM = nullptr;
+    uint16_t romBanks = 2;
+    uint16_t currentROMBank0 = 0;
+
+    uint8_t* EXTERNAL_RAM = nullptr;
+    uint32_t externalRAMSize = 0;
+    SaveRAM saveRAM;
+    std::chrono::steady_clock::time_point nextFlush;
+
+    // Interrupt enable
+    bool ienable = true;
+    int pendingIEnable = 0, pendingIDisable = 0;
+
+    bool halted = false;
+    bool haltskip = false;
+
+    // Memory Bank Controller
+    MBC mbc;
+
+    /* Power-on contents of uninitialized RAM, kept per instance: the
+       sequence of std::minstd_rand, with its state out in the open so
+       that save states carry it */
+    uint32_t noiseState = 1;
+    uint8_t noise()
+    {
+        noiseState = (uint64_t)noiseState * 48271 % 2147483647;
+        return noiseState;
+    }
+
+    /* Block cache, see cpu.cpp */
+
+    // A block translated to host code, as JIT::Code
+    typedef void (*Code)();
+
+    struct Block
+    {
+        std::vector<MicroOp> ops;
+        uint32_t hits = 0;
+        Code code = nullptr;
+    };
+
+    std::unordered_map<uint32_t, Block> blocks;
+
+    // Keys of the blocks decoded from each RAM page
+    std::vector<uint32_t> codePages[0x100];
+    bool codeBytes[0x10000] = {};
+
+    /* Write tracking, see trackWrites(). writeTargets is the write map
+       as mapped, before pages were taken out of writePages for it */
+    bool trackingWrites = false;
+    std::vector<uint8_t> written;
+    uint8_t* writeTargets[0x100] = {};
+
+    // Block being run and the micro-op to run next
+    Block* currentBlock = nullptr;
+    size_t currentOpIndex = 0;
+    uint16_t nextPC = 0;
+
+    /* Idle loops, see cpu.cpp */
+    static const int MAX_LOOP_READS = 4;
+
+    // Analysis of the loop at a ROM address
+    struct IdleLoop
+    {
+        uint32_t key = ~0u;
+        bool idle;
+        uint16_t end;                   // the branch back to the head
+        uint8_t written;                // registers the body changes
+        uint8_t readFrom;               // registers that address its reads
+        uint8_t fixedReads;
+        uint16_t reads[MAX_LOOP_READS]; // fixed addresses it reads
+    };
+
+    // Loop head being checked, with the state and time it was reached at
+    struct IdleProbe
+    {
+        bool active = false;
+        uint16_t head;
+        uint32_t start;
+        uint32_t next;
+        uint8_t regs[8];
+        uint16_t SP;
+    };
+
+    std::unordered_map<uint32_t, uint64_t> idleLoopCycles;
+    IdleLoop idleLoops[0x400];
+    IdleProbe probe;
+
+    // Cycle count the running exec() stops at
+    uint32_t execLimit = 0;
+
+    /* What exec() is compiled with. The fast policy leaves every
+       debugger hook out of the loop, the debug policy checks them
+       between instructions. */
+    struct FastPolicy
+    {
+        static const bool stepping = false;
+        static const bool breakpoints = false;
+        static const bool tracing = false;
+    };
+    struct DebugPolicy
+    {
+        static const bool stepping = true;
+        static const bool breakpoints = true;
+        static const bool tracing = true;
+    };
+
+    /* Opcode tables, see cpu.cpp */
+    struct OpEntry
+    {
+        void (*execute)(CPU& cpu);
+        uint8_t cycles;
+    };
+
+    struct MemoryFetch;
+    struct DecodedFetch;
+    struct CycleFetch;
+
+    // Cycles CycleFetch has run ahead of the instruction's count
+    uint32_t prepaid = 0;
+
+    static const std::array<OpEntry, 256> opcodeTable;
+    static const std::array<OpEntry, 256> decodedOpcodeTable;
+    static const std::array<OpEntry, 256> cycleOpcodeTable;
+    static const std::array<OpEntry, 256> prefixCBTable;
+    static const std::array<OpEntry, 256> cyclePrefixCBTable;
+
+    template <typename Fetch, size_t... ops>
+    static constexpr std::array<OpEntry, 256> makeOpcodeTable(std::index_sequence<ops...>);
+    template <typename Fetch, size_t... ops>
+    static constexpr std::array<OpEntry, 256> makePrefixCBTable(std::index_sequence<ops...>);
+    template <typename Fetch> static const std::array<OpEntry, 256>& opcodes();
+    template <typename Fetch> static const std::array<OpEntry, 256>& prefixCBOpcodes();
+
+    // Table entries, running one opcode on a CPU
+    template <uint8_t op, typename Fetch>
+    static void execute(CPU& cpu) { cpu.instruction<op, Fetch>(); }
+    template <uint8_t op, typename Fetch>
+    static void executeCB(CPU& cpu) { cpu.prefixCBInstruction<op, Fetch>(); }
+
+    /* Memory */
+    void mapVRAM();
+    void mapOAM();
+    void protectCodePage(uint8_t page);
+    size_t memoryPage(const uint8_t* mem);
+    void mapWritePages(uint32_t start, uint32_t end, uint8_t* mem);
+    void markWritten();
+    void invalidateCodePage(uint8_t page);
+    uint8_t readHandler(uint16_t loc);
+    void writeHandler(uint16_t loc, uint8_t byte);
+    template <typename Fetch> void writeWord(uint16_t loc, uint16_t word);
+    uint8_t getImmediateByte();
+    uint16_t getImmediateWord();
+    void tick(uint32_t t);
+
+    /* ALU */
+    void setZeroFlag(bool b);
+    void setSubtractFlag(bool b);
+    void setHalfCarryFlag(bool b);
+    void setCarryFlag(bool b);
+    void setHL(uint16_t word);
+    void add(uint8_t value);
+    void adc(uint8_t value);
+    void sub(uint8_t value);
+    void sbc(uint8_t value);
+    void cp(uint8_t value);
+    void inc(uint8_t& a);
+    void dec(uint8_t& a);
+    void addWord(uint16_t value);
+    void incPair(uint8_t& h, uint8_t& l);
+    void decPair(uint8_t& h, uint8_t& l);
+    template <typename Fetch> void pushWord(uint16_t val);
+    template <typename Fetch> uint16_t popWord();
+    template <typename Fetch> void JRIF(bool b);
+    template <typename Fetch> void RETIF(bool b);
+    template <typename Fetch> void JPIF(bool b);
+    template <typename Fetch> void CALLIF(bool b);
+    template <typename Fetch> void RST(uint8_t pos);
+    void stop();
+    void EI();
+    void DI();
+    void rlc(uint8_t& reg);
+    void rrc(uint8_t& reg);
+    void rl(uint8_t& reg);
+    void rr(uint8_t& reg);
+    void sla(uint8_t& reg);
+    void sra(uint8_t& reg);
+    void swap(uint8_t& reg);
+    void srl(uint8_t& reg);
+
+    /* Instructions */
+    template <uint8_t r> uint8_t& reg();
+    template <uint8_t r, typename Fetch> uint8_t getOperand();
+    template <uint8_t r, typename Fetch> void setOperand(uint8_t value);
+    template <uint8_t r, void (CPU::*func)(uint8_t&), typename Fetch> void modifyOperand();
+    template <uint8_t p> uint16_t getPair();
+    template <uint8_t p> void setPair(uint16_t word);
+    template <uint8_t p> uint16_t getStackPair();
+    template <uint8_t p> void setStackPair(uint16_t word);
+    template <uint8_t cc> bool condition();
+    template <uint8_t y> void alu(uint8_t value);
+    template <uint8_t y> void rotate(uint8_t& reg);
+    template <uint8_t bit> void resetBit(uint8_t& reg);
+    template <uint8_t bit> void setBit(uint8_t& reg);
+    void invalidOpcode(uint8_t opcode);
+    template <uint8_t op, typename Fetch> void instruction();
+    template <uint8_t op, typename Fetch> void prefixCBInstruction();
+    template <typename Fetch> void prefixCB();
+    template <typename Fetch> void stepWith();
+
+    /* Block cache */
+    uint32_t blockKey(uint16_t pc);
+    Block* decodeBlock(uint16_t start);
+    Block* findBlock(uint16_t pc);
+    void stepCached();
+
+    /* Idle loops */
+    bool analyzeLoopOp(IdleLoop& loop, uint16_t& pc, uint16_t head, bool& closed);
+    const IdleLoop& findIdleLoop(uint16_t head);
+    void saveProbeState();
+    bool sameProbeState();
+    template <typename Policy> void checkIdleLoop(uint16_t from, uint32_t maxcycles);
 
-    void quit();
-}
+    /* Interrupts and exec() */
+    void interrupt(uint16_t pos);
+    void handleInterrupt();
+    void updatePendingInterrupts();
+    bool needsPoll();
+    void resetCompiledBlocks();
+    template <typename Policy> Code compiledBlock();
+    template <typename Policy> bool watched();
+    template <typename Policy, typename Fetch> void execWith(uint32_t maxcycles);
+    void traceInstruction();
+};
 
 char* readFileBytes(const char *name, uint32_t* len = nullptr);
 
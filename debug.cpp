@@ -1,6 +1,7 @@
 #include "debug.h"
 #include <SDL2/SDL.h>
-#include "cpu.h"
+#include "gameboy.h"
+#include "frontend.h"
 #include <iostream>
 #include <vector>
 #include <sstream>
@@ -10,18 +11,13 @@
 #include "checkbox.h"
 #include "textbox.h"
 #include "dis.h"
-#include "apu.h"
-#include "gpu.h"
-#include "joypad.h"
+#include "statefile.h"
 #include <fstream>
 
 const uint32_t width = 640;
 const uint32_t height = 400;
 
-std::vector<uint32_t> charmap;
-
-std::stringstream ss;
-void enableHex(int w)
+void Debugger::enableHex(int w)
 {
     ss << std::hex << std::uppercase << std::setw(w) << std::setfill('0');
 }
@@ -44,14 +40,14 @@ const char* getMemoryName(uint16_t pos)
     else return "";
 }
 
-Debugger::Debugger()
+// Font of the debugger, loaded the first time it is drawn
+static const std::vector<uint32_t>& getCharmap()
 {
-
-    /* Load charmap */
-    if (charmap.size() == 0)
+    static const std::vector<uint32_t> charmap = []
     {
         uint32_t len = 288 * 112;
         uint32_t w, h;
+        std::vector<uint32_t> charmap;
         std::vector<unsigned char> image; //the raw pixels
         lodepng::decode(image, w, h, "charmap.png");
         charmap.resize(len);
@@ -62,19 +58,24 @@ Debugger::Debugger()
             else if(i % 4 == 2) rawpix[i] = image[i-2];
             else rawpix[i] = image[i];
         }
-        image.clear();
-    }
+        return charmap;
+    }();
+    return charmap;
+}
 
+Debugger::Debugger(Frontend& frontend)
+: frontend(frontend), gb(frontend.gb)
+{
     // Make Window Componentss
 
     // Do one CPU step
     Button* button_step = new Button("step", 6, 168, 64, 18);
     button_step->onclick = [](Debugger* debugger)
                             {
-                                CPU::stepmode = true;
-                                CPU::takestep = 1;
+                                debugger->gb.cpu.stepmode = true;
+                                debugger->gb.cpu.takestep = 1;
                                 // Override rununtil
-                                debugger->rununtil |= 0x10000;
+                                debugger->gb.cpu.rununtil |= 0x10000;
                             };
     components.push_back(button_step);
 
@@ -82,8 +83,8 @@ Debugger::Debugger()
     button_step_count = new Button("step x1", 6, 210, 108, 18);
     button_step_count->onclick = [](Debugger* debugger)
                             {
-                                CPU::stepmode = true;
-                                CPU::takestep = debugger->stepcount;
+                                debugger->gb.cpu.stepmode = true;
+                                debugger->gb.cpu.takestep = debugger->stepcount;
                             };
     components.push_back(button_step_count);
 
@@ -108,8 +109,8 @@ Debugger::Debugger()
     button_run_until = new Button("run to ?", 6, 276, 108, 18);
     button_run_until->onclick = [](Debugger* debugger)
                             {
-                                CPU::stepmode = true;
-                                debugger->rununtil &= 0xFFFF;
+                                debugger->gb.cpu.stepmode = true;
+                                debugger->gb.cpu.rununtil &= 0xFFFF;
                             };
     components.push_back(button_run_until);
 
@@ -120,24 +121,24 @@ Debugger::Debugger()
                             {
                                 std::stringstream ss;
                                 ss << std::hex << self->text;
-                                ss >> debugger->rununtil;
+                                ss >> debugger->gb.cpu.rununtil;
                                 ss.str(std::string());
                                 ss.clear();
 
-                                debugger->rununtil |= 0x10000;
+                                debugger->gb.cpu.rununtil |= 0x10000;
 
-                                ss << "run to " << (debugger->rununtil & 0xFFFF);
+                                ss << "run to " << (debugger->gb.cpu.rununtil & 0xFFFF);
                                 debugger->button_run_until->setText(ss.str());
                             };
     components.push_back(run_until_enter);
 
     // Toggle CPU instruction stepping
     CheckBox* toggle_step = new CheckBox(74, 168);
-    toggle_step->check = &CPU::stepmode;
+    toggle_step->check = &gb.cpu.stepmode;
     toggle_step->oncheck = [](Debugger* debugger)
                             {
                                 // Override run until
-                                debugger->rununtil |= 0x10000;
+                                debugger->gb.cpu.rununtil |= 0x10000;
                             };
     components.push_back(toggle_step);
 
@@ -145,10 +146,10 @@ Debugger::Debugger()
     Button* button_reset = new Button("\x0F", 94, 168, 20, 18);
     button_reset->onclick = [](Debugger* debugger)
                             {
-                                CPU::reset();
-                                CPU::stepmode = true;
+                                debugger->gb.cpu.reset();
+                                debugger->gb.cpu.stepmode = true;
                                 // Override run until
-                                debugger->rununtil |= 0x10000;
+                                debugger->gb.cpu.rununtil |= 0x10000;
                             };
     components.push_back(button_reset);
 
@@ -184,19 +185,19 @@ Debugger::Debugger()
 
     /* Toggle sound channels */
     CheckBox* toggle_pulse1 = new CheckBox(612, 8);
-    toggle_pulse1->check = &APU::channelEnabled[0];
+    toggle_pulse1->check = &gb.apu.channelEnabled[0];
     components.push_back(toggle_pulse1);
 
     CheckBox* toggle_pulse2 = new CheckBox(612, 32);
-    toggle_pulse2->check = &APU::channelEnabled[1];
+    toggle_pulse2->check = &gb.apu.channelEnabled[1];
     components.push_back(toggle_pulse2);
 
     CheckBox* toggle_wave = new CheckBox(612, 56);
-    toggle_wave->check =   &APU::channelEnabled[2];
+    toggle_wave->check =   &gb.apu.channelEnabled[2];
     components.push_back(toggle_wave);
 
     CheckBox* toggle_noise = new CheckBox(612, 80);
-    toggle_noise->check =  &APU::channelEnabled[3];
+    toggle_noise->check =  &gb.apu.channelEnabled[3];
     components.push_back(toggle_noise);
 
     /* Enter rom to load */
@@ -205,7 +206,8 @@ Debugger::Debugger()
     load_enter->setHex(false);
     load_enter->onenter = [](TextBox* self, Debugger* debugger)
                             {
-                                CPU::init(self->text.c_str());
+                                if (!debugger->gb.cpu.init(self->text.c_str()))
+                                    debugger->frontend.raise();
                             };
     components.push_back(load_enter);
 
@@ -215,97 +217,65 @@ Debugger::Debugger()
     tas_enter->setHex(false);
     tas_enter->onenter = [](TextBox* self, Debugger* debugger)
                             {
-                                CPU::tasplayer.loadVBM(self->text.c_str());
+                                if (!debugger->gb.tasplayer.loadVBM(self->text.c_str()))
+                                    debugger->frontend.raise();
                             };
     components.push_back(tas_enter);
 
     Button* tas_stop = new Button("Stop", 582, 120, 48, 18);
     tas_stop->onclick = [](Debugger* debugger)
                             {
-                                CPU::tasplayer.stop();
+                                debugger->gb.tasplayer.stop();
                             };
     components.push_back(tas_stop);
 
-    #define OSTREAM_WRITE_U32(fout, value) \
-            fout.put(value >> 24); \
-            fout.put(value >> 16); \
-            fout.put(value >> 8); \
-            fout.put(value);
-
     /* Save states */
     Button* save_state = new Button("Save State", 426, 6, 108, 18);
     save_state->onclick = [](Debugger* debugger)
                             {
-                                std::ofstream state;
-                                std::string title = "states/" + CPU::romtitle + ".sav";
-                                state.open(title, std::ios::binary | std::ios::out);
-                                state.put(CPU::currentROMBank);
-                                OSTREAM_WRITE_U32(state, CPU::cycles);
-                                OSTREAM_WRITE_U32(state, CPU::divcycles);
-                                OSTREAM_WRITE_U32(state, CPU::timercycles);
-                                OSTREAM_WRITE_U32(state, CPU::frameticks);
-                                for(int i = 0; i < 4; i++)
-                                    state.write((char*)&APU::channel[i], sizeof(Channel));
-                                state.put(CPU::PC >> 8);
-                                state.put(CPU::PC);
-                                state.put(CPU::SP >> 8);
-                                state.put(CPU::SP);
-                                state.put(CPU::A);
-                                state.put(CPU::F);
-                                state.put(CPU::B);
-                                state.put(CPU::C);
-                                state.put(CPU::D);
-                                state.put(CPU::E);
-                                state.put(CPU::H);
-                                state.put(CPU::L);
-                                state.write((char*)CPU::RAM, 0x10000);
-                                state.close();
+                                GameBoy& gb = debugger->gb;
+                                std::string title = "states/" + gb.cpu.romtitle + ".sav";
+                                if (!debugger->frontend.persist.saveState(gb, title))
+                                    std::cout << "Still writing the last states, " << title << " not saved" << std::endl;
                             };
     components.push_back(save_state);
 
-    #undef OSTREAM_WRITE_U32
-
-    #define OSTREAM_READ_U32(fin, value) \
-            value = fin.get() << 24; \
-            value |= fin.get() << 16; \
-            value |= fin.get() << 8; \
-            value |= fin.get(); \
-
     Button* load_state = new Button("Load State", 426, 32, 108, 18);
     load_state->onclick = [](Debugger* debugger)
                             {
-                                CPU::hardreset();
-                                std::ifstream state;
-                                std::string title = "states/" + CPU::romtitle + ".sav";
-                                state.open(title, std::ios::binary | std::ios::in);
-                                CPU::setBank(state.get());
-                                OSTREAM_READ_U32(state, CPU::cycles);
-                                OSTREAM_READ_U32(state, CPU::divcycles);
-                                OSTREAM_READ_U32(state, CPU::timercycles);
-                                OSTREAM_READ_U32(state, CPU::frameticks);
-                                for(int i = 0; i < 4; i++)
-                                    state.read((char*)&APU::channel[i], sizeof(Channel));
-                                CPU::PC = state.get() << 8;
-                                CPU::PC |= state.get();
-                                CPU::SP = state.get() << 8;
-                                CPU::SP |= state.get();
-                                CPU::A = state.get();
-                                CPU::F = state.get();
-                                CPU::B = state.get();
-                                CPU::C = state.get();
-                                CPU::D = state.get();
-                                CPU::E = state.get();
-                                CPU::H = state.get();
-                                CPU::L = state.get();
-                                state.read((char*)CPU::RAM, 0x10000);
-                                state.close();
-                                GPU::raise();
+                                GameBoy& gb = debugger->gb;
+                                std::string title = "states/" + gb.cpu.romtitle + ".sav";
+                                // A state just saved may still be on its way
+                                debugger->frontend.persist.wait();
+                                std::ifstream state(title, std::ios::binary);
+                                std::vector<uint8_t> buffer;
+                                if (!StateFile::read(state, buffer) || !gb.loadState(buffer))
+                                    std::cout << "No state for this game in " << title << std::endl;
+                                debugger->frontend.raise();
                             };
     components.push_back(load_state);
-    #undef OSTREAM_READ_U32
+
+    Button* screenshot = new Button("Screenshot", 426, 58, 108, 18);
+    screenshot->onclick = [](Debugger* debugger)
+                            {
+                                GameBoy& gb = debugger->gb;
+                                std::string title = "screenshots/" + gb.cpu.romtitle + "-" +
+                                                    std::to_string(gb.gpu.frames) + ".png";
+                                if (!debugger->frontend.persist.saveScreenshot(gb, title))
+                                    std::cout << "Still writing the last files, " << title << " not saved" << std::endl;
+                            };
+    components.push_back(screenshot);
 
 }
 
+Debugger::~Debugger()
+{
+    if (!closed)
+        close();
+    for (Component* component : components)
+        delete component;
+}
+
 // Create the window
 void Debugger::init()
 {
@@ -322,21 +292,22 @@ void Debugger::init()
 
     pixels = new uint32_t[width * height];
     closed = false;
+    gb.cpu.debugging = true;
 }
 
 // Update logic information
 void Debugger::update()
 {
-    if (!Joypad::control) {
+    if (!frontend.control) {
         for (uint32_t i = 0; i < components.size(); i++)
             components[i]->update(this);
     }
 
     if (memorystart > 0xFF20) memorystart = 0xFF20;
 
-    if ((rununtil & 0x10000) == 0)
+    if ((gb.cpu.rununtil & 0x10000) == 0)
     {
-        CPU::stepmode = false;
+        gb.cpu.stepmode = false;
     }
 }
 
@@ -379,14 +350,14 @@ void Debugger::drawDisassembly(int32_t x, int32_t y)
     fillRect(0xEFEFEF, x + 6, y + 6, 288, 144);
 
     // Disassemble 12 bytes around to get an accurate scope of disassembled code
-    int back = CPU::PC - 12;
+    int back = gb.cpu.PC - 12;
     if (back < 0) back = 0;
-    std::vector<Instruction> disassembly = Disassembler::disassembleRAM(back, CPU::PC + 12);
+    std::vector<Instruction> disassembly = Disassembler::disassembleRAM(gb.cpu, back, gb.cpu.PC + 12);
     // Find the instruction that's located at PC
     uint32_t pcInstr;
     for (uint32_t i = 0; i < disassembly.size(); i++)
     {
-        if (CPU::PC == disassembly[i].pos)
+        if (gb.cpu.PC == disassembly[i].pos)
         {
             pcInstr = i;
             break;
@@ -401,7 +372,7 @@ void Debugger::drawDisassembly(int32_t x, int32_t y)
         if (op >= disassembly.size()) continue;
 
         Instruction* instr = &disassembly[op];
-        bool atPC = CPU::PC == instr->pos;
+        bool atPC = gb.cpu.PC == instr->pos;
         int32_t yp = y + 10 + i * 20;
 
         // Highlight current instruction
@@ -461,13 +432,13 @@ void Debugger::drawMemory(int32_t x, int32_t y)
         // Draw bytes
         enableHex(2);
         if (i < 0x8000 || (i >= 0xA000 && i < 0xFE00))
-            ss << (int)CPU::read(i);
+            ss << (int)gb.cpu.read(i);
         else
-            ss << (int)CPU::RAM[i];
+            ss << (int)gb.cpu.RAM[i];
 
         uint32_t bytecol = 0xF0F0F0;
-        if (CPU::PC == i) bytecol = 0xA1A100;
-        else if (CPU::SP == i) bytecol = 0xCC297A;
+        if (gb.cpu.PC == i) bytecol = 0xA1A100;
+        else if (gb.cpu.SP == i) bytecol = 0xCC297A;
 
         write(ss.str(), bytecol, x + 106 + ((i-memorystart) % bytewidth) * 24,
               y + 4 + 16 * ((i-memorystart) / bytewidth));
@@ -486,14 +457,14 @@ void Debugger::drawRegs(int32_t x, int32_t y)
 
     // Draw PC
     enableHex(4);
-    ss << CPU::PC;
+    ss << gb.cpu.PC;
     write("PC :", 0xA1A100, x + 9, y + 14 * off);
-    write(ss.str(), CPU::PC >= 0x8000 ? 0x8F0000 : 0xF0F0F0, x + 6 * 9, y + 14 * off++);
+    write(ss.str(), gb.cpu.PC >= 0x8000 ? 0x8F0000 : 0xF0F0F0, x + 6 * 9, y + 14 * off++);
     ss.str("");
     enableHex(4);
 
     // Draw SP
-    ss << CPU::SP;
+    ss << gb.cpu.SP;
     write("SP :", 0xCC297A, x + 9, y + 14 * off);
     write(ss.str(), 0xF0F0F0, x + 6 * 9, y + 14 * off++);
     ss.str("");
@@ -501,7 +472,7 @@ void Debugger::drawRegs(int32_t x, int32_t y)
 
 
     #define DRAW_R(reg) \
-        ss << CPU:: reg (); \
+        ss << gb.cpu. reg (); \
         write(#reg " :", 0x006699, x + 9, y + 14 * off); \
         write(ss.str(), 0xF0F0F0, x + 6 * 9, y + 14 * off++); \
         ss.str(""); \
@@ -512,10 +483,10 @@ void Debugger::drawRegs(int32_t x, int32_t y)
     DRAW_R(HL);
     #undef DRAW_R
 
-    write("zero", (CPU::getZero() ? 0xE6E600 : 0x363636), x + 9, y + 14 * off++);
-    write("subtract", (CPU::getSubtract() ? 0xE6E600 : 0x363636), x + 9, y + 14 * off++);
-    write("half carry", (CPU::getHalfCarry() ? 0xE6E600 : 0x363636), x + 9, y + 14 * off++);
-    write("carry", (CPU::getCarry() ? 0xE6E600 : 0x363636), x + 9, y + 14 * off++);
+    write("zero", (gb.cpu.getZero() ? 0xE6E600 : 0x363636), x + 9, y + 14 * off++);
+    write("subtract", (gb.cpu.getSubtract() ? 0xE6E600 : 0x363636), x + 9, y + 14 * off++);
+    write("half carry", (gb.cpu.getHalfCarry() ? 0xE6E600 : 0x363636), x + 9, y + 14 * off++);
+    write("carry", (gb.cpu.getCarry() ? 0xE6E600 : 0x363636), x + 9, y + 14 * off++);
 }
 
 // Fill a rectangle of color
@@ -552,6 +523,8 @@ void Debugger::drawChar(char c, uint32_t col, int32_t xo, int32_t yo)
 {
     if (!pixels) return;
 
+    const std::vector<uint32_t>& charmap = getCharmap();
+
     uint32_t xow = xo + 9;
     uint32_t yoh = yo + 14;
     for (uint32_t y = yo; y < yoh; y++)
@@ -599,6 +572,11 @@ uint32_t Debugger::getWindowID()
 void Debugger::close()
 {
     closed = true;
+    // Breakpoints and stepping only hold while the debugger is open,
+    // from the next frame the CPU runs without them
+    gb.cpu.debugging = false;
+    gb.cpu.stepmode = false;
+    gb.cpu.rununtil |= 0x10000;
     SDL_DestroyWindow(window);
     SDL_DestroyTexture(videoTexture);
     SDL_DestroyRenderer(renderer);
@@ -3,11 +3,14 @@
 #include <stdint.h>
 #include <vector>
 #include <string>
+#include <sstream>
 
 struct SDL_Window;
 struct SDL_Renderer;
 struct SDL_Texture;
 
+class GameBoy;
+class Frontend;
 class Component;
 class Button;
 
@@ -21,6 +24,10 @@ private:
 
     std::vector<Component*> components;
 
+    // Text of the numbers being drawn
+    std::stringstream ss;
+    void enableHex(int w);
+
     Button* button_step_count;
     Button* button_run_until;
 
@@ -28,16 +35,18 @@ private:
     void drawMemory(int32_t, int32_t);
     void drawDisassembly(int32_t, int32_t);
 public:
-    bool closed;
+    Frontend& frontend;
+    GameBoy& gb;
+
+    bool closed = true;
 
-    uint32_t* pixels;
+    uint32_t* pixels = nullptr;
 
     int32_t memorystart = 0x0000;
     int32_t stepcount = 1;
 
-    uint32_t rununtil = 0x10000;
-
-    Debugger();
+    Debugger(Frontend& frontend);
+    ~Debugger();
 
     void init();
 
@@ -293,7 +293,7 @@ namespace Disassembler
 
     }
 
-    std::vector<Instruction> disassembleRAM(uint32_t pos, uint32_t end)
+    std::vector<Instruction> disassembleRAM(CPU& cpu, uint32_t pos, uint32_t end)
     {
         std::vector<Instruction> instructions;
 
@@ -302,18 +302,18 @@ namespace Disassembler
             uint32_t start = pos; // Start of instruction
             std::vector<uint16_t> bytes; // Storage of existing bytes
 
-            std::string op = opcodes[CPU::read(pos)];
-            bytes.push_back(CPU::read(pos++));
+            std::string op = opcodes[cpu.read(pos)];
+            bytes.push_back(cpu.read(pos++));
 
             int32_t getb = op.find("%b");
             int32_t getw = op.find("%w");
             uint8_t byte;
             uint16_t word;
 
-            #define dis_get_byte() { byte = CPU::read(pos++); \
+            #define dis_get_byte() { byte = cpu.read(pos++); \
                 bytes.push_back(byte); }
 
-            #define dis_get_word() {word = CPU::read(pos) | (CPU::read(pos + 1) << 8);\
+            #define dis_get_word() {word = cpu.read(pos) | (cpu.read(pos + 1) << 8);\
                 pos += 2; bytes.push_back(word & 0xFF); bytes.push_back(word >> 8);}
 
             if (getb == -1 && getw != -1) dis_get_word()
@@ -3,6 +3,8 @@
 #include <iostream>
 #include <vector>
 
+class CPU;
+
 struct Instruction
 {
     uint32_t pos;
@@ -14,7 +16,7 @@ struct Instruction
 namespace Disassembler
 {
     void init();
-    std::vector<Instruction> disassembleRAM(uint32_t start, uint32_t end);
+    std::vector<Instruction> disassembleRAM(CPU& cpu, uint32_t start, uint32_t end);
 }
 
 #endif
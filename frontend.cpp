@@ -0,0 +1,288 @@
+#include "frontend.h"
+#include <SDL2/SDL.h>
+#include "gameboy.h"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+
+// Keys of the joypad buttons, in the bit order of Joypad::held
+static const SDL_Scancode keys[8] =
+{
+    SDL_SCANCODE_X,
+    SDL_SCANCODE_Z,
+    SDL_SCANCODE_RSHIFT,
+    SDL_SCANCODE_RETURN,
+    SDL_SCANCODE_RIGHT,
+    SDL_SCANCODE_LEFT,
+    SDL_SCANCODE_UP,
+    SDL_SCANCODE_DOWN
+};
+
+Frontend::Frontend(GameBoy& gb)
+: gb(gb), debugger(*this)
+{
+}
+
+Frontend::~Frontend()
+{
+    if (audioOpen)
+        SDL_CloseAudio();
+    if (!debugger.closed)
+        debugger.close();
+    SDL_DestroyTexture(videoTexture);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+}
+
+void Frontend::init()
+{
+    window = SDL_CreateWindow("GEM Gameboy Emulator", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                              160 * scale, 144 * scale, 0);
+
+    renderer = SDL_CreateRenderer(window, -1, 0);
+
+    // Scale info
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+    SDL_RenderSetLogicalSize(renderer, 160, 144);
+
+    videoTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                                     SDL_TEXTUREACCESS_STREAMING,
+                                     160, 144);
+
+    /* Initialize SDL_Audio Specifications */
+    SDL_AudioSpec desiredSpec;
+    desiredSpec.freq = APU::FREQUENCY;
+    desiredSpec.format = AUDIO_S16SYS;
+    desiredSpec.channels = 2; // Stereo
+    desiredSpec.samples = 512;
+    desiredSpec.callback = audioCallback;
+    desiredSpec.userdata = this;
+
+    SDL_AudioSpec obtainedSpec;
+
+    audioOpen = SDL_OpenAudio(&desiredSpec, &obtainedSpec) == 0;
+
+    SDL_PauseAudio(0);
+}
+
+/* SDL audio callback function */
+void Frontend::audioCallback(void* userdata, Uint8* stream, int length)
+{
+    ((Frontend*)userdata)->gb.apu.generateSamples((Sint16*) stream, length/2);
+}
+
+void Frontend::run()
+{
+    while (running)
+    {
+        if (pacer.runFrame())
+        {
+            // Holding R goes back a frame at a time instead
+            if (rewinding())
+                gb.rewind.stepBack();
+            else
+                gb.runFrame();
+        }
+        if (pacer.showFrame())
+            present();
+
+        handleEvents();
+
+        if (!debugger.closed)
+        {
+            debugger.update();
+            debugger.draw();
+        }
+
+        if (pressed[SDL_SCANCODE_ESCAPE])
+        {
+
+            pressed[SDL_SCANCODE_ESCAPE] = false;
+            if (debugger.closed)
+                debugger.init();
+            else
+                debugger.close();
+
+        }
+
+        pacer.wait();
+
+        Pacer::Stats stats;
+        if (pacer.report(stats))
+            showStats(stats);
+    }
+}
+
+// Speed controls, on the keys around the joypad's
+void Frontend::hotkey(int scancode)
+{
+    switch (scancode)
+    {
+    case SDL_SCANCODE_TAB:
+        // Uncapped turbo, and back
+        if (pacer.speed > 0)
+        {
+            normalSpeed = pacer.speed;
+            pacer.speed = 0;
+        }
+        else pacer.speed = normalSpeed;
+        break;
+    case SDL_SCANCODE_RIGHTBRACKET:
+        if (pacer.speed > 0 && pacer.speed < 4)
+            pacer.speed *= 2;
+        break;
+    case SDL_SCANCODE_LEFTBRACKET:
+        if (pacer.speed == 0)
+            pacer.speed = 4;
+        else if (pacer.speed > 0.25)
+            pacer.speed /= 2;
+        break;
+    case SDL_SCANCODE_BACKSPACE:
+        pacer.speed = 1;
+        break;
+    case SDL_SCANCODE_P:
+        pacer.paused = !pacer.paused;
+        break;
+    case SDL_SCANCODE_SPACE:
+        pacer.advance();
+        break;
+    }
+}
+
+bool Frontend::rewinding()
+{
+    return control && pressed[SDL_SCANCODE_R] && gb.rewind.enabled() && !gb.tasplayer.isRunning();
+}
+
+void Frontend::showStats(const Pacer::Stats& stats)
+{
+    std::ostringstream title;
+    title << std::fixed << std::setprecision(1) << "GEM Gameboy Emulator - ";
+    if (pacer.paused)
+        title << "paused";
+    else if (rewinding())
+        title << "rewinding";
+    else if (pacer.speed == 0)
+        title << "turbo";
+    else
+        title << pacer.speed << "x";
+    title << ", " << stats.fps << " fps, " << stats.cpu << "% CPU, jitter "
+          << std::setprecision(2) << stats.jitter << " ms (worst " << stats.worst << ")";
+    SDL_SetWindowTitle(window, title.str().c_str());
+}
+
+void Frontend::quit()
+{
+    running = false;
+}
+
+void Frontend::handleEvents()
+{
+    mouseup = false;
+    SDL_Event event;
+    while (SDL_PollEvent(&event))
+    {
+        switch (event.type)
+        {
+        case SDL_QUIT:
+            quit();
+            break;
+
+        case SDL_KEYDOWN:
+            {
+            // Control type stack size
+            if (typeStack.size() >= 256) typeStack.pop_front();
+
+            SDL_Keycode key = event.key.keysym.sym;
+
+            // Typing buffer
+            if (key < 256) {
+                // Shifting
+                if(event.key.keysym.mod & KMOD_SHIFT) {
+                    if (isalpha(key)) key -= 32;
+                    switch (key)
+                    {
+                        case '-': key = '_'; break;
+                    }
+                }
+                typeStack.push_back(key);
+            }
+
+            if (control && !event.key.repeat)
+                hotkey(event.key.keysym.scancode);
+
+            if (control && !gb.tasplayer.isRunning())
+                pressed[event.key.keysym.scancode] = true;
+            }
+            break;
+
+        case SDL_KEYUP:
+            if (control && !gb.tasplayer.isRunning())
+                pressed[event.key.keysym.scancode] = false;
+            break;
+
+        case SDL_WINDOWEVENT:
+            switch (event.window.event) {
+                case SDL_WINDOWEVENT_CLOSE:
+                    if (event.window.windowID == debugger.getWindowID())
+                    {
+                        debugger.close();
+                    }
+                    else if (event.window.windowID == getWindowID())
+                    {
+                        quit();
+                    }
+                    break;
+
+                case SDL_WINDOWEVENT_FOCUS_GAINED:
+                    if (event.window.windowID == getWindowID())
+                        control = true;
+                    break;
+                case SDL_WINDOWEVENT_FOCUS_LOST:
+                    if (event.window.windowID == getWindowID())
+                        control = false;
+                    break;
+            }
+            break;
+
+        case SDL_MOUSEBUTTONDOWN:
+            mousedown = true;
+            break;
+
+        case SDL_MOUSEBUTTONUP:
+            mouseup = true;
+            mousedown = false;
+            break;
+        }
+
+
+    }
+
+    // A running movie sets the buttons itself
+    if (!gb.tasplayer.isRunning())
+    {
+        uint8_t held = 0;
+        for (int i = 0; i < 8; i++)
+            if (pressed[keys[i]]) held |= 1 << i;
+        gb.joypad.held = held;
+    }
+}
+
+void Frontend::present()
+{
+    SDL_UpdateTexture(videoTexture, nullptr, gb.gpu.screen, 160 * sizeof(uint32_t));
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, videoTexture, nullptr, nullptr);
+    SDL_RenderPresent(renderer);
+}
+
+uint32_t Frontend::getWindowID()
+{
+    return SDL_GetWindowID(window);
+}
+
+void Frontend::raise()
+{
+    SDL_RaiseWindow(window);
+    debugger.loseFocus();
+}
@@ -0,0 +1,74 @@
+#ifndef FRONTEND_H
+#define FRONTEND_H
+#include <stdint.h>
+#include <deque>
+#include "debug.h"
+#include "pacer.h"
+#include "persist.h"
+
+class GameBoy;
+
+struct SDL_Window;
+struct SDL_Renderer;
+struct SDL_Texture;
+
+/* The SDL side of the emulator. Shows one GameBoy in a window, plays its
+   sound, maps the keyboard onto its joypad and hosts the debugger. The
+   emulation core never includes SDL. */
+class Frontend
+{
+public:
+    GameBoy& gb;
+    Debugger debugger;
+    Pacer pacer;
+    // Writes states and screenshots off the emulation thread
+    Persist persist;
+
+    bool mousedown = false;
+    bool mouseup = false;
+    // The game window has focus, keys go to the joypad
+    bool control = false;
+
+    bool pressed[512] = {};
+
+    std::deque<char> typeStack;
+
+    Frontend(GameBoy& gb);
+    ~Frontend();
+    Frontend(const Frontend&) = delete;
+    Frontend& operator=(const Frontend&) = delete;
+
+    // Open the window and the audio device
+    void init();
+
+    // Run frames at the pacer's speed until the window closes
+    void run();
+    void quit();
+
+    // Bring the game window to the front
+    void raise();
+
+private:
+    SDL_Window* window = nullptr;
+    SDL_Renderer* renderer = nullptr;
+    SDL_Texture* videoTexture = nullptr;
+
+    uint32_t scale = 2;
+
+    bool audioOpen = false;
+    bool running = true;
+
+    // Speed to go back to after turbo
+    double normalSpeed = 1;
+
+    void handleEvents();
+    void hotkey(int scancode);
+    bool rewinding();
+    void showStats(const Pacer::Stats& stats);
+    void present();
+    uint32_t getWindowID();
+
+    static void audioCallback(void* userdata, uint8_t* stream, int length);
+};
+
+#endif // FRONTEND_H
@@ -0,0 +1,203 @@
+#include "gameboy.h"
+#include <fstream>
+#include <vector>
+#include <string.h>
+#include "lodepng.h"
+#include "state.h"
+
+// "GEMS" read as a little endian word
+static const uint32_t STATE_MAGIC = 0x534D4547;
+// Magic, version and length
+static const uint32_t STATE_HEADER = 12;
+
+GameBoy::GameBoy()
+: cpu(*this), scheduler(*this), timer(*this), gpu(*this), apu(*this),
+  io(*this), jit(*this), tasplayer(*this), rewind(*this)
+{
+}
+
+GameBoy::~GameBoy()
+{
+    // While the scheduler is still there to stop the clock by
+    cpu.closeSave();
+}
+
+void GameBoy::runFrame()
+{
+    cpu.exec(FRAME_CYCLES);
+    cpu.frameticks++;
+    cpu.flushSave();
+    rewind.capture();
+}
+
+void GameBoy::writeState(StateWriter& state)
+{
+    state.put32(STATE_MAGIC);
+    state.put32(STATE_VERSION);
+    state.put32(0);
+
+    cpu.saveState(state);
+    scheduler.saveState(state);
+    timer.saveState(state);
+    gpu.saveState(state);
+    apu.saveState(state);
+    state.put8(joypad.held);
+
+    state.patch32(8, state.size());
+}
+
+bool GameBoy::readHeader(StateReader& state)
+{
+    size_t length = state.remaining();
+    return length >= STATE_HEADER &&
+           state.get32() == STATE_MAGIC && state.get32() == STATE_VERSION && state.get32() == length;
+}
+
+bool GameBoy::readState(StateReader& state)
+{
+    if (!readHeader(state) || !cpu.loadState(state))
+        return false;
+    scheduler.loadState(state);
+    timer.loadState(state);
+    gpu.loadState(state);
+    apu.loadState(state);
+    joypad.held = state.get8();
+    return true;
+}
+
+void GameBoy::saveState(std::vector<uint8_t>& buffer)
+{
+    StateWriter state(buffer);
+    writeState(state);
+}
+
+bool GameBoy::loadState(const uint8_t* data, size_t length)
+{
+    StateReader state(data, length);
+    if (!readState(state))
+        return false;
+
+    // Pages, banks and I/O handlers follow from what was loaded
+    cpu.initMemoryMap();
+    return true;
+}
+
+size_t GameBoy::snapshotPages() const
+{
+    return (sizeof(cpu.RAM) + cpu.cartridgeRAMSize() + GPU::FRAME_BUFFERS_SIZE) / Snapshot::PAGE_SIZE;
+}
+
+uint8_t* GameBoy::snapshotPage(size_t i, bool& tracked)
+{
+    const size_t ramPages = sizeof(cpu.RAM) / Snapshot::PAGE_SIZE;
+    const size_t cartPages = cpu.cartridgeRAMSize() / Snapshot::PAGE_SIZE;
+    if (i < ramPages)
+    {
+        // OAM DMA, the I/O registers and the parts behind them write
+        // the last two pages without going through the CPU
+        tracked = i < 0xFE;
+        return cpu.RAM + i * Snapshot::PAGE_SIZE;
+    }
+    i -= ramPages;
+    if (i < cartPages)
+    {
+        tracked = true;
+        return cpu.cartridgeRAM() + i * Snapshot::PAGE_SIZE;
+    }
+    i -= cartPages;
+    tracked = false;
+    return gpu.frameBuffers() + i * Snapshot::PAGE_SIZE;
+}
+
+void GameBoy::takeSnapshot(Snapshot& snapshot)
+{
+    StateWriter state(snapshot.registers, false);
+    writeState(state);
+
+    // Without a base of the same layout, every page is copied
+    size_t count = snapshotPages();
+    bool based = basePages.size() == count;
+    snapshot.pages.resize(count);
+    snapshot.copied = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        bool tracked;
+        const uint8_t* mem = snapshotPage(i, tracked);
+        if (based && (tracked ? !cpu.pageWritten(i) : memcmp(basePages[i]->data(), mem, Snapshot::PAGE_SIZE) == 0))
+            snapshot.pages[i] = basePages[i];
+        else
+        {
+            std::shared_ptr<Snapshot::Page> page = std::make_shared<Snapshot::Page>();
+            memcpy(page->data(), mem, Snapshot::PAGE_SIZE);
+            snapshot.pages[i] = std::move(page);
+            snapshot.copied++;
+        }
+    }
+
+    setBase(snapshot);
+}
+
+// Track writes from snapshot on, changing only the pointers that differ
+void GameBoy::setBase(const Snapshot& snapshot)
+{
+    basePages.resize(snapshot.pages.size());
+    for (size_t i = 0; i < basePages.size(); i++)
+        if (basePages[i] != snapshot.pages[i])
+            basePages[i] = snapshot.pages[i];
+    cpu.trackWrites();
+}
+
+bool GameBoy::restoreSnapshot(const Snapshot& snapshot)
+{
+    StateReader check(snapshot.registers.data(), snapshot.registers.size(), false);
+    if (snapshot.pages.size() != snapshotPages() || !readHeader(check) || !cpu.matchesState(check))
+        return false;
+
+    // Memory goes back first, as the parts read their registers out of
+    // it as they load. A page is already right if the CPU hasn't
+    // written it since the base, and the base shares it
+    size_t count = snapshot.pages.size();
+    bool based = basePages.size() == count;
+    for (size_t i = 0; i < count; i++)
+    {
+        bool tracked;
+        uint8_t* mem = snapshotPage(i, tracked);
+        if (!based || !tracked || cpu.pageWritten(i) || basePages[i] != snapshot.pages[i])
+            memcpy(mem, snapshot.pages[i]->data(), Snapshot::PAGE_SIZE);
+    }
+
+    StateReader state(snapshot.registers.data(), snapshot.registers.size(), false);
+    readState(state);
+
+    cpu.initMemoryMap();
+    setBase(snapshot);
+    return true;
+}
+
+bool GameBoy::encodeScreenshot(const uint32_t* screen, std::vector<unsigned char>& png)
+{
+    std::vector<unsigned char> image(160 * 144 * 4);
+    for (int i = 0; i < 160 * 144; i++)
+    {
+        uint32_t col = screen[i];
+        image[i * 4 + 0] = col >> 16;
+        image[i * 4 + 1] = col >> 8;
+        image[i * 4 + 2] = col;
+        image[i * 4 + 3] = 0xFF;
+    }
+    return lodepng::encode(png, image, 160, 144) == 0;
+}
+
+bool GameBoy::saveScreenshot(const char* filename)
+{
+    std::vector<unsigned char> png;
+    return encodeScreenshot(gpu.screen, png) && lodepng_save_file(png.data(), png.size(), filename) == 0;
+}
+
+bool GameBoy::dumpMemory(const char* filename)
+{
+    std::ofstream out(filename, std::ios::binary);
+    for (uint32_t loc = 0; loc < 0x10000; loc++)
+        out.put(cpu.read(loc));
+    return (bool)out;
+}
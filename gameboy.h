@@ -0,0 +1,93 @@
+#ifndef GAMEBOY_H
+#define GAMEBOY_H
+#include <vector>
+#include "cpu.h"
+#include "scheduler.h"
+#include "timer.h"
+#include "gpu.h"
+#include "apu.h"
+#include "io.h"
+#include "joypad.h"
+#include "jit.h"
+#include "tas.h"
+#include "snapshot.h"
+#include "rewind.h"
+
+/* One emulated Game Boy. Every part of the machine lives in here and
+   reaches the others through it, so any number of them can run side by
+   side, each on its own thread. Nothing in here uses SDL: a frontend
+   shows gpu.screen, plays apu.generateSamples() and sets joypad.held.
+
+   It holds all of RAM and the caches, so allocate it on the heap. */
+class GameBoy
+{
+public:
+    // CPU cycles in one frame: 154 lines of 456, at 4194304 Hz
+    static const uint32_t FRAME_CYCLES = 70224;
+
+    CPU cpu;
+    Scheduler scheduler;
+    Timer timer;
+    GPU gpu;
+    APU apu;
+    IO io;
+    Joypad joypad;
+    JIT jit;
+
+    TAS tasplayer;
+    Rewind rewind;
+
+    GameBoy();
+    ~GameBoy();
+    GameBoy(const GameBoy&) = delete;
+    GameBoy& operator=(const GameBoy&) = delete;
+
+    // Run one frame's worth of cycles, then flush the save file if due
+    // and capture a state to rewind to if one is due
+    void runFrame();
+
+    /* Save states. A state is the whole machine in one buffer: a
+       header of "GEMS", STATE_VERSION, the length and the cartridge,
+       then the CPU, scheduler, timer, GPU, APU and joypad in turn,
+       little endian throughout. Take and restore them between frames.
+
+       saveState replaces the contents of buffer, reusing its memory.
+       loadState returns false, leaving the machine as it was, for a
+       state of another version or cartridge or a truncated one */
+    static const uint32_t STATE_VERSION = 1;
+    void saveState(std::vector<uint8_t>& buffer);
+    bool loadState(const uint8_t* data, size_t length);
+    bool loadState(const std::vector<uint8_t>& buffer) { return loadState(buffer.data(), buffer.size()); }
+
+    /* Snapshots, see snapshot.h. The CPU tracks the pages written since
+       the last snapshot taken or restored, so taking one copies only
+       those, and restoring one copies back only the pages that differ
+       from it. Pages the CPU can't track (OAM, I/O and the frame
+       buffers, which are written around it) are compared instead.
+
+       restoreSnapshot returns false, leaving the machine as it was, for
+       a snapshot of another cartridge */
+    void takeSnapshot(Snapshot& snapshot);
+    bool restoreSnapshot(const Snapshot& snapshot);
+
+    // Write gpu.screen as a PNG, return false on failure
+    bool saveScreenshot(const char* filename);
+    // Encode a 160x144 frame as a PNG, return false on failure
+    static bool encodeScreenshot(const uint32_t* screen, std::vector<unsigned char>& png);
+    // Write the address space as the CPU sees it, return false on failure
+    bool dumpMemory(const char* filename);
+
+private:
+    // The pages of the last snapshot taken or restored
+    std::vector<std::shared_ptr<const Snapshot::Page>> basePages;
+
+    void writeState(StateWriter& state);
+    bool readHeader(StateReader& state);
+    bool readState(StateReader& state);
+    // Where snapshot page i lives, and whether CPU writes to it are tracked
+    uint8_t* snapshotPage(size_t i, bool& tracked);
+    size_t snapshotPages() const;
+    void setBase(const Snapshot& snapshot);
+};
+
+#endif // GAMEBOY_H
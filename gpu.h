@@ -1,19 +1,59 @@
 #ifndef GPU_H
-#define GPU_G
+#define GPU_H
 #include <stdint.h>
 
-namespace GPU
+class GameBoy;
+class StateWriter;
+class StateReader;
+
+class GPU
 {
-    extern uint32_t rendercycles;
+public:
+    uint32_t rendercycles = 0;
+
+    // The frame being drawn, line by line
+    uint32_t* pixels = buffers[0];
+    // The last complete frame, what a frontend shows
+    uint32_t* screen = buffers[1];
+    // Frames completed with the LCD on
+    uint32_t frames = 0;
 
-    void init();
+    GPU(GameBoy& gb);
+    GPU(const GPU&) = delete;
+    GPU& operator=(const GPU&) = delete;
 
     void step();
+    // Scheduler event: catch rendercycles up and step
+    void update();
+
+    // The frame being drawn and the last one, with the timing. The
+    // per-line buffers are rebuilt before each line is drawn
+    void saveState(StateWriter& state);
+    void loadState(StateReader& state);
+
+    // Both frame buffers, one after the other, for snapshots
+    uint8_t* frameBuffers() { return (uint8_t*)buffers; }
+    static const uint32_t FRAME_BUFFERS_SIZE = 2 * 160 * 144 * 4;
+
+private:
+    GameBoy& gb;
+
+    uint32_t buffers[2][160 * 144] = {};
+
+    uint32_t palette[4] = { 0xFFEFCE, 0xDE944A, 0xAD2921, 0x311852 };
+
+    /* Line specific data for sprite drawing and priorities */
+    uint8_t bgpixels[160] = {};
+    uint8_t spritey[144][160] = {};
 
-    void refresh();
+    bool pendingVBlank = false;
 
-    uint32_t getWindowID();
-    void raise();
-}
+    uint32_t getPaletteIndex(uint16_t loc, uint8_t col);
+    void drawSprites(uint8_t line);
+    void renderLine(uint8_t line);
+    void checkCoincidence();
+    uint32_t cyclesUntilStep();
+    void finishFrame();
+};
 
 #endif // GPU_H
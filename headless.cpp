@@ -0,0 +1,259 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include "gameboy.h"
+#include "batch.h"
+#include "statefile.h"
+
+/* gem-headless: runs the emulation core without SDL, as fast as the
+   host allows, and writes out what it ended on. Built from the core
+   sources and this file in place of main.cpp. */
+
+static void usage()
+{
+    std::cout << "Usage: gem-headless --rom game.gb [options]\n"
+                 "       gem-headless --batch manifest [--threads N] [--max-cycles N] [options]\n"
+                 "  --boot file        boot ROM to run first\n"
+                 "  --frames N         frames to run (600, or to the end of the movie)\n"
+                 "  --movie file.vbm   play back a VBM movie\n"
+                 "  --save file.sav    keep battery-backed cartridge RAM in file\n"
+                 "  --save-interval S  seconds between writebacks of the save file (1)\n"
+                 "  --load-state file  start from a save state\n"
+                 "  --save-state file  write a save state at the end\n"
+                 "  --state-level N    compression of --save-state, 0 (none) to 3 (best), 2\n"
+                 "  --rewind MB        keep MB of states to rewind to (0, off)\n"
+                 "  --rewind-every N   frames between those states (1)\n"
+                 "  --rewind-back N    step back N of them at the end, before writing out\n"
+                 "  --cached           run predecoded blocks\n"
+                 "  --jit              translate hot blocks to x86-64\n"
+                 "  --cycle-accurate   time each memory access to its M-cycle (slower)\n"
+                 "  --no-idle-skip     run idle loops instead of skipping them\n"
+                 "  --idle-stats       print the cycles skipped in each idle loop\n"
+                 "  --screenshot file  write the last frame as a PNG\n"
+                 "  --dump-ram file    write the 64KB address space\n"
+                 "  --dump-regs        print the registers\n"
+                 "  --trace file       log every instruction run, with the registers\n"
+                 "  --batch file       run the jobs of a manifest in parallel, see batch.h\n"
+                 "  --threads N        worker threads for --batch (one per core)\n"
+                 "  --max-cycles N     stop a --batch job as hung after N cycles" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* game = nullptr;
+    const char* bootRom = "";
+    const char* movie = nullptr;
+    const char* screenshot = nullptr;
+    const char* ramDump = nullptr;
+    const char* manifest = nullptr;
+    const char* tracefile = nullptr;
+    const char* savefile = nullptr;
+    double saveInterval = 1;
+    const char* loadState = nullptr;
+    const char* saveState = nullptr;
+    int stateLevel = StateFile::LEVEL_DEFAULT;
+    double rewindMB = 0;
+    uint32_t rewindInterval = 1;
+    int64_t rewindBack = 0;
+    unsigned threads = std::thread::hardware_concurrency();
+    uint64_t maxCycles = 0;
+    int64_t frames = -1;
+    bool cached = false, jit = false, skipIdle = true, cycleAccurate = false;
+    bool idleStats = false, dumpRegs = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--rom") == 0 && hasValue)
+            game = argv[++i];
+        else if (strcmp(argv[i], "--boot") == 0 && hasValue)
+            bootRom = argv[++i];
+        else if (strcmp(argv[i], "--frames") == 0 && hasValue)
+            frames = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--movie") == 0 && hasValue)
+            movie = argv[++i];
+        else if (strcmp(argv[i], "--screenshot") == 0 && hasValue)
+            screenshot = argv[++i];
+        else if (strcmp(argv[i], "--dump-ram") == 0 && hasValue)
+            ramDump = argv[++i];
+        else if (strcmp(argv[i], "--save") == 0 && hasValue)
+            savefile = argv[++i];
+        else if (strcmp(argv[i], "--save-interval") == 0 && hasValue)
+            saveInterval = atof(argv[++i]);
+        else if (strcmp(argv[i], "--load-state") == 0 && hasValue)
+            loadState = argv[++i];
+        else if (strcmp(argv[i], "--save-state") == 0 && hasValue)
+            saveState = argv[++i];
+        else if (strcmp(argv[i], "--state-level") == 0 && hasValue)
+            stateLevel = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--rewind") == 0 && hasValue)
+            rewindMB = atof(argv[++i]);
+        else if (strcmp(argv[i], "--rewind-every") == 0 && hasValue)
+            rewindInterval = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--rewind-back") == 0 && hasValue)
+            rewindBack = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--trace") == 0 && hasValue)
+            tracefile = argv[++i];
+        else if (strcmp(argv[i], "--batch") == 0 && hasValue)
+            manifest = argv[++i];
+        else if (strcmp(argv[i], "--threads") == 0 && hasValue)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-cycles") == 0 && hasValue)
+            maxCycles = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--dump-regs") == 0)
+            dumpRegs = true;
+        else if (strcmp(argv[i], "--cached") == 0)
+            cached = true;
+        else if (strcmp(argv[i], "--jit") == 0)
+            jit = true;
+        else if (strcmp(argv[i], "--cycle-accurate") == 0)
+            cycleAccurate = true;
+        else if (strcmp(argv[i], "--no-idle-skip") == 0)
+            skipIdle = false;
+        else if (strcmp(argv[i], "--idle-stats") == 0)
+            idleStats = true;
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (manifest)
+    {
+        std::ifstream in(manifest);
+        if (!in)
+        {
+            std::cerr << "Could not read " << manifest << std::endl;
+            return 1;
+        }
+
+        Batch batch;
+        batch.cachedInterpreter = cached;
+        batch.useJIT = jit;
+        batch.skipIdleLoops = skipIdle;
+        batch.cycleAccurate = cycleAccurate;
+        batch.saveInterval = saveInterval;
+        if (maxCycles)
+            batch.maxCycles = maxCycles;
+        if (!batch.load(in, std::cerr))
+            return 1;
+        return batch.run(threads, std::cout) ? 1 : 0;
+    }
+
+    if (!game)
+    {
+        usage();
+        return 1;
+    }
+
+    std::unique_ptr<GameBoy> gb(new GameBoy);
+    gb->cpu.cachedInterpreter = cached;
+    gb->cpu.skipIdleLoops = skipIdle;
+    gb->cpu.cycleAccurate = cycleAccurate;
+    gb->cpu.saveInterval = saveInterval;
+    gb->rewind.configure(rewindMB * (1 << 20), rewindInterval);
+    if (savefile)
+        gb->cpu.savePath = savefile;
+    if (jit)
+    {
+        gb->cpu.useJIT = gb->jit.init();
+        if (!gb->cpu.useJIT)
+            std::cerr << "JIT unavailable, using the interpreter" << std::endl;
+    }
+
+    // Tracing needs the debug policy, and the interpreter to see each instruction
+    std::ofstream trace;
+    if (tracefile)
+    {
+        trace.open(tracefile);
+        if (!trace)
+        {
+            std::cerr << "Could not write " << tracefile << std::endl;
+            return 1;
+        }
+        gb->cpu.trace = &trace;
+        gb->cpu.debugging = true;
+    }
+
+    gb->cpu.initBootROM(bootRom);
+    if (gb->cpu.init(game))
+        return 1;
+    if (movie && gb->tasplayer.loadVBM(movie))
+        return 1;
+    if (loadState)
+    {
+        std::ifstream in(loadState, std::ios::binary);
+        std::vector<uint8_t> state;
+        if (!StateFile::read(in, state) || !gb->loadState(state))
+        {
+            std::cerr << "Could not load a state for this ROM from " << loadState << std::endl;
+            return 1;
+        }
+    }
+
+    // Without a count, a movie runs to its end
+    if (frames < 0 && !movie)
+        frames = 600;
+
+    auto start = std::chrono::steady_clock::now();
+    int64_t ran = 0;
+    while (frames < 0 ? gb->tasplayer.isRunning() : ran < frames)
+    {
+        gb->runFrame();
+        ran++;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cerr << ran << " frames in " << elapsed.count() << " s, "
+              << (elapsed.count() > 0 ? ran / elapsed.count() : 0) << " fps" << std::endl;
+
+    if (rewindBack > 0)
+    {
+        int64_t back = 0;
+        while (back < rewindBack && gb->rewind.stepBack())
+            back++;
+        std::cerr << "Rewound " << back << " of " << rewindBack << " states, "
+                  << gb->rewind.states() << " left in " << gb->rewind.bytes() << " bytes" << std::endl;
+    }
+
+    if (dumpRegs)
+    {
+        gb->cpu.printStatus(std::cout);
+        std::cout << "Cycles : " << gb->scheduler.now() << std::endl;
+    }
+
+    if (idleStats)
+        gb->cpu.reportIdleLoops(std::cout);
+
+    if (screenshot && !gb->saveScreenshot(screenshot))
+    {
+        std::cerr << "Could not write " << screenshot << std::endl;
+        return 1;
+    }
+
+    if (saveState)
+    {
+        std::vector<uint8_t> state;
+        gb->saveState(state);
+        std::ofstream out(saveState, std::ios::binary);
+        if (!StateFile::write(out, state, stateLevel))
+        {
+            std::cerr << "Could not write " << saveState << std::endl;
+            return 1;
+        }
+    }
+
+    if (ramDump && !gb->dumpMemory(ramDump))
+    {
+        std::cerr << "Could not write " << ramDump << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
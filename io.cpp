@@ -0,0 +1,354 @@
+#include "io.h"
+#include "gameboy.h"
+
+static uint8_t getInput(GameBoy& gb, uint8_t val)
+{
+    if (!(val & 0x20))
+        return (val & 0xF0) | gb.joypad.getButtons();
+
+    if (!(val & 0x10))
+        return (val & 0xF0) | gb.joypad.getDirections();
+
+    return 0xFF;
+}
+
+static void writeP1(GameBoy& gb, uint8_t byte)
+{
+    uint8_t oldP1 = gb.cpu.RAM[IO_P1];
+    byte = (byte & 0xF0) | (oldP1 & ~0xF0);
+    byte = getInput(gb, byte);
+    if ((byte != oldP1) && ((byte & 0x0F) != 0x0F))
+        gb.cpu.RAM[IO_IF] |= INTERRUPT_HILO;
+    gb.cpu.RAM[IO_P1] = byte;
+}
+
+/* LY is reset when written to */
+static void writeLY(GameBoy& gb, uint8_t)
+{
+    gb.cpu.RAM[IO_LY] = 0;
+}
+
+static uint8_t readLY(GameBoy& gb)
+{
+    if (gb.cpu.RAM[IO_LCDC] & (1 << 7))
+        return gb.cpu.RAM[IO_LY];
+    else
+        return 0;
+}
+
+/* DMA Transfer */
+static void writeDMA(GameBoy& gb, uint8_t byte)
+{
+    uint16_t start = byte << 8;
+    for (uint16_t i = 0; i < 0xA0; i++)
+    {
+        gb.cpu.RAM[OAM + i] = gb.cpu.read(start + i);
+    }
+}
+
+/* SOUND REGISTERS */
+static void writeNR10(GameBoy& gb, uint8_t byte)
+{
+    gb.apu.freqSweepTime = (byte >> 4) & 3;
+    gb.apu.freqSweepDirection = byte & 0x8;
+    gb.apu.freqSweepShift = byte & 0x7;
+}
+
+static void writeNR11(GameBoy& gb, uint8_t byte)
+{
+    gb.apu.channel[0].length = byte & 0x3F;
+    gb.apu.channel[0].lengthTimer
+        = (64 - gb.apu.channel[0].length) * (1/256.f) * 4194304;
+    gb.apu.duty1 = APU::dutyCycles[byte >> 6];
+}
+
+static void writeNR12(GameBoy& gb, uint8_t byte)
+{
+    gb.apu.channel[0].volume = byte >> 4;
+    gb.apu.channel[0].volumeSweep = byte & 0x7;
+    gb.apu.channel[0].volumeDirection = byte & 0x8;
+}
+
+static void writeNR13(GameBoy& gb, uint8_t byte)
+{
+    gb.apu.channel[0].freq &= 0xFF00;
+    gb.apu.channel[0].freq |= byte;
+}
+
+static void writeNR14(GameBoy& gb, uint8_t byte)
+{
+    gb.apu.channel[0].restart = byte & 0x80;
+    gb.apu.channel[0].uselength = byte & 0x40;
+    gb.apu.channel[0].freq &= 0xF8FF;
+    gb.apu.channel[0].freq |= int(byte & 0x7) << 8;
+
+    gb.apu.channel[0].length = gb.cpu.RAM[IO_NR11] & 0x3F;
+    gb.apu.channel[0].lengthTimer
+        = (64 - gb.apu.channel[0].length) * (1/256.f) * 4194304;
+
+    if (byte & 0x80)
+    {
+        gb.cpu.RAM[IO_NR52] |= 1;
+
+        gb.apu.channel[0].volume = gb.cpu.RAM[IO_NR12] >> 4;
+        gb.apu.freqSweepTime = (gb.cpu.RAM[IO_NR10] >> 4) & 3;
+
+        if (!(gb.apu.freqSweepTime || gb.apu.freqSweepShift))
+            gb.cpu.RAM[IO_NR52] &= ~1;
+
+        if (gb.apu.freqSweepShift && gb.apu.freqSweepTime)
+            gb.apu.calcFreqSweep();
+    }
+}
+
+static void writeNR21(GameBoy& gb, uint8_t byte)
+{
+    gb.apu.channel[1].length = byte & 0x3F;
+    gb.apu.channel[1].lengthTimer
+        = (64 - gb.apu.channel[1].length) * (1/256.f) * 4194304;
+    gb.apu.duty2 = APU::dutyCycles[byte >> 6];
+}
+
+static void writeNR22(GameBoy& gb, uint8_t byte)
+{
+    gb.apu.channel[1].volume = byte >> 4;
+    gb.apu.channel[1].volumeSweep = byte & 0x7;
+    gb.apu.channel[1].volumeDirection = byte & 0x8;
+}
+
+static void writeNR23(GameBoy& gb, uint8_t byte)
+{
+    gb.apu.channel[1].freq &= 0xFF00;
+    gb.apu.channel[1].freq |= byte;
+}
+
+static void writeNR24(GameBoy& gb, uint8_t byte)
+{
+    gb.apu.channel[1].restart = byte & 0x80;
+    gb.apu.channel[1].uselength = byte & 0x40;
+    gb.apu.channel[1].freq &= 0xF8FF;
+    gb.apu.channel[1].freq |= int(byte & 0x7) << 8;
+
+    gb.apu.channel[1].length = gb.cpu.RAM[IO_NR21] & 0x3F;
+    gb.apu.channel[1].lengthTimer
+        = (64 - gb.apu.channel[1].length) * (1/256.f) * 4194304;
+
+    if (byte & 0x80)
+    {
+        gb.cpu.RAM[IO_NR52] |= 2;
+        gb.apu.channel[1].volume = gb.cpu.RAM[IO_NR22] >> 4;
+    }
+}
+
+/* Free Wave Channel */
+static void writeNR30(GameBoy& gb, uint8_t byte)
+{
+    gb.apu.playwave = byte & 0x80;
+}
+
+static void writeNR31(GameBoy& gb, uint8_t byte)
+{
+    gb.apu.channel[2].length = byte;
+    gb.apu.channel[2].lengthTimer
+        = (256 - gb.apu.channel[2].length) * (1/256.f) * 4194304;
+}
+
+static uint8_t waveVolume(uint8_t byte)
+{
+    const uint8_t volumes[4] = { 0, 4, 2, 1 };
+    return volumes[(byte >> 5) & 0x3];
+}
+
+static void writeNR32(GameBoy& gb, uint8_t byte)
+{
+    gb.apu.channel[2].volume = waveVolume(byte);
+}
+
+static void writeNR33(GameBoy& gb, uint8_t byte)
+{
+    gb.apu.channel[2].freq &= 0xFF00;
+    gb.apu.channel[2].freq |= byte;
+}
+
+static void writeNR34(GameBoy& gb, uint8_t byte)
+{
+    gb.apu.channel[2].restart = byte & 0x80;
+    gb.apu.channel[2].uselength = byte & 0x40;
+    gb.apu.channel[2].freq &= 0xF8FF;
+    gb.apu.channel[2].freq |= int(byte & 0x7) << 8;
+
+    if (byte & 0x80)
+    {
+        gb.cpu.RAM[IO_NR52] |= 4;
+
+        gb.apu.channel[2].length = gb.cpu.RAM[IO_NR31];
+        gb.apu.channel[2].lengthTimer
+            = (256 - gb.apu.channel[2].length) * (1/256.f) * 4194304;
+
+        gb.apu.channel[2].volume = waveVolume(gb.cpu.RAM[IO_NR32]);
+    }
+}
+
+/* Noise Channel */
+static void writeNR41(GameBoy& gb, uint8_t byte) // Channel 4 Sound Length
+{
+    gb.apu.channel[3].length = byte & 0x3F;
+    gb.apu.channel[3].lengthTimer
+        = (64 - gb.apu.channel[3].length) * (1/256.f) * 4194304;
+}
+
+static void writeNR42(GameBoy& gb, uint8_t byte) // Channel 4 Volume Envelope
+{
+    gb.apu.channel[3].volume = byte >> 4;
+    gb.apu.channel[3].volumeSweep = byte & 0x7;
+    gb.apu.channel[3].volumeDirection = byte & 0x8;
+}
+
+static void writeNR43(GameBoy& gb, uint8_t byte) // Channel 4 Polynomial Counter
+{
+    gb.apu.shiftClockFreq = (byte >> 4);
+    gb.apu.counterStepWidth = (byte & 0x8);
+    gb.apu.divRatio = (byte & 0x7);
+
+    double r = gb.apu.divRatio;
+    if (r == 0) r = 0.5d;
+    gb.apu.noiseScaler = 524288.d / r / (double)(1 << (gb.apu.shiftClockFreq+1));
+}
+
+static void writeNR44(GameBoy& gb, uint8_t byte) // Channel 4 Counter/Consecutive; Intial
+{
+    gb.apu.channel[3].restart = byte & 0x80;
+    gb.apu.channel[3].uselength = byte & 0x40;
+
+    if (byte & 0x80)
+    {
+        gb.cpu.RAM[IO_NR52] |= 8;
+
+        gb.apu.channel[3].length = gb.cpu.RAM[IO_NR41] & 0x3F;
+        gb.apu.channel[3].lengthTimer
+            = (64 - gb.apu.channel[3].length) * (1/256.f) * 4194304;
+
+        gb.apu.channel[3].volume = gb.cpu.RAM[IO_NR42] >> 4;
+        gb.apu.lfsr = ~0;
+    }
+}
+
+/* Sound Control Registers */
+static void writeNR50(GameBoy& gb, uint8_t byte) // Channel control / ON-OFF/ Volume
+{
+    gb.apu.solevel_1 = (byte & 7) / 7.f;
+    gb.apu.solevel_2 = ((byte >> 4) & 7) / 7.f;
+}
+
+// IO_NR51 (Sound Output selection)
+// is determined during mixing
+
+static void writeNR52(GameBoy& gb, uint8_t byte) // Sound on/off
+{
+    if (!(byte & 0x80))
+    {
+        for (int i = IO_NR10; i < IO_NR51; i++)
+            gb.cpu.RAM[i] = 0;
+    }
+    gb.io.setSoundPower(byte & 0x80);
+}
+
+static bool isSoundRegister(uint16_t loc)
+{
+    return loc >= IO_NR10 && loc <= IO_NR51;
+}
+
+/* Timer registers */
+static uint8_t readDIV(GameBoy& gb) { return gb.timer.readDIV(); }
+static uint8_t readTIMA(GameBoy& gb) { return gb.timer.readTIMA(); }
+static void writeDIV(GameBoy& gb, uint8_t byte) { gb.timer.writeDIV(byte); }
+static void writeTIMA(GameBoy& gb, uint8_t byte) { gb.timer.writeTIMA(byte); }
+static void writeTMA(GameBoy& gb, uint8_t byte) { gb.timer.writeTMA(byte); }
+static void writeTAC(GameBoy& gb, uint8_t byte) { gb.timer.writeTAC(byte); }
+
+// Look up the behaviour of a register, only done when the table is built
+IORegister IO::define(uint16_t loc)
+{
+    /* Wave pattern RAM and high RAM */
+    if ((loc >= 0xFF30 && loc < 0xFF40) || loc >= 0xFF80)
+        return { 0x00, 0xFF, nullptr, nullptr };
+
+    IORegister reg;
+    switch (loc)
+    {
+        case IO_P1:   reg = { 0xC0, 0x00, nullptr, writeP1 }; break;
+        case 0xFF01:  reg = { 0x00, 0xFF, nullptr, nullptr }; break; // SB
+        case 0xFF02:  reg = { 0x7E, 0x81, nullptr, nullptr }; break; // SC
+        case IO_DIV:  reg = { 0x00, 0x00, readDIV, writeDIV }; break;
+        case IO_TIMA: reg = { 0x00, 0xFF, readTIMA, writeTIMA }; break;
+        case IO_TMA:  reg = { 0x00, 0x00, nullptr, writeTMA }; break;
+        case IO_TAC:  reg = { 0xF8, 0x00, nullptr, writeTAC }; break;
+        case IO_IF:   reg = { 0xE0, 0xFF, nullptr, nullptr }; break;
+
+        case IO_NR10: reg = { 0x80, 0xFF, nullptr, writeNR10 }; break;
+        case IO_NR11: reg = { 0x3F, 0xFF, nullptr, writeNR11 }; break;
+        case IO_NR12: reg = { 0x00, 0xFF, nullptr, writeNR12 }; break;
+        case IO_NR13: reg = { 0xFF, 0xFF, nullptr, writeNR13 }; break;
+        case IO_NR14: reg = { 0xBF, 0xFF, nullptr, writeNR14 }; break;
+        case IO_NR21: reg = { 0x3F, 0xFF, nullptr, writeNR21 }; break;
+        case IO_NR22: reg = { 0x00, 0xFF, nullptr, writeNR22 }; break;
+        case IO_NR23: reg = { 0xFF, 0xFF, nullptr, writeNR23 }; break;
+        case IO_NR24: reg = { 0xBF, 0xFF, nullptr, writeNR24 }; break;
+        case IO_NR30: reg = { 0x7F, 0xFF, nullptr, writeNR30 }; break;
+        case IO_NR31: reg = { 0xFF, 0xFF, nullptr, writeNR31 }; break;
+        case IO_NR32: reg = { 0x9F, 0xFF, nullptr, writeNR32 }; break;
+        case IO_NR33: reg = { 0xFF, 0xFF, nullptr, writeNR33 }; break;
+        case IO_NR34: reg = { 0xBF, 0xFF, nullptr, writeNR34 }; break;
+        case IO_NR41: reg = { 0xFF, 0xFF, nullptr, writeNR41 }; break;
+        case IO_NR42: reg = { 0x00, 0xFF, nullptr, writeNR42 }; break;
+        case IO_NR43: reg = { 0x00, 0xFF, nullptr, writeNR43 }; break;
+        case IO_NR44: reg = { 0xBF, 0xFF, nullptr, writeNR44 }; break;
+        case IO_NR50: reg = { 0x00, 0xFF, nullptr, writeNR50 }; break;
+        case IO_NR51: reg = { 0x00, 0xFF, nullptr, nullptr }; break;
+        case IO_NR52: reg = { 0x70, 0x80, nullptr, writeNR52 }; break;
+
+        case IO_LCDC: reg = { 0x00, 0xFF, nullptr, nullptr }; break;
+        case IO_STAT: reg = { 0x80, 0x78, nullptr, nullptr }; break;
+        case IO_SCY:  reg = { 0x00, 0xFF, nullptr, nullptr }; break;
+        case IO_SCX:  reg = { 0x00, 0xFF, nullptr, nullptr }; break;
+        case IO_LY:   reg = { 0x00, 0x00, readLY, writeLY }; break;
+        case IO_LYC:  reg = { 0x00, 0xFF, nullptr, nullptr }; break;
+        case IO_DMA:  reg = { 0x00, 0xFF, nullptr, writeDMA }; break;
+        case IO_BGP:  reg = { 0x00, 0xFF, nullptr, nullptr }; break;
+        case IO_OBP0: reg = { 0x00, 0xFF, nullptr, nullptr }; break;
+        case IO_OBP1: reg = { 0x00, 0xFF, nullptr, nullptr }; break;
+        case IO_WY:   reg = { 0x00, 0xFF, nullptr, nullptr }; break;
+        case IO_WX:   reg = { 0x00, 0xFF, nullptr, nullptr }; break;
+
+        /* Unused */
+        default:      reg = { 0xFF, 0x00, nullptr, nullptr }; break;
+    }
+
+    if (isSoundRegister(loc) || loc == IO_NR52)
+        reg.event = Scheduler::EVENT_APU;
+
+    if (isSoundRegister(loc) && !gb.apu.poweron)
+    {
+        reg.writable = 0;
+        reg.write = nullptr;
+    }
+    return reg;
+}
+
+IO::IO(GameBoy& gb)
+: gb(gb)
+{
+}
+
+void IO::init()
+{
+    for (uint32_t loc = 0xFF00; loc <= 0xFFFF; loc++)
+        registers[loc & 0xFF] = define(loc);
+}
+
+void IO::setSoundPower(bool on)
+{
+    gb.apu.poweron = on;
+    for (uint16_t loc = IO_NR10; loc <= IO_NR51; loc++)
+        registers[loc & 0xFF] = define(loc);
+}
@@ -0,0 +1,42 @@
+#ifndef IO_H
+#define IO_H
+#include <stdint.h>
+#include "scheduler.h"
+
+class GameBoy;
+
+/* Description of one register in the FF00-FFFF page */
+struct IORegister
+{
+    // Bits that always read back as 1
+    uint8_t unreadable;
+    // Bits stored in RAM by a write
+    uint8_t writable;
+    // Replaces the plain read when set
+    uint8_t (*read)(GameBoy& gb);
+    // Side effect run after a write is stored
+    void (*write)(GameBoy& gb, uint8_t byte);
+    // Event whose timers count differently after a write
+    uint8_t event = Scheduler::EVENT_COUNT;
+};
+
+class IO
+{
+public:
+    IORegister registers[0x100];
+
+    IO(GameBoy& gb);
+
+    // Build the register table
+    void init();
+
+    // Sound registers ignore writes while the APU is off
+    void setSoundPower(bool on);
+
+private:
+    GameBoy& gb;
+
+    IORegister define(uint16_t loc);
+};
+
+#endif // IO_H
@@ -0,0 +1,462 @@
+#include "jit.h"
+#include "gameboy.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+#include <string.h>
+#include <vector>
+
+const size_t CODE_SIZE = 16 << 20;
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+
+/* Entry points for translated code, which passes the CPU in RDI */
+static uint8_t callRead(CPU* cpu, uint16_t loc) { return cpu->read(loc); }
+static void callWrite(CPU* cpu, uint16_t loc, uint8_t byte) { cpu->write(loc, byte); }
+static int callPoll(CPU* cpu, uint16_t next) { return cpu->jitPoll(next); }
+
+/* All guest state is addressed relative to RBX, which holds the
+   address of the CPU. Everything lives in the same GameBoy, so the
+   offsets fit a 32-bit displacement. */
+struct JIT::Emitter
+{
+    uint8_t* pos;
+    uint8_t* end;
+    const uint8_t* base;
+
+    int32_t offset(const void* var)
+    {
+        return (const uint8_t*)var - base;
+    }
+
+    void byte(uint8_t b)
+    {
+        if (pos < end) *pos = b;
+        pos++;
+    }
+
+    void word(uint16_t w) { byte(w); byte(w >> 8); }
+    void dword(uint32_t d) { word(d); word(d >> 16); }
+    void qword(uint64_t q) { dword(q); dword(q >> 32); }
+
+    bool full() { return pos > end; }
+
+    // ModRM for [rbx + disp32] of a guest variable
+    void mem(int reg, const void* var)
+    {
+        byte(0x80 | (reg << 3) | RBX);
+        dword(offset(var));
+    }
+
+    // op r8, [var]
+    void load8(uint8_t op, int reg, const void* var) { byte(op); mem(reg, var); }
+
+    void movLoad(int reg, const void* var) { load8(0x8A, reg, var); }
+    void movStore(int reg, const void* var) { load8(0x88, reg, var); }
+
+    void movzxLoad(int reg, const void* var)
+    {
+        byte(0x0F); byte(0xB6); mem(reg, var);
+    }
+
+    void storeImm8(const void* var, uint8_t imm)
+    {
+        byte(0xC6); mem(0, var); byte(imm);
+    }
+
+    void storeImm16(const void* var, uint16_t imm)
+    {
+        byte(0x66); byte(0xC7); mem(0, var); word(imm);
+    }
+
+    // group 1 op (add, or, adc, sbb, and, sub, xor, cmp) byte [var], imm8
+    void group1Imm8(int ext, const void* var, uint8_t imm)
+    {
+        byte(0x80); mem(ext, var); byte(imm);
+    }
+
+    // call func, with the CPU as the first argument
+    void callCPU(const void* func)
+    {
+        byte(0x48); byte(0x89); byte(0xDF);     // mov rdi, rbx
+        callAbs(func);
+    }
+
+    void callAbs(const void* func)
+    {
+        byte(0x48); byte(0xB8); qword((uint64_t)func);
+        byte(0xFF); byte(0xD0);
+    }
+
+    // Short forward jump, patched by bind()
+    uint8_t* jump8(uint8_t op)
+    {
+        byte(op); byte(0);
+        return pos;
+    }
+
+    void bind(uint8_t* after)
+    {
+        if (pos <= end) after[-1] = pos - after;
+    }
+
+    // Near jump (0F cc for a condition), patched by bind32()
+    uint8_t* jump32(uint8_t op)
+    {
+        byte(op); dword(0);
+        return pos;
+    }
+
+    uint8_t* jcc32(uint8_t cc)
+    {
+        byte(0x0F);
+        return jump32(cc);
+    }
+
+    void bind32(uint8_t* after, uint8_t* target)
+    {
+        if (target <= end && after <= end)
+        {
+            int32_t rel = target - after;
+            memcpy(after - 4, &rel, 4);
+        }
+    }
+};
+
+// Convert the LAHF result in AH into guest flags in AL
+void JIT::emitFlags(Emitter& e)
+{
+    e.byte(0x9F);                               // lahf
+    e.byte(0x0F); e.byte(0xB6); e.byte(0xC4);   // movzx eax, ah
+    e.byte(0x0F); e.byte(0xB6); e.byte(0x84); e.byte(0x03);
+    e.dword(e.offset(lahfFlags));               // movzx eax, [rbx + rax + lahfFlags]
+}
+
+// Merge the flags in AL with the bits of F in keep
+void JIT::emitStoreFlags(Emitter& e, uint8_t keep)
+{
+    e.movLoad(RDX, &gb.cpu.F);
+    e.byte(0x80); e.byte(0xE2); e.byte(keep);   // and dl, keep
+    e.byte(0x08); e.byte(0xD0);                 // or al, dl
+    e.movStore(RAX, &gb.cpu.F);
+}
+
+// ADD, ADC, SUB, SBC, AND, XOR, OR, CP with a register (z) or an immediate
+void JIT::emitALU(Emitter& e, uint8_t y, int z, uint8_t imm)
+{
+    // x86 opcode extension of each ALU operation
+    const uint8_t ext[8] = { 0, 2, 5, 3, 4, 6, 1, 7 };
+
+    if (z >= 0) e.movLoad(RCX, registers[z]);
+    e.movLoad(RAX, &gb.cpu.A);
+
+    // Carry into CF for ADC and SBC
+    if (y == 1 || y == 3)
+    {
+        e.movLoad(RDX, &gb.cpu.F);
+        e.byte(0xC0); e.byte(0xEA); e.byte(5);  // shr dl, 5
+    }
+
+    if (z >= 0)
+    {
+        e.byte(ext[y] << 3);                    // op al, cl
+        e.byte(0xC8);
+    }
+    else
+    {
+        e.byte((ext[y] << 3) | 4);              // op al, imm8
+        e.byte(imm);
+    }
+
+    if (y != 7) e.movStore(RAX, &gb.cpu.A);
+    emitFlags(e);
+
+    if (y == 2 || y == 3 || y == 7)
+    {
+        e.byte(0x0C); e.byte(SUBTRACT_FLAG);    // or al, N
+    }
+    else if (y == 4)
+    {
+        e.byte(0x24); e.byte(ZERO_FLAG);        // and al, Z
+        e.byte(0x0C); e.byte(HALF_CARRY_FLAG);  // or al, H
+    }
+    else if (y >= 5)
+    {
+        e.byte(0x24); e.byte(ZERO_FLAG);        // and al, Z
+    }
+    emitStoreFlags(e, 0x0F);
+}
+
+// INC r / DEC r
+void JIT::emitIncDec(Emitter& e, uint8_t r, bool dec)
+{
+    e.byte(0xFE); e.mem(dec ? 1 : 0, registers[r]);
+    emitFlags(e);
+    e.byte(0x24); e.byte(ZERO_FLAG | HALF_CARRY_FLAG);
+    if (dec)
+    {
+        e.byte(0x0C); e.byte(SUBTRACT_FLAG);
+    }
+    emitStoreFlags(e, CARRY_FLAG | 0x0F);
+}
+
+// INC rr / DEC rr
+void JIT::emitIncDecPair(Emitter& e, uint8_t p, bool dec)
+{
+    if (p == 3)
+    {
+        e.byte(0x66); e.byte(0x83); e.mem(dec ? 5 : 0, &gb.cpu.SP); e.byte(1);
+        return;
+    }
+    e.group1Imm8(dec ? 5 : 0, registers[p * 2 + 1], 1);     // add/sub low, 1
+    e.group1Imm8(dec ? 3 : 2, registers[p * 2], 0);         // adc/sbb high, 0
+}
+
+// Load HL into EAX and the page pointer for it into RDX
+void JIT::emitHLPage(Emitter& e, uint8_t* const* pages)
+{
+    e.movzxLoad(RAX, &gb.cpu.H);
+    e.byte(0xC1); e.byte(0xE0); e.byte(8);      // shl eax, 8
+    e.movLoad(RAX, &gb.cpu.L);
+    e.byte(0x89); e.byte(0xC1);                 // mov ecx, eax
+    e.byte(0xC1); e.byte(0xE9); e.byte(8);      // shr ecx, 8
+    e.byte(0x48); e.byte(0x8B); e.byte(0x94); e.byte(0xCB);
+    e.dword(e.offset(pages));                   // mov rdx, [rbx + rcx * 8 + pages]
+    e.byte(0x48); e.byte(0x85); e.byte(0xD2);   // test rdx, rdx
+}
+
+// LD r, (HL) through the page map, calling CPU::read for handled pages
+void JIT::emitLoadHL(Emitter& e, uint8_t r)
+{
+    emitHLPage(e, gb.cpu.readPages);
+    uint8_t* slow = e.jump8(0x74);              // jz slow
+    e.byte(0x0F); e.byte(0xB6); e.byte(0xC8);   // movzx ecx, al
+    e.byte(0x8A); e.byte(0x04); e.byte(0x0A);   // mov al, [rdx + rcx]
+    uint8_t* done = e.jump8(0xEB);              // jmp done
+    e.bind(slow);
+    e.byte(0x89); e.byte(0xC6);                 // mov esi, eax
+    e.callCPU((const void*)&callRead);
+    e.bind(done);
+    e.movStore(RAX, registers[r]);
+}
+
+// LD (HL), r through the page map, calling CPU::write for handled pages
+void JIT::emitStoreHL(Emitter& e, uint8_t r)
+{
+    e.movzxLoad(RSI, registers[r]);
+    emitHLPage(e, gb.cpu.writePages);
+    uint8_t* slow = e.jump8(0x74);              // jz slow
+    e.byte(0x0F); e.byte(0xB6); e.byte(0xC8);   // movzx ecx, al
+    e.byte(0x40); e.byte(0x88); e.byte(0x34); e.byte(0x0A);
+                                                // mov [rdx + rcx], sil
+    uint8_t* done = e.jump8(0xEB);              // jmp done
+    e.bind(slow);
+    e.byte(0x89); e.byte(0xF2);                 // mov edx, esi
+    e.byte(0x89); e.byte(0xC6);                 // mov esi, eax
+    e.callCPU((const void*)&callWrite);
+    e.bind(done);
+}
+
+// Emit an instruction inline, return false to leave it to its handler
+bool JIT::emitInline(Emitter& e, const CPU::MicroOp& op)
+{
+    const uint8_t x = op.opcode >> 6, y = (op.opcode >> 3) & 7, z = op.opcode & 7;
+    const uint8_t p = y >> 1, q = y & 1;
+
+    if (op.opcode == 0x00)
+        return true;
+
+    if (x == 0)
+    {
+        /* LD rr, d16 */
+        if (z == 1 && q == 0)
+        {
+            if (p == 3) e.storeImm16(&gb.cpu.SP, op.operand);
+            else
+            {
+                e.storeImm8(registers[p * 2], op.operand >> 8);
+                e.storeImm8(registers[p * 2 + 1], op.operand);
+            }
+            return true;
+        }
+        /* INC rr / DEC rr */
+        if (z == 3)
+        {
+            emitIncDecPair(e, p, q);
+            return true;
+        }
+        /* INC r / DEC r */
+        if ((z == 4 || z == 5) && y != 6)
+        {
+            emitIncDec(e, y, z == 5);
+            return true;
+        }
+        /* LD r, d8 */
+        if (z == 6 && y != 6)
+        {
+            e.storeImm8(registers[y], op.operand);
+            return true;
+        }
+        return false;
+    }
+
+    if (x == 1)
+    {
+        if (op.opcode == 0x76)
+            return false;
+        /* LD r, (HL) */
+        if (z == 6) emitLoadHL(e, y);
+        /* LD (HL), r */
+        else if (y == 6) emitStoreHL(e, z);
+        /* LD r, r */
+        else
+        {
+            e.movLoad(RAX, registers[z]);
+            e.movStore(RAX, registers[y]);
+        }
+        return true;
+    }
+
+    /* ALU A, r */
+    if (x == 2 && z != 6)
+    {
+        emitALU(e, y, z, 0);
+        return true;
+    }
+
+    /* ALU A, d8 */
+    if (op.opcode != 0xCB && x == 3 && z == 6)
+    {
+        emitALU(e, y, -1, op.operand);
+        return true;
+    }
+
+    return false;
+}
+
+JIT::JIT(GameBoy& gb)
+: gb(gb),
+  registers { &gb.cpu.B, &gb.cpu.C, &gb.cpu.D, &gb.cpu.E,
+              &gb.cpu.H, &gb.cpu.L, nullptr, &gb.cpu.A }
+{
+}
+
+JIT::~JIT()
+{
+    if (code) munmap(code, CODE_SIZE);
+}
+
+bool JIT::init()
+{
+    if (code) return true;
+
+    void* mem = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return false;
+    code = (uint8_t*)mem;
+
+    for (int ah = 0; ah < 0x100; ah++)
+    {
+        lahfFlags[ah] = ((ah & 0x40) ? ZERO_FLAG : 0) |
+                        ((ah & 0x10) ? HALF_CARRY_FLAG : 0) |
+                        ((ah & 0x01) ? CARRY_FLAG : 0);
+    }
+    return true;
+}
+
+/* Every instruction becomes its inline translation, or a call to
+   its handler with PC and the operand set as the cached interpreter
+   would. It then adds its cycles and compares them against the next
+   scheduler event, calling CPU::jitPoll for the rest of exec()'s
+   loop only once that is due, so timing matches the interpreter
+   instruction for instruction. The last instruction always polls. */
+JIT::Code JIT::compile(const CPU::MicroOp* ops, size_t count, uint16_t pc)
+{
+    Emitter e = { code + codeUsed, code + CODE_SIZE, (const uint8_t*)&gb.cpu };
+
+    // Out of line polls: jae site, return point and next PC
+    struct Poll { uint8_t* jump; uint8_t* back; uint16_t pc; };
+    std::vector<Poll> polls;
+
+    e.byte(0x53);                               // push rbx
+    e.byte(0x48); e.byte(0xBB);
+    e.qword((uint64_t)&gb.cpu);                 // mov rbx, &cpu
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const CPU::MicroOp& op = ops[i];
+        bool last = i == count - 1;
+        pc += op.length;
+
+        if (!emitInline(e, op))
+        {
+            if (op.length > 1 && op.opcode != 0xCB)
+                e.storeImm16(&gb.cpu.decodedOperand, op.operand);
+            e.storeImm16(&gb.cpu.PC, pc);
+            e.callCPU((const void*)op.execute);
+        }
+        else if (last)
+            e.storeImm16(&gb.cpu.PC, pc);
+
+        // EI and DI take effect in jitPoll
+        if (op.opcode == 0xF3 || op.opcode == 0xFB)
+        {
+            e.byte(0xC7); e.mem(0, &gb.scheduler.next);
+            e.dword(0);                         // mov dword [next], 0
+        }
+
+        e.byte(0x83); e.mem(0, &gb.cpu.cycles);
+        e.byte(op.cycles);                      // add dword [cycles], t
+
+        if (last)
+        {
+            e.byte(0xBE); e.dword(pc);          // mov esi, next
+            e.callCPU((const void*)&callPoll);
+            break;
+        }
+
+        e.load8(0x8B, RAX, &gb.cpu.cycles);         // mov eax, [cycles]
+        e.load8(0x3B, RAX, &gb.scheduler.next);     // cmp eax, [next]
+        uint8_t* jump = e.jcc32(0x83);              // jae poll
+        polls.push_back({ jump, e.pos, pc });
+    }
+
+    uint8_t* exit = e.pos;
+    e.byte(0x5B);                               // pop rbx
+    e.byte(0xC3);                               // ret
+
+    for (const Poll& poll : polls)
+    {
+        e.bind32(poll.jump, e.pos);
+        e.storeImm16(&gb.cpu.PC, poll.pc);
+        e.byte(0xBE); e.dword(poll.pc);         // mov esi, next
+        e.callCPU((const void*)&callPoll);
+        e.byte(0x85); e.byte(0xC0);             // test eax, eax
+        e.bind32(e.jcc32(0x85), exit);          // jnz exit
+        e.bind32(e.jump32(0xE9), poll.back);    // jmp back
+    }
+
+    if (e.full())
+        return nullptr;
+
+    Code block = (Code)(code + codeUsed);
+    codeUsed = e.pos - code;
+    return block;
+}
+
+void JIT::reset()
+{
+    codeUsed = 0;
+}
+
+#else
+
+JIT::JIT(GameBoy& gb) : gb(gb) { }
+JIT::~JIT() { }
+bool JIT::init() { return false; }
+JIT::Code JIT::compile(const CPU::MicroOp* ops, size_t count, uint16_t pc) { return nullptr; }
+void JIT::reset() { }
+
+#endif
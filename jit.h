@@ -0,0 +1,63 @@
+#ifndef JIT_H
+#define JIT_H
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu.h"
+
+class GameBoy;
+
+/* Translates blocks of the block cache into x86-64 code. Only built
+   for x86-64 Linux; elsewhere init() fails and the cached interpreter
+   is used instead. Each instance has its own code buffer. */
+class JIT
+{
+public:
+    // Returned by CPU::jitPoll
+    enum Exit
+    {
+        CONTINUE,       // keep running the block
+        EXIT            // return to exec()
+    };
+
+    typedef void (*Code)();
+
+    JIT(GameBoy& gb);
+    ~JIT();
+    JIT(const JIT&) = delete;
+    JIT& operator=(const JIT&) = delete;
+
+    // Allocate the code buffer, return false when unsupported
+    bool init();
+
+    // Translate a block starting at pc, null when the buffer is full
+    Code compile(const CPU::MicroOp* ops, size_t count, uint16_t pc);
+
+    // Drop every translated block
+    void reset();
+
+private:
+    GameBoy& gb;
+
+    uint8_t* code = nullptr;
+    size_t codeUsed = 0;
+
+    // Flags after LAHF (SF ZF - AF - PF - CF) as Z - H C
+    uint8_t lahfFlags[0x100];
+
+    // Guest registers by operand index, 6 is (HL)
+    uint8_t* registers[8];
+
+    struct Emitter;
+
+    void emitFlags(Emitter& e);
+    void emitStoreFlags(Emitter& e, uint8_t keep);
+    void emitALU(Emitter& e, uint8_t y, int z, uint8_t imm);
+    void emitIncDec(Emitter& e, uint8_t r, bool dec);
+    void emitIncDecPair(Emitter& e, uint8_t p, bool dec);
+    void emitHLPage(Emitter& e, uint8_t* const* pages);
+    void emitLoadHL(Emitter& e, uint8_t r);
+    void emitStoreHL(Emitter& e, uint8_t r);
+    bool emitInline(Emitter& e, const CPU::MicroOp& op);
+};
+
+#endif // JIT_H
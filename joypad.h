@@ -1,22 +1,30 @@
 #ifndef JOYPAD_H
 #define JOYPAD_H
-#include <deque>
 #include <stdint.h>
 
-namespace Joypad
+/* The buttons held down, set by the frontend or a TAS movie and read
+   back through the P1 register */
+class Joypad
 {
-    extern bool mousedown;
-    extern bool mouseup;
-    extern bool control;
+public:
+    // Bits of held, in the order of a VBM movie's controller data
+    enum Button
+    {
+        BUTTON_A        = 0x01,
+        BUTTON_B        = 0x02,
+        BUTTON_SELECT   = 0x04,
+        BUTTON_START    = 0x08,
+        BUTTON_RIGHT    = 0x10,
+        BUTTON_LEFT     = 0x20,
+        BUTTON_UP       = 0x40,
+        BUTTON_DOWN     = 0x80
+    };
 
-    extern bool pressed[512];
-
-    extern std::deque<char> typeStack;
-
-    void update();
+    uint8_t held = 0;
 
+    // Low nibble of P1 with the buttons or the directions selected
     uint8_t getButtons();
     uint8_t getDirections();
-}
+};
 
 #endif // JOYPAD_H
@@ -1,25 +1,21 @@
 #include <SDL2/SDL.h>
 #include <iostream>
-#include <fstream>
 #include <stdlib.h>
-#include "cpu.h"
-#include "gpu.h"
+#include <string.h>
+#include <memory>
+#include "gameboy.h"
+#include "frontend.h"
 #include "dis.h"
-#include "apu.h"
+#include "bench.h"
 
-
-char* readFileBytes(const char *name, uint32_t* length)
+// game.gb saves to game.sav, next to it
+static std::string savePathFor(const std::string& rom)
 {
-    std::ifstream fl(name);
-    if (!fl) return nullptr;
-    fl.seekg(0, std::ios::end);
-    size_t len = fl.tellg();
-    if (length) *length = len;
-    char *ret = new char[len];
-    fl.seekg(0, std::ios::beg);
-    fl.read(ret, len);
-    fl.close();
-    return ret;
+    size_t dot = rom.find_last_of('.');
+    size_t slash = rom.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return rom + ".sav";
+    return rom.substr(0, dot) + ".sav";
 }
 
 int main(int argc, char* argv[])
@@ -28,29 +24,99 @@ int main(int argc, char* argv[])
         std::cout << "Please supply the paths to (1) the gameboy boot ROM and (2) a game to play." << std::endl;
         return 1;
     }*/
-    
+
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+    {
+        uint32_t iterations = argc > 2 ? atoi(argv[2]) : 1000000;
+        std::unique_ptr<GameBoy> gb(new GameBoy);
+        Benchmark::opcodes(*gb, iterations);
+        Benchmark::alu(*gb, iterations * 20);
+        Benchmark::tiers(*gb, iterations, argc > 3 ? argv[3] : nullptr);
+        Benchmark::states(argc > 3 ? argv[3] : nullptr);
+        Benchmark::clock();
+        return 0;
+    }
+
+    std::unique_ptr<GameBoy> gb(new GameBoy);
+
     const char * bootRom = "";
     const char * game = "";
 
+    bool idleStats = false;
+    bool frameStats = false;
+    bool save = true;
+    double speed = 1;
+    double rewindMB = 32;
+    uint32_t rewindInterval = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--rom") == 0 && i + 1 < argc)
+            game = argv[++i];
+        else if (strcmp(argv[i], "--boot") == 0 && i + 1 < argc)
+            bootRom = argv[++i];
+        else if (strcmp(argv[i], "--cached") == 0)
+            gb->cpu.cachedInterpreter = true;
+        else if (strcmp(argv[i], "--jit") == 0)
+        {
+            gb->cpu.useJIT = gb->jit.init();
+            if (!gb->cpu.useJIT)
+                std::cout << "JIT unavailable, using the interpreter" << std::endl;
+        }
+        else if (strcmp(argv[i], "--cycle-accurate") == 0)
+            gb->cpu.cycleAccurate = true;
+        else if (strcmp(argv[i], "--no-idle-skip") == 0)
+            gb->cpu.skipIdleLoops = false;
+        else if (strcmp(argv[i], "--idle-stats") == 0)
+            idleStats = true;
+        else if (strcmp(argv[i], "--frame-stats") == 0)
+            frameStats = true;
+        else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc)
+            speed = atof(argv[++i]);
+        else if (strcmp(argv[i], "--no-save") == 0)
+            save = false;
+        else if (strcmp(argv[i], "--save-interval") == 0 && i + 1 < argc)
+            gb->cpu.saveInterval = atof(argv[++i]);
+        else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc)
+            rewindMB = atof(argv[++i]);
+        else if (strcmp(argv[i], "--rewind-every") == 0 && i + 1 < argc)
+            rewindInterval = atoi(argv[++i]);
+    }
+    gb->rewind.configure(rewindMB * (1 << 20), rewindInterval);
+    if (save && *game)
+        gb->cpu.savePath = savePathFor(game);
+
     SDL_Init(SDL_INIT_EVERYTHING);
     Disassembler::init();
 
-    CPU::debugger.init();
-    GPU::init();
+    // Closes its windows and the audio device before SDL_Quit
+    std::unique_ptr<Frontend> frontend(new Frontend(*gb));
+    frontend->pacer.speed = speed;
+    frontend->debugger.init();
+    frontend->init();
 
-    CPU::initBootROM(bootRom);
-    if(!CPU::init(game))
+    gb->cpu.initBootROM(bootRom);
+    if(!gb->cpu.init(game))
     {
 
-        APU::init();
-        CPU::run();
+        frontend->raise();
+        frontend->run();
+
+        if (idleStats)
+            gb->cpu.reportIdleLoops(std::cout);
+
+        if (frameStats)
+        {
+            Pacer::Stats stats = frontend->pacer.total();
+            std::cout << stats.fps << " fps, " << stats.cpu << "% CPU, frame period jitter "
+                      << stats.jitter << " ms RMS, " << stats.worst << " ms worst" << std::endl;
+        }
     } else {
-        SDL_CloseAudio();
+        frontend.reset();
         SDL_Quit();
         return 1;
     }
 
-    SDL_CloseAudio();
+    frontend.reset();
     SDL_Quit();
     return 0;
 }
@@ -1,36 +1,290 @@
 #include "mbc.h"
 #include "cpu.h"
+#include <time.h>
+#include <algorithm>
 
-void nrom_write(MBC* mbc, uint16_t loc, uint8_t value) { }
+// Emulated cycles in a second, which the clock counts
+static const uint32_t RTC_SECOND = 4194304;
 
-void mbc1_write(MBC* mbc, uint16_t loc, uint8_t value)
+void RTC::update(uint64_t now)
 {
-    switch (loc >> 12) {
-    case 0: case 1:
-            mbc->enableram = ((value & 0x0F) == 0xA);
-    break;
-    case 2: case 3: {
-        uint8_t bank = value & 0x1F;
-        CPU::setBank(bank);
-    } break;
-    case 4: case 5:
-        if (mbc->mode == 1)
-        {
+    // A clock that went back counts as no time passed
+    uint64_t elapsed = now > synced ? now - synced : 0;
+    synced = now;
+    advance(elapsed);
+}
+
+void RTC::advance(uint64_t elapsed)
+{
+    if (regs[DAYS_HIGH] & 0x40)
+        return;
+
+    elapsed += subsecond;
+    subsecond = elapsed % RTC_SECOND;
+    uint64_t seconds = elapsed / RTC_SECOND;
+    if (!seconds)
+        return;
+
+    uint64_t total = regs[SECONDS] + seconds;
+    regs[SECONDS] = total % 60;
+    total = regs[MINUTES] + total / 60;
+    regs[MINUTES] = total % 60;
+    total = regs[HOURS] + total / 60;
+    regs[HOURS] = total % 24;
+    total = (regs[DAYS_LOW] | ((regs[DAYS_HIGH] & 1) << 8)) + total / 24;
+
+    // Past 511 days the counter wraps and sets the carry bit
+    uint8_t carry = total > 0x1FF ? 0x80 : 0;
+    regs[DAYS_LOW] = total;
+    regs[DAYS_HIGH] = (regs[DAYS_HIGH] & 0xC0) | carry | ((total >> 8) & 1);
+}
+
+void RTC::write(uint8_t reg, uint8_t value, uint64_t now)
+{
+    static const uint8_t masks[5] = { 0x3F, 0x3F, 0x1F, 0xFF, 0xC1 };
+
+    update(now);
+    regs[reg] = value & masks[reg];
+    // Writing the seconds restarts the second
+    if (reg == SECONDS)
+        subsecond = 0;
+}
+
+void RTC::save(uint8_t* out, uint64_t now)
+{
+    update(now);
+    uint64_t stamp = time(nullptr);
+    // Little endian words, each register in the low byte of its own
+    std::fill(out, out + 40, 0);
+    for (int i = 0; i < 5; i++)
+    {
+        out[i * 4] = regs[i];
+        out[20 + i * 4] = latched[i];
+    }
+    for (int i = 0; i < 8; i++)
+        out[40 + i] = stamp >> (i * 8);
+}
+
+void RTC::load(const uint8_t* in, uint64_t now)
+{
+    for (int i = 0; i < 5; i++)
+    {
+        regs[i] = in[i * 4];
+        latched[i] = in[20 + i * 4];
+    }
+    uint64_t stamp = 0;
+    for (int i = 0; i < 8; i++)
+        stamp |= (uint64_t)in[40 + i] << (i * 8);
+
+    // Run the clock on for as long as the host was away
+    uint64_t host = time(nullptr);
+    uint64_t away = stamp && host > stamp ? host - stamp : 0;
+    synced = now;
+    advance(away * RTC_SECOND);
+}
+
+int MBC1::write(MBC& mbc, uint16_t loc, uint8_t value, uint64_t now)
+{
+    switch (loc >> 13)
+    {
+    case 0:
+        mbc.enableram = (value & 0x0F) == 0xA;
+        return MBC::REMAP_RAM;
+    case 1:
+        // Bank 0 reads as 1, before the bank is wrapped to the ROM size
+        mbc.bank1 = value & 0x1F;
+        if (mbc.bank1 == 0) mbc.bank1 = 1;
+        break;
+    case 2:
+        mbc.bank2 = value & 3;
+        break;
+    default:
+        // Mode 1 also puts bank2 on 0000-3FFF and the RAM bank
+        mbc.mode = value & 1;
+        break;
+    }
+
+    mbc.rombank = (mbc.bank2 << 5) | mbc.bank1;
+    mbc.rombank0 = mbc.mode ? mbc.bank2 << 5 : 0;
+    mbc.rambank = mbc.mode ? mbc.bank2 : 0;
+    return MBC::REMAP_ROM | MBC::REMAP_RAM;
+}
+
+int MBC2::write(MBC& mbc, uint16_t loc, uint8_t value, uint64_t now)
+{
+    if (loc >= 0x4000)
+        return 0;
+
+    // Address bit 8 picks the register
+    if (loc & 0x100)
+    {
+        mbc.rombank = value & 0x0F;
+        if (mbc.rombank == 0) mbc.rombank = 1;
+        return MBC::REMAP_ROM;
+    }
+    mbc.enableram = (value & 0x0F) == 0xA;
+    return MBC::REMAP_RAM;
+}
+
+// The 512 half-bytes repeat through A000-BFFF, the top half reads as 1s
+uint8_t MBC2::readRAM(MBC& mbc, uint8_t* ram, uint16_t loc, uint64_t now)
+{
+    return 0xF0 | ram[loc & 0x1FF];
+}
 
+void MBC2::writeRAM(MBC& mbc, uint8_t* ram, uint16_t loc, uint8_t value, uint64_t now)
+{
+    ram[loc & 0x1FF] = value & 0x0F;
+}
+
+int MBC3::write(MBC& mbc, uint16_t loc, uint8_t value, uint64_t now)
+{
+    switch (loc >> 13)
+    {
+    case 0:
+        mbc.enableram = (value & 0x0F) == 0xA;
+        return MBC::REMAP_RAM;
+    case 1:
+        mbc.rombank = value & 0x7F;
+        if (mbc.rombank == 0) mbc.rombank = 1;
+        return MBC::REMAP_ROM;
+    case 2:
+        if (value < 0x08)
+        {
+            mbc.rambank = value;
+            mbc.rtcSelect = 0;
         }
-        else
+        else if (value <= 0x0C && mbc.hasRTC)
+            mbc.rtcSelect = value;
+        return MBC::REMAP_RAM;
+    default:
+        // Writing 0 then 1 copies the clock to the registers read back
+        if (mbc.hasRTC && mbc.rtc.latch == 0 && value == 1)
         {
-
+            mbc.rtc.update(now);
+            for (int i = 0; i < 5; i++)
+                mbc.rtc.latched[i] = mbc.rtc.regs[i];
         }
-    break;
-    case 6: case 7:
-        // RAM Mode 0 = 16/8
-        // RAM Mode 1 = 4/32
-        mbc->mode = value & 1;
-    break;
+        mbc.rtc.latch = value;
+        return 0;
+    }
+}
+
+uint8_t MBC3::readRAM(MBC& mbc, uint8_t* ram, uint16_t loc, uint64_t now)
+{
+    if (mbc.rtcSelect)
+        return mbc.rtc.latched[mbc.rtcSelect - 0x08];
+    return 0xFF;
+}
+
+void MBC3::writeRAM(MBC& mbc, uint8_t* ram, uint16_t loc, uint8_t value, uint64_t now)
+{
+    if (!mbc.rtcSelect)
+        return;
+    mbc.rtc.write(mbc.rtcSelect - 0x08, value, now);
+    mbc.rtc.latched[mbc.rtcSelect - 0x08] = mbc.rtc.regs[mbc.rtcSelect - 0x08];
+}
+
+int MBC5::write(MBC& mbc, uint16_t loc, uint8_t value, uint64_t now)
+{
+    switch (loc >> 12)
+    {
+    case 0: case 1:
+        mbc.enableram = (value & 0x0F) == 0xA;
+        return MBC::REMAP_RAM;
+    case 2:
+        // Low 8 bits of the bank, and bank 0 is bank 0
+        mbc.rombank = (mbc.rombank & 0x100) | value;
+        return MBC::REMAP_ROM;
+    case 3:
+        mbc.rombank = (mbc.rombank & 0xFF) | ((value & 1) << 8);
+        return MBC::REMAP_ROM;
+    case 4: case 5:
+        mbc.rambank = value & (mbc.rumble ? 0x07 : 0x0F);
+        return MBC::REMAP_RAM;
+    default:
+        return 0;
     }
 }
 
+template <typename Mapper>
+static void mapperWrite(CPU& cpu, MBC& mbc, uint16_t loc, uint8_t value, uint64_t now)
+{
+    int remap = Mapper::write(mbc, loc, value, now);
+    if (remap & MBC::REMAP_ROM)
+        cpu.mapROM();
+    if (remap & MBC::REMAP_RAM)
+    {
+        mbc.ramMapped = Mapper::mapsRAM(mbc);
+        cpu.mapExternalRAM();
+    }
+}
+
+template <typename Mapper>
+static uint8_t mapperReadRAM(MBC& mbc, uint8_t* ram, uint16_t loc, uint64_t now)
+{
+    if (!mbc.enableram)
+        return 0xFF;
+    return Mapper::readRAM(mbc, ram, loc, now);
+}
+
+template <typename Mapper>
+static void mapperWriteRAM(MBC& mbc, uint8_t* ram, uint16_t loc, uint8_t value, uint64_t now)
+{
+    if (mbc.enableram)
+        Mapper::writeRAM(mbc, ram, loc, value, now);
+}
 
-MBC nrom = { 0, 0, 0, false, nrom_write };
-MBC mbc1 = { 0, 0, 0, false, mbc1_write };
+template <typename Mapper>
+void MBC::select()
+{
+    write = mapperWrite<Mapper>;
+    readRAM = mapperReadRAM<Mapper>;
+    writeRAM = mapperWriteRAM<Mapper>;
+    ramMapped = Mapper::mapsRAM(*this);
+}
+
+void MBC::init(uint8_t type, uint8_t ramcode, uint64_t now)
+{
+    static const uint32_t ramsizes[6] = { 0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000 };
+    ramsize = ramcode < 6 ? ramsizes[ramcode] : 0;
+    rtc.synced = now;
+
+    switch (type)
+    {
+    case 0x01: case 0x02: case 0x03:
+        select<MBC1>();
+        break;
+    case 0x05: case 0x06:
+        select<MBC2>();
+        ramsize = 0x200;
+        break;
+    case 0x0F: case 0x10:
+        hasRTC = true;
+        select<MBC3>();
+        break;
+    case 0x11: case 0x12: case 0x13:
+        select<MBC3>();
+        break;
+    case 0x1C: case 0x1D: case 0x1E:
+        rumble = true;
+        select<MBC5>();
+        break;
+    case 0x19: case 0x1A: case 0x1B:
+        select<MBC5>();
+        break;
+    default:
+        // ROM only, or ROM and RAM, which is always enabled
+        select<NoMBC>();
+        enableram = true;
+        break;
+    }
+
+    switch (type)
+    {
+    case 0x03: case 0x06: case 0x09: case 0x0F: case 0x10:
+    case 0x13: case 0x1B: case 0x1E:
+        battery = true;
+        break;
+    }
+}
@@ -2,16 +2,146 @@
 #define MBC_H
 #include <stdint.h>
 
+class CPU;
+
+// MBC3 real time clock, counted from emulated cycles
+struct RTC
+{
+    enum { SECONDS, MINUTES, HOURS, DAYS_LOW, DAYS_HIGH };
+
+    uint8_t regs[5] = {};       // as the clock counts them
+    uint8_t latched[5] = {};    // as the game reads them
+    uint64_t synced = 0;        // cycle regs were brought up to
+    uint32_t subsecond = 0;     // cycles into the current second
+    uint8_t latch = 0xFF;       // last write to 6000-7FFF
+
+    // Count the seconds up to now, unless halted
+    void update(uint64_t now);
+    // Count elapsed cycles on, unless halted
+    void advance(uint64_t elapsed);
+    void write(uint8_t reg, uint8_t value, uint64_t now);
+
+    // The clock as the 48 bytes other emulators put after the RAM in a
+    // save file: the registers, the latched registers and the host time.
+    // Loading counts on by the time the save was put away
+    static const uint32_t SAVE_SIZE = 48;
+    void save(uint8_t* out, uint64_t now);
+    void load(const uint8_t* in, uint64_t now);
+};
+
+/* Bank registers of the cartridge's memory bank controller */
 struct MBC
 {
-    int mode;
-    int rombanks;
-    int ramsize;
-    bool enableram;
-    void (*write)(MBC*,uint16_t loc, uint8_t value);
+    // Parts of the memory map a register write changed
+    enum Remap
+    {
+        REMAP_ROM = 1,
+        REMAP_RAM = 2
+    };
+
+    int mode = 0;
+    uint16_t rombanks = 2;      // 16KB banks in the ROM, a power of two
+    uint32_t ramsize = 0;       // bytes of cartridge RAM
+    bool enableram = false;
+    bool battery = false;       // RAM and clock kept while switched off
+
+    // Banks mapped at 0000-3FFF, 4000-7FFF and A000-BFFF, before
+    // wrapping to what the cartridge has
+    uint16_t rombank0 = 0;
+    uint16_t rombank = 1;
+    uint8_t rambank = 0;
+
+    // A000-BFFF is the RAM bank, rather than the mapper's handlers
+    bool ramMapped = true;
+
+    // MBC1 registers, for 2000-3FFF and 4000-5FFF
+    uint8_t bank1 = 1, bank2 = 0;
+
+    // MBC3 clock and the register of it selected at A000-BFFF, or 0
+    bool hasRTC = false;
+    uint8_t rtcSelect = 0;
+    RTC rtc;
+
+    // MBC5 carts with a motor take it out of the RAM bank register
+    bool rumble = false;
+
+    // Handlers set once by init() to the mapper's instantiations in
+    // mbc.cpp: writes to 0000-7FFF, and accesses to A000-BFFF the page
+    // map can't serve
+    void (*write)(CPU& cpu, MBC& mbc, uint16_t loc, uint8_t value, uint64_t now) = nullptr;
+    uint8_t (*readRAM)(MBC& mbc, uint8_t* ram, uint16_t loc, uint64_t now) = nullptr;
+    void (*writeRAM)(MBC& mbc, uint8_t* ram, uint16_t loc, uint8_t value, uint64_t now) = nullptr;
+
+    // Without a cartridge, writes to ROM are ignored
+    MBC() { init(0, 0, 0); }
+
+    // Pick the mapper for the cartridge type (0x147) and size the RAM
+    // from its code (0x149) in the header
+    void init(uint8_t type, uint8_t ramcode, uint64_t now);
+
+private:
+    template <typename Mapper> void select();
 };
 
-extern MBC nrom;
-extern MBC mbc1;
+/* Mappers. Each is a type with a static interface, taking the defaults
+   of Mapper for what it doesn't have:
+
+       // Update the registers for a write to 0000-7FFF and return
+       // the MBC::Remap bits of what it changed
+       static int write(MBC& mbc, uint16_t loc, uint8_t value, uint64_t now);
+
+       // Whether A000-BFFF can be mapped straight to the RAM bank
+       static bool mapsRAM(const MBC& mbc);
+
+       // A000-BFFF while enabled but not mapped
+       static uint8_t readRAM(MBC& mbc, uint8_t* ram, uint16_t loc, uint64_t now);
+       static void writeRAM(MBC& mbc, uint8_t* ram, uint16_t loc, uint8_t value, uint64_t now);
+
+   The CPU never calls a mapper directly. Handlers instantiated for the
+   mapper inline it and remap the pages it asks for, so a new mapper is
+   a type here and a cartridge type in MBC::init(). */
+
+struct Mapper
+{
+    static int write(MBC& mbc, uint16_t loc, uint8_t value, uint64_t now) { return 0; }
+    static bool mapsRAM(const MBC& mbc) { return true; }
+    static uint8_t readRAM(MBC& mbc, uint8_t* ram, uint16_t loc, uint64_t now) { return 0xFF; }
+    static void writeRAM(MBC& mbc, uint8_t* ram, uint16_t loc, uint8_t value, uint64_t now) { }
+};
+
+// ROM only, with RAM always enabled if there is any
+struct NoMBC : Mapper
+{
+};
+
+// Up to 2MB of ROM and 32KB of RAM, sharing two bank bits
+struct MBC1 : Mapper
+{
+    static int write(MBC& mbc, uint16_t loc, uint8_t value, uint64_t now);
+};
+
+// 256KB of ROM and 512 half-bytes of RAM inside the controller
+struct MBC2 : Mapper
+{
+    static int write(MBC& mbc, uint16_t loc, uint8_t value, uint64_t now);
+    static bool mapsRAM(const MBC& mbc) { return false; }
+    static uint8_t readRAM(MBC& mbc, uint8_t* ram, uint16_t loc, uint64_t now);
+    static void writeRAM(MBC& mbc, uint8_t* ram, uint16_t loc, uint8_t value, uint64_t now);
+};
+
+// 2MB of ROM, 32KB of RAM and a clock
+struct MBC3 : Mapper
+{
+    static int write(MBC& mbc, uint16_t loc, uint8_t value, uint64_t now);
+    static bool mapsRAM(const MBC& mbc) { return mbc.rtcSelect == 0; }
+    static uint8_t readRAM(MBC& mbc, uint8_t* ram, uint16_t loc, uint64_t now);
+    static void writeRAM(MBC& mbc, uint8_t* ram, uint16_t loc, uint8_t value, uint64_t now);
+};
+
+// 8MB of ROM and 128KB of RAM
+struct MBC5 : Mapper
+{
+    static int write(MBC& mbc, uint16_t loc, uint8_t value, uint64_t now);
+};
 
 #endif // MBC_H
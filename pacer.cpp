@@ -0,0 +1,148 @@
+#include "pacer.h"
+#include <thread>
+#include <math.h>
+
+using std::chrono::duration;
+using std::chrono::duration_cast;
+
+const Pacer::Clock::duration Pacer::FRAME_PERIOD =
+    duration_cast<Pacer::Clock::duration>(duration<double>(70224.0 / 4194304.0));
+
+// Bounds on how far ahead of the due time a wait stops sleeping
+static const Pacer::Clock::duration MIN_SPIN = std::chrono::microseconds(200);
+static const Pacer::Clock::duration MAX_SPIN = std::chrono::milliseconds(20);
+
+static double toMs(Pacer::Clock::duration d)
+{
+    return duration<double, std::milli>(d).count();
+}
+
+Pacer::Pacer()
+{
+    Clock::time_point now = Clock::now();
+    due = lastFrame = lastShown = now;
+    restart(second, now);
+    restart(run, now);
+}
+
+void Pacer::advance()
+{
+    paused = true;
+    stepping = true;
+}
+
+bool Pacer::runFrame()
+{
+    if (paused && !stepping)
+        return false;
+
+    stepping = false;
+    second.frames++;
+    run.frames++;
+    return true;
+}
+
+void Pacer::wait()
+{
+    Clock::time_point now = Clock::now();
+    Clock::duration period = FRAME_PERIOD;
+
+    if (speed <= 0)
+        due = now;
+    else
+    {
+        period = duration_cast<Clock::duration>(FRAME_PERIOD / speed);
+        due += period;
+
+        // Far behind, after a stall or a breakpoint: start over from
+        // now rather than run a burst of frames to catch up
+        if (now > due + 4 * period)
+            due = now;
+
+        // Sleep the bulk of it, then spin over what the OS can't time
+        if (due - now > oversleep)
+        {
+            Clock::time_point target = due - oversleep;
+            std::this_thread::sleep_until(target);
+            Clock::duration late = Clock::now() - target;
+
+            // Follow a slower wakeup at once, a faster one gradually
+            if (late > oversleep)
+                oversleep = late;
+            else
+                oversleep -= (oversleep - late) / 16;
+            if (oversleep < MIN_SPIN) oversleep = MIN_SPIN;
+            if (oversleep > MAX_SPIN) oversleep = MAX_SPIN;
+        }
+        while (Clock::now() < due)
+            std::this_thread::yield();
+    }
+
+    now = Clock::now();
+    Clock::duration taken = now - lastFrame;
+    lastFrame = now;
+
+    bool paced = speed > 0;
+    double error = toMs(taken - period);
+    record(second, paced, error);
+    record(run, paced, error);
+}
+
+bool Pacer::showFrame()
+{
+    if (speed > 0 && speed <= 1)
+        return true;
+
+    Clock::time_point now = Clock::now();
+    if (now - lastShown < FRAME_PERIOD)
+        return false;
+    lastShown = now;
+    return true;
+}
+
+bool Pacer::report(Stats& stats)
+{
+    Clock::time_point now = Clock::now();
+    if (now - second.start < std::chrono::seconds(1))
+        return false;
+
+    stats = summarize(second, now);
+    restart(second, now);
+    return true;
+}
+
+Pacer::Stats Pacer::total()
+{
+    return summarize(run, Clock::now());
+}
+
+void Pacer::restart(Window& window, Clock::time_point now)
+{
+    window = Window();
+    window.start = now;
+    window.cpuStart = std::clock();
+}
+
+void Pacer::record(Window& window, bool paced, double error)
+{
+    if (!paced)
+        return;
+
+    window.timed++;
+    window.errorSquares += error * error;
+    if (fabs(error) > window.worst)
+        window.worst = fabs(error);
+}
+
+Pacer::Stats Pacer::summarize(const Window& window, Clock::time_point now)
+{
+    double wall = duration<double>(now - window.start).count();
+    double cpu = double(std::clock() - window.cpuStart) / CLOCKS_PER_SEC;
+
+    Stats stats;
+    stats.fps = wall > 0 ? window.frames / wall : 0;
+    stats.cpu = wall > 0 ? cpu / wall * 100 : 0;
+    stats.jitter = window.timed ? sqrt(window.errorSquares / window.timed) : 0;
+    stats.worst = window.worst;
+    return stats;
+}
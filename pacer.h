@@ -0,0 +1,81 @@
+#ifndef PACER_H
+#define PACER_H
+#include <stdint.h>
+#include <chrono>
+#include <ctime>
+
+/* Paces the frontend to the DMG frame rate, 4194304 / 70224 Hz, or a
+   multiple of it. Waits sleep until just before the frame is due and
+   spin the rest of the way, so the frame period is kept to well under
+   a millisecond without holding a core. */
+class Pacer
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Length of a frame at normal speed
+    static const Clock::duration FRAME_PERIOD;
+
+    // Multiple of normal speed, 0 runs uncapped
+    double speed = 1;
+
+    bool paused = false;
+
+    // What report() hands back, over the last second
+    struct Stats
+    {
+        double fps;
+        double cpu;             // host CPU time over wall time, in percent
+        double jitter;          // RMS of frame period error, in ms
+        double worst;           // largest frame period error, in ms
+    };
+
+    Pacer();
+
+    // Run the next frame even though paused
+    void advance();
+
+    // Whether to run a frame now, false while paused
+    bool runFrame();
+
+    // Wait until the next frame is due
+    void wait();
+
+    // Whether a frame should be shown, at most once per normal frame
+    // period when running fast
+    bool showFrame();
+
+    // Fill stats and return true once a second
+    bool report(Stats& stats);
+
+    // Stats over the whole run
+    Stats total();
+
+private:
+    Clock::time_point due;
+    Clock::time_point lastFrame;
+    Clock::time_point lastShown;
+
+    bool stepping = false;
+
+    // How late sleeps wake up, which is how long a wait spins for
+    Clock::duration oversleep = std::chrono::milliseconds(1);
+
+    // Since the last report, and since the start
+    struct Window
+    {
+        Clock::time_point start;
+        std::clock_t cpuStart;
+        uint32_t frames = 0;        // run by the emulator
+        uint32_t timed = 0;         // waits paced to speed
+        double errorSquares = 0;
+        double worst = 0;
+    };
+    Window second, run;
+
+    void restart(Window& window, Clock::time_point now);
+    void record(Window& window, bool paced, double error);
+    Stats summarize(const Window& window, Clock::time_point now);
+};
+
+#endif // PACER_H
@@ -0,0 +1,200 @@
+#include "persist.h"
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "gameboy.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PERSIST_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+// Room for a state with the largest cartridge RAM, so saves never allocate
+static const size_t STATE_RESERVE = 0x60000;
+
+/* Write data to path by way of path.tmp, synced before it replaces
+   path. Return false, leaving path as it was, on failure */
+static bool replaceFile(const std::string& path, const uint8_t* data, size_t length)
+{
+    std::string temp = path + ".tmp";
+#ifdef PERSIST_POSIX
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = true;
+    while (ok && length > 0)
+    {
+        ssize_t written = ::write(fd, data, length);
+        if (written < 0 && errno == EINTR)
+            continue;
+        ok = written > 0;
+        if (ok)
+        {
+            data += written;
+            length -= written;
+        }
+    }
+    ok = fsync(fd) == 0 && ok;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0)
+    {
+        unlink(temp.c_str());
+        return false;
+    }
+
+    // The rename itself is only safe once the directory is
+    size_t slash = path.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    int dirfd = ::open(dir.c_str(), O_RDONLY);
+    if (dirfd >= 0)
+    {
+        fsync(dirfd);
+        ::close(dirfd);
+    }
+    return true;
+#else
+    {
+        std::ofstream out(temp, std::ios::binary);
+        out.write((const char*)data, length);
+        if (!out.flush())
+            return false;
+    }
+    // Renaming over a file that exists fails on some hosts
+    remove(path.c_str());
+    return rename(temp.c_str(), path.c_str()) == 0;
+#endif
+}
+
+Persist::Persist()
+{
+    // Filled once, so the pages are there before the first save
+    for (Slot& slot : slots)
+    {
+        slot.data.resize(STATE_RESERVE);
+        slot.data.clear();
+    }
+    worker = std::thread(&Persist::run, this);
+}
+
+Persist::~Persist()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    work.notify_one();
+    worker.join();
+}
+
+Persist::Slot* Persist::acquire()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (Slot& slot : slots)
+        if (!slot.busy)
+        {
+            slot.busy = true;
+            return &slot;
+        }
+    return nullptr;
+}
+
+void Persist::submit(Slot* slot)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(slot);
+    }
+    work.notify_one();
+}
+
+bool Persist::saveState(GameBoy& gb, const std::string& path, int level)
+{
+    Slot* slot = acquire();
+    if (!slot)
+        return false;
+    gb.saveState(slot->data);
+    slot->path = path;
+    slot->kind = KIND_STATE;
+    slot->level = level;
+    submit(slot);
+    return true;
+}
+
+bool Persist::saveScreenshot(GameBoy& gb, const std::string& path)
+{
+    Slot* slot = acquire();
+    if (!slot)
+        return false;
+    const uint8_t* screen = (const uint8_t*)gb.gpu.screen;
+    slot->data.assign(screen, screen + 160 * 144 * sizeof(uint32_t));
+    slot->path = path;
+    slot->kind = KIND_SCREENSHOT;
+    submit(slot);
+    return true;
+}
+
+void Persist::wait()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [this]
+    {
+        for (const Slot& slot : slots)
+            if (slot.busy)
+                return false;
+        return true;
+    });
+}
+
+void Persist::run()
+{
+#ifdef __linux__
+    // Compressing gives way to the emulation thread when they share a core
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+#endif
+
+    std::vector<unsigned char> png;
+    while (true)
+    {
+        Slot* slot;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            work.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+            slot = queue.front();
+            queue.pop_front();
+        }
+
+        bool ok;
+        if (slot->kind == KIND_SCREENSHOT)
+        {
+            png.clear();
+            ok = GameBoy::encodeScreenshot((const uint32_t*)slot->data.data(), png) &&
+                 replaceFile(slot->path, png.data(), png.size());
+        }
+        else
+        {
+            std::ostringstream file;
+            ok = StateFile::write(file, slot->data, slot->level);
+            std::string bytes = file.str();
+            ok = ok && replaceFile(slot->path, (const uint8_t*)bytes.data(), bytes.size());
+        }
+        if (!ok)
+            std::cerr << "Could not write " + slot->path + "\n";
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            slot->busy = false;
+        }
+        done.notify_all();
+    }
+}
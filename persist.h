@@ -0,0 +1,74 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "statefile.h"
+
+class GameBoy;
+
+/* Writes save states and screenshots on a thread of its own, so that
+   no frame waits on the disk. The emulation thread only copies what is
+   to be written into one of two buffers set aside up front. The worker
+   compresses or encodes it, writes it to a temporary file beside the
+   target, syncs that to disk and renames it over the target, so a
+   crash at any point leaves the old file or the new one whole.
+
+   While the worker writes from one buffer, the next save fills the
+   other. A save that finds both still being written is dropped rather
+   than waited for, and returns false. */
+class Persist
+{
+public:
+    Persist();
+    // Finishes what was queued
+    ~Persist();
+    Persist(const Persist&) = delete;
+    Persist& operator=(const Persist&) = delete;
+
+    // Queue the state of gb, to be written to path as a state file
+    bool saveState(GameBoy& gb, const std::string& path, int level = StateFile::LEVEL_DEFAULT);
+
+    // Queue gb.gpu.screen, to be written to path as a PNG
+    bool saveScreenshot(GameBoy& gb, const std::string& path);
+
+    // Wait until everything queued is written, as before reading it back
+    void wait();
+
+private:
+    enum Kind
+    {
+        KIND_STATE,
+        KIND_SCREENSHOT
+    };
+
+    struct Slot
+    {
+        std::vector<uint8_t> data;
+        std::string path;
+        Kind kind = KIND_STATE;
+        int level = 0;
+        bool busy = false;
+    };
+
+    static const int SLOTS = 2;
+    Slot slots[SLOTS];
+
+    std::deque<Slot*> queue;
+    std::mutex lock;
+    std::condition_variable work;
+    std::condition_variable done;
+    bool stopping = false;
+
+    std::thread worker;
+
+    Slot* acquire();
+    void submit(Slot* slot);
+    void run();
+};
+
+#endif // PERSIST_H
@@ -0,0 +1,210 @@
+#include "rewind.h"
+#include <string.h>
+#include "gameboy.h"
+
+static void putCount(std::vector<uint8_t>& out, size_t count)
+{
+    while (count >= 0x80)
+    {
+        out.push_back(count | 0x80);
+        count >>= 7;
+    }
+    out.push_back(count);
+}
+
+static size_t getCount(const uint8_t*& pos, const uint8_t* end)
+{
+    size_t count = 0;
+    for (int shift = 0; pos < end; shift += 7)
+    {
+        uint8_t byte = *pos++;
+        count |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    return count;
+}
+
+// First byte at or after pos where a and b differ, a word at a time
+static size_t skipSame(const uint8_t* a, const uint8_t* b, size_t pos, size_t length)
+{
+    while (pos + 8 <= length)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + pos, 8);
+        memcpy(&y, b + pos, 8);
+        if (x != y)
+            break;
+        pos += 8;
+    }
+    while (pos < length && a[pos] == b[pos])
+        pos++;
+    return pos;
+}
+
+/* Write the XOR of a and b as a list of runs: the count of bytes that
+   are the same, the count that differ, then the XOR of those. Trailing
+   bytes that are the same are left out */
+static void encode(std::vector<uint8_t>& out, const uint8_t* a, const uint8_t* b, size_t length)
+{
+    out.clear();
+    size_t pos = 0;
+    while (true)
+    {
+        size_t same = pos;
+        pos = skipSame(a, b, pos, length);
+        if (pos == length)
+            break;
+
+        // Changed bytes go a word at a time, up to a word that is the
+        // same, so the few that are the same in among them go too
+        size_t differ = pos;
+        size_t end = pos;
+        while (end + 8 <= length)
+        {
+            uint64_t x, y;
+            memcpy(&x, a + end, 8);
+            memcpy(&y, b + end, 8);
+            if (x == y)
+                break;
+            end += 8;
+        }
+        if (end + 8 > length)
+            end = length;
+
+        putCount(out, differ - same);
+        putCount(out, end - differ);
+        size_t at = out.size();
+        out.resize(at + end - differ);
+        for (size_t i = differ; i < end; i++)
+            out[at + i - differ] = a[i] ^ b[i];
+        pos = end;
+    }
+}
+
+// XOR a delta from encode into state
+static bool apply(std::vector<uint8_t>& state, const uint8_t* delta, size_t length)
+{
+    const uint8_t* pos = delta;
+    const uint8_t* end = delta + length;
+    size_t at = 0;
+    while (pos < end)
+    {
+        at += getCount(pos, end);
+        size_t count = getCount(pos, end);
+        if (at + count > state.size() || count > (size_t)(end - pos))
+            return false;
+        for (size_t i = 0; i < count; i++)
+            state[at + i] ^= pos[i];
+        at += count;
+        pos += count;
+    }
+    return true;
+}
+
+Rewind::Rewind(GameBoy& gb)
+: gb(gb)
+{
+}
+
+void Rewind::configure(size_t budget, uint32_t every)
+{
+    ring.assign(budget, 0);
+    ring.shrink_to_fit();
+    interval = every ? every : 1;
+    clear();
+}
+
+void Rewind::clear()
+{
+    deltas.clear();
+    newest.clear();
+    frames = 0;
+}
+
+size_t Rewind::states() const
+{
+    return newest.empty() ? 0 : deltas.size() + 1;
+}
+
+size_t Rewind::bytes() const
+{
+    size_t total = 0;
+    for (const Delta& delta : deltas)
+        total += delta.length;
+    return total;
+}
+
+void Rewind::capture()
+{
+    if (!enabled() || ++frames < interval)
+        return;
+    frames = 0;
+
+    gb.saveState(current);
+    if (newest.size() == current.size())
+    {
+        encode(encoded, newest.data(), current.data(), current.size());
+        store(encoded);
+    }
+    else
+        // Another cartridge, or the first state
+        deltas.clear();
+    newest.swap(current);
+}
+
+// Put a delta in the ring after the newest, over the oldest
+void Rewind::store(const std::vector<uint8_t>& delta)
+{
+    if (delta.size() > ring.size())
+    {
+        deltas.clear();
+        return;
+    }
+
+    size_t at = deltas.empty() ? 0 : deltas.back().offset + deltas.back().length;
+    if (at + delta.size() > ring.size())
+    {
+        // The end of the ring is left unused, along with the deltas
+        // in it, which are the oldest
+        while (!deltas.empty() && deltas.front().offset >= at)
+            deltas.pop_front();
+        at = 0;
+    }
+    while (!deltas.empty() && deltas.front().offset >= at && deltas.front().offset < at + delta.size())
+        deltas.pop_front();
+
+    if (!delta.empty())
+        memcpy(ring.data() + at, delta.data(), delta.size());
+    deltas.push_back({ at, delta.size() });
+}
+
+bool Rewind::stepBack()
+{
+    if (newest.empty())
+        return false;
+
+    // Right after a capture the machine is at the newest state already
+    bool atNewest = frames == 0;
+    if (atNewest)
+    {
+        if (deltas.empty())
+            return false;
+        const Delta& delta = deltas.back();
+        if (!apply(newest, ring.data() + delta.offset, delta.length))
+        {
+            clear();
+            return false;
+        }
+        deltas.pop_back();
+    }
+
+    if (!gb.loadState(newest))
+    {
+        // Of a cartridge since replaced
+        clear();
+        return false;
+    }
+    frames = 0;
+    return true;
+}
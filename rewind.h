@@ -0,0 +1,71 @@
+#ifndef REWIND_H
+#define REWIND_H
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <vector>
+
+class GameBoy;
+
+/* Rewinding. Every interval frames, capture() saves a state and keeps
+   how it differs from the state captured before it: the XOR of the
+   two, with the runs of bytes that did not change left out. A frame
+   changes a few KB of a 258KB state, so a delta is that size.
+
+   Deltas go into a ring of a fixed number of bytes, the oldest giving
+   way to the newest once it is full. The newest state is kept whole,
+   and stepping back XORs the newest delta into it to get the state
+   before, so going back costs one delta and one load per step, however
+   long the history. The budget is for deltas; the two whole states
+   kept besides come to a little over 0.5MB. */
+class Rewind
+{
+public:
+    Rewind(GameBoy& gb);
+    Rewind(const Rewind&) = delete;
+    Rewind& operator=(const Rewind&) = delete;
+
+    /* Keep up to budget bytes of deltas, a state every interval frames.
+       A budget of 0 turns rewinding off, and it starts off */
+    void configure(size_t budget, uint32_t interval = 1);
+    bool enabled() const { return !ring.empty(); }
+
+    // After each frame, see GameBoy::runFrame
+    void capture();
+
+    /* Load the last state captured, or if no frame has run since, the
+       one before it. Return false, with the machine as it was, when
+       there is nothing further back */
+    bool stepBack();
+
+    // Forget every state, as after loading a cartridge
+    void clear();
+
+    // States that stepBack can still go to, and the bytes they take
+    size_t states() const;
+    size_t bytes() const;
+
+private:
+    GameBoy& gb;
+
+    struct Delta
+    {
+        size_t offset;
+        size_t length;
+    };
+
+    std::vector<uint8_t> ring;
+    std::deque<Delta> deltas;
+
+    // The newest state, and the one being captured
+    std::vector<uint8_t> newest;
+    std::vector<uint8_t> current;
+    std::vector<uint8_t> encoded;
+
+    uint32_t interval = 1;
+    uint32_t frames = 0;
+
+    void store(const std::vector<uint8_t>& delta);
+};
+
+#endif // REWIND_H
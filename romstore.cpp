@@ -0,0 +1,165 @@
+#include "romstore.h"
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ROMSTORE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+ROMImage::~ROMImage()
+{
+#ifdef ROMSTORE_MMAP
+    if (mapped)
+    {
+        munmap(const_cast<uint8_t*>(bytes), length);
+        return;
+    }
+#endif
+    delete[] bytes;
+}
+
+namespace
+{
+    // Device, inode, size and modification time of a file
+    typedef std::tuple<uint64_t, uint64_t, uint64_t, int64_t> FileKey;
+
+    std::mutex storeLock;
+    std::map<FileKey, std::weak_ptr<const ROMImage>> byFile;
+    std::multimap<uint64_t, std::weak_ptr<const ROMImage>> byHash;
+
+    // Banks a file of length bytes is padded to
+    uint32_t paddedSize(uint64_t length)
+    {
+        uint32_t banks = 2;
+        while (banks < 512 && banks * 0x4000ull < length)
+            banks *= 2;
+        return banks * 0x4000u;
+    }
+
+    // FNV-1a over 64-bit words, the size is a whole number of banks
+    uint64_t hashImage(const uint8_t* bytes, uint32_t size)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (uint32_t i = 0; i < size; i += 8)
+        {
+            uint64_t word;
+            memcpy(&word, bytes + i, 8);
+            hash = (hash ^ word) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    template <typename Map>
+    void prune(Map& map)
+    {
+        for (auto it = map.begin(); it != map.end(); )
+            it = it->second.expired() ? map.erase(it) : std::next(it);
+    }
+}
+
+std::shared_ptr<const ROMImage> ROMStore::load(const char* filename)
+{
+    std::shared_ptr<ROMImage> image(new ROMImage);
+
+#ifdef ROMSTORE_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+    FileKey key(st.st_dev, st.st_ino, st.st_size, st.st_mtime);
+
+    // The same file loaded again needs no reading at all
+    {
+        std::lock_guard<std::mutex> guard(storeLock);
+        auto found = byFile.find(key);
+        if (found != byFile.end())
+            if (std::shared_ptr<const ROMImage> shared = found->second.lock())
+            {
+                close(fd);
+                return shared;
+            }
+    }
+
+    uint32_t size = paddedSize(st.st_size);
+    if (st.st_size == size)
+    {
+        void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            image->bytes = (const uint8_t*)map;
+            image->mapped = true;
+        }
+    }
+    if (!image->mapped)
+    {
+        // An odd size, or a file that cannot be mapped, is copied
+        uint8_t* copy = new uint8_t[size];
+        uint32_t length = std::min<uint64_t>(st.st_size, size);
+        uint32_t done = 0;
+        while (done < length)
+        {
+            ssize_t got = pread(fd, copy + done, length - done, done);
+            if (got <= 0)
+                break;
+            done += got;
+        }
+        std::fill(copy + done, copy + size, 0xFF);
+        image->bytes = copy;
+    }
+    close(fd);
+#else
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file)
+        return nullptr;
+    uint64_t length = file.tellg();
+    if (length == 0)
+        return nullptr;
+
+    uint32_t size = paddedSize(length);
+    uint8_t* copy = new uint8_t[size];
+    file.seekg(0);
+    file.read((char*)copy, std::min<uint64_t>(length, size));
+    std::fill(copy + file.gcount(), copy + size, 0xFF);
+    image->bytes = copy;
+#endif
+
+    image->length = size;
+    image->digest = hashImage(image->bytes, size);
+
+    std::lock_guard<std::mutex> guard(storeLock);
+    prune(byFile);
+    prune(byHash);
+
+    // Another file, or another thread, may already hold these contents
+    auto range = byHash.equal_range(image->digest);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        std::shared_ptr<const ROMImage> shared = it->second.lock();
+        if (shared && shared->size() == size && memcmp(shared->data(), image->bytes, size) == 0)
+        {
+#ifdef ROMSTORE_MMAP
+            byFile[key] = shared;
+#endif
+            return shared;
+        }
+    }
+
+#ifdef ROMSTORE_MMAP
+    byFile[key] = image;
+#endif
+    byHash.emplace(image->digest, image);
+    return image;
+}
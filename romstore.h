@@ -0,0 +1,44 @@
+#ifndef ROMSTORE_H
+#define ROMSTORE_H
+#include <stdint.h>
+#include <memory>
+
+/* A cartridge ROM, read only, sized to a power of two 16KB banks so
+   that wrapping a bank number to it is a mask. Where the file is
+   already that size it is mapped straight from the file, otherwise it
+   is copied with the unused space filled as open bus. */
+class ROMImage
+{
+public:
+    ~ROMImage();
+
+    const uint8_t* data() const { return bytes; }
+    uint32_t size() const { return length; }
+    uint16_t banks() const { return length / 0x4000; }
+    uint64_t hash() const { return digest; }
+
+private:
+    friend class ROMStore;
+    ROMImage() = default;
+    ROMImage(const ROMImage&) = delete;
+    ROMImage& operator=(const ROMImage&) = delete;
+
+    const uint8_t* bytes = nullptr;
+    uint32_t length = 0;
+    uint64_t digest = 0;
+    bool mapped = false;
+};
+
+/* Every ROM loaded in the process, so that instances running the same
+   game share one copy of it. A file loaded again is found by its
+   identity without being read, and a different file with the same
+   contents by their hash. An image is unmapped when the last GameBoy
+   holding it lets go. Safe to call from any thread. */
+class ROMStore
+{
+public:
+    // The image of the ROM in filename, nullptr if it cannot be read
+    static std::shared_ptr<const ROMImage> load(const char* filename);
+};
+
+#endif // ROMSTORE_H
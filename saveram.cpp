@@ -0,0 +1,100 @@
+#include "saveram.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SAVERAM_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+SaveRAM::~SaveRAM()
+{
+    close();
+}
+
+uint8_t* SaveRAM::open(const std::string& filename, uint32_t size)
+{
+    close();
+    path = filename;
+    length = size;
+    if (size == 0)
+        return nullptr;
+
+#ifdef SAVERAM_MMAP
+    if (!path.empty())
+    {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 &&
+            ((uint64_t)st.st_size >= size || ftruncate(fd, size) == 0))
+        {
+            void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED)
+            {
+                bytes = (uint8_t*)map;
+                file = true;
+                existing = std::min<uint64_t>(st.st_size, size);
+                std::fill(bytes + existing, bytes + size, 0xFF);
+            }
+        }
+        // The mapping holds on to the file
+        if (fd >= 0)
+            ::close(fd);
+        if (file)
+            return bytes;
+        std::cerr << "Error (Save file \"" + path + "\" could not be mapped, saves will be lost)\n";
+    }
+#else
+    if (!path.empty())
+    {
+        // Read in whole and written back by flush()
+        std::ifstream in(path, std::ios::binary);
+        bytes = new uint8_t[size];
+        in.read((char*)bytes, size);
+        existing = in.gcount();
+        std::fill(bytes + existing, bytes + size, 0xFF);
+        file = true;
+        return bytes;
+    }
+#endif
+
+    bytes = new uint8_t[size]();
+    return bytes;
+}
+
+void SaveRAM::flush()
+{
+    if (!file)
+        return;
+#ifdef SAVERAM_MMAP
+    msync(bytes, length, MS_ASYNC);
+#else
+    std::ofstream out(path, std::ios::binary);
+    out.write((const char*)bytes, length);
+#endif
+}
+
+void SaveRAM::close()
+{
+    if (!bytes)
+        return;
+#ifdef SAVERAM_MMAP
+    if (file)
+    {
+        msync(bytes, length, MS_SYNC);
+        munmap(bytes, length);
+    }
+    else
+        delete[] bytes;
+#else
+    flush();
+    delete[] bytes;
+#endif
+    bytes = nullptr;
+    length = existing = 0;
+    file = false;
+}
@@ -0,0 +1,49 @@
+#ifndef SAVERAM_H
+#define SAVERAM_H
+#include <stdint.h>
+#include <string>
+
+/* Memory for cartridge RAM. A battery-backed cartridge keeps it in a
+   save file mapped shared, so the game's writes land straight in the
+   page cache: nothing is copied and no call is made per write, however
+   many instances run. flush() asks the kernel to start writing the
+   dirty pages back and returns at once; close() waits for them.
+
+   Without a file, or on a host without mmap, it is plain memory. */
+class SaveRAM
+{
+public:
+    SaveRAM() = default;
+    SaveRAM(const SaveRAM&) = delete;
+    SaveRAM& operator=(const SaveRAM&) = delete;
+    ~SaveRAM();
+
+    /* Back size bytes with path, growing it as needed, with the bytes
+       added filled with 0xFF. An empty path, or a file that cannot be
+       mapped, gives zeroed memory instead. Return the memory */
+    uint8_t* open(const std::string& path, uint32_t size);
+
+    // Write back and let go of the memory
+    void close();
+
+    // Start writing back what changed since, without waiting
+    void flush();
+
+    uint8_t* data() { return bytes; }
+    uint32_t size() const { return length; }
+
+    // Whether the memory is kept in a file
+    bool persistent() const { return file; }
+
+    // Bytes at the start that were read from the file rather than added
+    uint32_t stored() const { return existing; }
+
+private:
+    uint8_t* bytes = nullptr;
+    uint32_t length = 0;
+    uint32_t existing = 0;
+    bool file = false;
+    std::string path;
+};
+
+#endif // SAVERAM_H
@@ -0,0 +1,123 @@
+#include "scheduler.h"
+#include "gameboy.h"
+#include "state.h"
+
+// Catch a subsystem up without running its event
+static void (* const syncs[Scheduler::EVENT_COUNT])(GameBoy&) =
+{
+    nullptr,
+    nullptr,
+    [](GameBoy& gb) { gb.apu.sync(); },
+    nullptr
+};
+
+static void (* const handlers[Scheduler::EVENT_COUNT])(GameBoy&) =
+{
+    [](GameBoy& gb) { gb.timer.update(); },
+    [](GameBoy& gb) { gb.gpu.update(); },
+    [](GameBoy& gb) { gb.apu.step(); },
+    nullptr
+};
+
+Scheduler::Scheduler(GameBoy& gb)
+: gb(gb)
+{
+    reset();
+}
+
+void Scheduler::updateNext()
+{
+    next = NEVER;
+    for (int e = 0; e < EVENT_COUNT; e++)
+        if (times[e] < next)
+            next = times[e];
+}
+
+uint64_t Scheduler::now()
+{
+    return base + gb.cpu.cycles;
+}
+
+void Scheduler::schedule(Event e, uint32_t delay)
+{
+    times[e] = delay == NEVER ? NEVER : gb.cpu.cycles + delay;
+    if (times[e] < next)
+        next = times[e];
+}
+
+uint32_t Scheduler::catchUp(Event e)
+{
+    uint32_t elapsed = gb.cpu.cycles - synced[e];
+    synced[e] = gb.cpu.cycles;
+    return elapsed;
+}
+
+void Scheduler::refresh(Event e)
+{
+    if (syncs[e]) syncs[e](gb);
+    schedule(e, 0);
+}
+
+void Scheduler::run()
+{
+    for (int e = 0; e < EVENT_COUNT; e++)
+    {
+        if (times[e] <= gb.cpu.cycles)
+        {
+            times[e] = NEVER;
+            if (handlers[e]) handlers[e](gb);
+        }
+    }
+    updateNext();
+}
+
+void Scheduler::sync()
+{
+    for (int e = 0; e < EVENT_COUNT; e++)
+        times[e] = gb.cpu.cycles;
+    run();
+}
+
+void Scheduler::reset()
+{
+    for (int e = 0; e < EVENT_COUNT; e++)
+    {
+        times[e] = gb.cpu.cycles;
+        synced[e] = gb.cpu.cycles;
+    }
+    next = gb.cpu.cycles;
+}
+
+void Scheduler::rebase(uint32_t elapsed)
+{
+    base += elapsed;
+    for (int e = 0; e < EVENT_COUNT; e++)
+    {
+        if (times[e] != NEVER)
+            times[e] = times[e] > elapsed ? times[e] - elapsed : 0;
+        synced[e] -= elapsed;
+    }
+    updateNext();
+}
+
+void Scheduler::saveState(StateWriter& state)
+{
+    state.put64(base);
+    state.put32(next);
+    for (int e = 0; e < EVENT_COUNT; e++)
+    {
+        state.put32(times[e]);
+        state.put32(synced[e]);
+    }
+}
+
+void Scheduler::loadState(StateReader& state)
+{
+    base = state.get64();
+    next = state.get32();
+    for (int e = 0; e < EVENT_COUNT; e++)
+    {
+        times[e] = state.get32();
+        synced[e] = state.get32();
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+#include <stdint.h>
+
+class GameBoy;
+class StateWriter;
+class StateReader;
+
+/* Events timed against CPU::cycles. The CPU only adds to its cycle
+   counter, and runs the scheduler at an instruction boundary once the
+   earliest event is due. Each subsystem catches its own counters up
+   when its event runs, and schedules its next event from there. */
+class Scheduler
+{
+public:
+    // In the order they run when due at the same boundary
+    enum Event
+    {
+        EVENT_TIMER,
+        EVENT_GPU,
+        EVENT_APU,
+        EVENT_EXEC_END,     // end of the running exec(), for compiled blocks
+        EVENT_COUNT
+    };
+
+    static const uint32_t NEVER = 0xFFFFFFFF;
+
+    // Cycle the earliest event is due at
+    uint32_t next = 0;
+
+    Scheduler(GameBoy& gb);
+
+    // Cycles run since startup, unlike CPU::cycles which exec() winds back
+    uint64_t now();
+
+    // Run e in delay cycles (NEVER cancels), replacing its pending time
+    void schedule(Event e, uint32_t delay);
+
+    // Make the CPU check in at the next instruction boundary
+    void wake() { next = 0; }
+
+    // Cycles since e's subsystem last caught up, and mark it caught up
+    uint32_t catchUp(Event e);
+
+    // Catch e's timers up before a register write changes how they
+    // count, and run it at the next boundary
+    void refresh(Event e);
+
+    // Run the events that are due
+    void run();
+
+    // Run every event now, bringing all counters up to date
+    void sync();
+
+    // Forget pending times after the state changed underneath,
+    // every event runs at the next boundary
+    void reset();
+
+    // Shift all times after CPU::cycles went down by elapsed
+    void rebase(uint32_t elapsed);
+
+    // Pending and caught up times, as they are
+    void saveState(StateWriter& state);
+    void loadState(StateReader& state);
+
+private:
+    GameBoy& gb;
+
+    // Cycles taken off CPU::cycles by rebase()
+    uint64_t base = 0;
+
+    uint32_t times[EVENT_COUNT];
+    uint32_t synced[EVENT_COUNT];
+
+    void updateNext();
+};
+
+#endif // SCHEDULER_H
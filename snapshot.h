@@ -0,0 +1,44 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stdint.h>
+#include <array>
+#include <memory>
+#include <vector>
+
+/* A save state kept in memory, sharing what it can with the snapshot
+   before it. The registers and the small parts of the machine are a
+   save state written without its memory. Memory is held in pages of
+   PAGE_SIZE bytes by shared pointer: a page not written since the last
+   snapshot is that snapshot's page, not a copy. Keeping a run of them
+   costs the pages written in between, rather than a whole state each,
+   and dropping one frees only what no other holds.
+
+   The pages are RAM, then cartridge RAM, then the GPU's frame buffers,
+   in the host's byte order. A snapshot only makes sense to the process
+   that took it; save a state to keep one. */
+class Snapshot
+{
+public:
+    static const size_t PAGE_SIZE = 0x100;
+    typedef std::array<uint8_t, PAGE_SIZE> Page;
+
+    std::vector<uint8_t> registers;
+    std::vector<std::shared_ptr<const Page>> pages;
+
+    // Pages copied when this was taken, the rest being shared
+    size_t copied = 0;
+
+    bool empty() const { return pages.empty(); }
+
+    // Bytes this snapshot added over the one before it
+    size_t bytes() const { return registers.size() + copied * PAGE_SIZE; }
+
+    void clear()
+    {
+        registers.clear();
+        pages.clear();
+        copied = 0;
+    }
+};
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,106 @@
+#ifndef STATE_H
+#define STATE_H
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/* Save states are written front to back into a byte buffer, every
+   value little endian whatever the host, so a state taken on one
+   machine loads on another. Clearing the buffer keeps its capacity, so
+   a buffer reused every frame is only allocated once.
+
+   Memory goes through putMemory, which a snapshot (see snapshot.h)
+   turns off to keep memory in pages of its own. */
+class StateWriter
+{
+public:
+    StateWriter(std::vector<uint8_t>& out, bool memory = true) : out(out), memory(memory) { out.clear(); }
+
+    size_t size() const { return out.size(); }
+
+    void put8(uint8_t v) { out.push_back(v); }
+    void putBool(bool v) { out.push_back(v); }
+    void put16(uint16_t v) { put8(v); put8(v >> 8); }
+    void put32(uint32_t v) { put16(v); put16(v >> 16); }
+    void put64(uint64_t v) { put32(v); put32(v >> 32); }
+    void putFloat(float v) { uint32_t bits; memcpy(&bits, &v, 4); put32(bits); }
+    void putDouble(double v) { uint64_t bits; memcpy(&bits, &v, 8); put64(bits); }
+
+    void putBytes(const uint8_t* data, size_t length)
+    {
+        out.insert(out.end(), data, data + length);
+    }
+
+    void putWords(const uint32_t* data, size_t count)
+    {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        putBytes((const uint8_t*)data, count * 4);
+#else
+        for (size_t i = 0; i < count; i++)
+            put32(data[i]);
+#endif
+    }
+
+    void putMemory(const uint8_t* data, size_t length) { if (memory) putBytes(data, length); }
+    void putMemoryWords(const uint32_t* data, size_t count) { if (memory) putWords(data, count); }
+
+    // Fill in a word written earlier, once its value is known
+    void patch32(size_t at, uint32_t v)
+    {
+        for (int i = 0; i < 4; i++)
+            out[at + i] = v >> (i * 8);
+    }
+
+private:
+    std::vector<uint8_t>& out;
+    bool memory;
+};
+
+/* Reads back what a StateWriter wrote. The caller checks the header
+   before reading the rest; past the end, reads give zeros. */
+class StateReader
+{
+public:
+    StateReader(const uint8_t* data, size_t length, bool memory = true)
+    : pos(data), end(data + length), memory(memory) { }
+
+    size_t remaining() const { return end - pos; }
+    // Whether memory is read here, rather than restored by a snapshot
+    bool hasMemory() const { return memory; }
+
+    uint8_t get8() { return pos < end ? *pos++ : 0; }
+    bool getBool() { return get8() != 0; }
+    uint16_t get16() { uint16_t v = get8(); return v | (get8() << 8); }
+    uint32_t get32() { uint32_t v = get16(); return v | ((uint32_t)get16() << 16); }
+    uint64_t get64() { uint64_t v = get32(); return v | ((uint64_t)get32() << 32); }
+    float getFloat() { uint32_t bits = get32(); float v; memcpy(&v, &bits, 4); return v; }
+    double getDouble() { uint64_t bits = get64(); double v; memcpy(&v, &bits, 8); return v; }
+
+    void getBytes(uint8_t* data, size_t length)
+    {
+        size_t have = length < remaining() ? length : remaining();
+        memcpy(data, pos, have);
+        memset(data + have, 0, length - have);
+        pos += have;
+    }
+
+    void getWords(uint32_t* data, size_t count)
+    {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        getBytes((uint8_t*)data, count * 4);
+#else
+        for (size_t i = 0; i < count; i++)
+            data[i] = get32();
+#endif
+    }
+
+    void getMemory(uint8_t* data, size_t length) { if (memory) getBytes(data, length); }
+    void getMemoryWords(uint32_t* data, size_t count) { if (memory) getWords(data, count); }
+
+private:
+    const uint8_t* pos;
+    const uint8_t* end;
+    bool memory;
+};
+
+#endif // STATE_H
@@ -0,0 +1,119 @@
+#include "statefile.h"
+#include <algorithm>
+#include "lodepng.h"
+
+namespace StateFile
+{
+    // "GEMZ" read as a little endian word
+    static const uint32_t MAGIC = 0x5A4D4547;
+
+    // A state a hundred times the size of any this emulator writes is
+    // taken as a corrupt header, rather than allocated
+    static const uint32_t MAX_STATE = 0x2000000;
+
+    enum Method
+    {
+        METHOD_STORED,
+        METHOD_ZLIB
+    };
+
+    static void put32(std::ostream& out, uint32_t v)
+    {
+        char bytes[4] = { (char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24) };
+        out.write(bytes, 4);
+    }
+
+    static bool get32(std::istream& in, uint32_t& v)
+    {
+        unsigned char bytes[4];
+        if (!in.read((char*)bytes, 4))
+            return false;
+        v = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+        return true;
+    }
+
+    static LodePNGCompressSettings settingsFor(int level)
+    {
+        LodePNGCompressSettings settings;
+        lodepng_compress_settings_init(&settings);
+        // Taking the first match that runs to the end keeps long runs,
+        // which states are full of, from searching the whole window
+        if (level == LEVEL_FAST)
+        {
+            settings.windowsize = 256;
+            settings.nicematch = 258;
+            settings.lazymatching = 0;
+        }
+        else if (level >= LEVEL_BEST)
+        {
+            settings.windowsize = 32768;
+            settings.nicematch = 258;
+        }
+        return settings;
+    }
+
+    bool write(std::ostream& out, const std::vector<uint8_t>& state, int level)
+    {
+        put32(out, MAGIC);
+        put32(out, FORMAT_VERSION);
+        put32(out, state.size());
+        put32(out, CHUNK_SIZE);
+
+        LodePNGCompressSettings settings = settingsFor(level);
+        std::vector<unsigned char> packed;
+        for (size_t at = 0; at < state.size(); at += CHUNK_SIZE)
+        {
+            uint32_t length = std::min<size_t>(CHUNK_SIZE, state.size() - at);
+            const uint8_t* chunk = state.data() + at;
+
+            packed.clear();
+            bool zlib = level != LEVEL_STORE &&
+                        lodepng::compress(packed, chunk, length, settings) == 0 &&
+                        packed.size() < length;
+
+            put32(out, length);
+            put32(out, zlib ? packed.size() : length);
+            out.put(zlib ? METHOD_ZLIB : METHOD_STORED);
+            if (zlib)
+                out.write((const char*)packed.data(), packed.size());
+            else
+                out.write((const char*)chunk, length);
+        }
+        return (bool)out;
+    }
+
+    bool read(std::istream& in, std::vector<uint8_t>& state)
+    {
+        uint32_t magic, version, total, chunkSize;
+        if (!get32(in, magic) || magic != MAGIC ||
+            !get32(in, version) || version != FORMAT_VERSION ||
+            !get32(in, total) || total > MAX_STATE ||
+            !get32(in, chunkSize) || chunkSize > MAX_STATE)
+            return false;
+
+        state.clear();
+        state.reserve(total);
+        std::vector<unsigned char> packed;
+        while (state.size() < total)
+        {
+            uint32_t length, stored;
+            int method;
+            if (!get32(in, length) || !get32(in, stored) || (method = in.get()) < 0 ||
+                length > chunkSize || length > total - state.size() || stored > chunkSize + 0x1000)
+                return false;
+
+            packed.resize(stored);
+            if (!in.read((char*)packed.data(), stored))
+                return false;
+
+            size_t before = state.size();
+            if (method == METHOD_STORED && stored == length)
+                state.insert(state.end(), packed.begin(), packed.end());
+            else if (method != METHOD_ZLIB || lodepng::decompress(state, packed.data(), stored) != 0)
+                return false;
+            if (state.size() - before != length)
+                return false;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef STATEFILE_H
+#define STATEFILE_H
+#include <stdint.h>
+#include <vector>
+#include <iostream>
+
+/* Save states on disk. A file is a header followed by the state in
+   chunks of at most CHUNK_SIZE bytes, each deflated on its own with
+   the zlib of lodepng, or stored if that doesn't make it smaller:
+
+       "GEMZ", FORMAT_VERSION, state length, chunk size    (32 bits each)
+       per chunk: length, stored length, method, bytes
+
+   little endian throughout. Reading takes a chunk at a time off the
+   stream, so a state is never held compressed in memory whole. */
+namespace StateFile
+{
+    static const uint32_t FORMAT_VERSION = 1;
+    static const uint32_t CHUNK_SIZE = 0x10000;
+
+    enum Level
+    {
+        LEVEL_STORE,        // no compression at all
+        LEVEL_FAST,         // short matches in a small window, for hot checkpoints
+        LEVEL_DEFAULT,      // lodepng's own settings
+        LEVEL_BEST          // the whole window, longest matches
+    };
+
+    // Write state to out at level, return false if it could not be written
+    bool write(std::ostream& out, const std::vector<uint8_t>& state, int level = LEVEL_DEFAULT);
+
+    // Replace state with one read from in, return false on a bad or
+    // truncated file
+    bool read(std::istream& in, std::vector<uint8_t>& state);
+}
+
+#endif // STATEFILE_H
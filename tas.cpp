@@ -1,9 +1,11 @@
 #include "tas.h"
 #include <iostream>
-#include "cpu.h"
-#include "joypad.h"
-#include <SDL2/SDL.h>
-#include "gpu.h"
+#include "gameboy.h"
+
+TAS::TAS(GameBoy& gb)
+: gb(gb)
+{
+}
 
 int TAS::loadVBM(const char* filename)
 {
@@ -11,7 +13,7 @@ int TAS::loadVBM(const char* filename)
     uint8_t* read = (uint8_t*)readFileBytes(filename, &length);
     if (!read)
     {
-        std::cout << "Error (File \"" << filename << "\" not found)";
+        std::cerr << "Error (File \"" + std::string(filename) + "\" not found)\n";
         return 1;
     }
 
@@ -26,7 +28,7 @@ int TAS::loadVBM(const char* filename)
 
     if (getInt() != 0x1A4D4256)
     {
-        std::cout << "Error (File \"" << filename << "\" has invalid VBM format)";
+        std::cerr << "Error (File \"" + std::string(filename) + "\" has invalid VBM format)\n";
         return 1;
     }
     getInt(); // Major version number, must be "1"
@@ -66,8 +68,9 @@ int TAS::loadVBM(const char* filename)
         getByte();
 
     index = control;
-    CPU::hardreset();
-    GPU::raise();
+    // Movies start from clean cartridge RAM, and leave the save file alone
+    gb.cpu.savePath.clear();
+    gb.cpu.hardreset();
 
     running = true;
     return 0;
@@ -75,21 +78,14 @@ int TAS::loadVBM(const char* filename)
 
 void TAS::step()
 {
-    if (CPU::runningBootROM) return;
+    if (gb.cpu.runningBootROM) return;
 
     uint8_t pad = getByte();
     uint8_t special = getByte();
 
-    Joypad::pressed[SDL_SCANCODE_X]      = pad & 0x01;
-    Joypad::pressed[SDL_SCANCODE_Z]      = pad & 0x02;
-    Joypad::pressed[SDL_SCANCODE_RSHIFT] = pad & 0x04;
-    Joypad::pressed[SDL_SCANCODE_RETURN] = pad & 0x08;
-    Joypad::pressed[SDL_SCANCODE_RIGHT]  = pad & 0x10;
-    Joypad::pressed[SDL_SCANCODE_LEFT]   = pad & 0x20;
-    Joypad::pressed[SDL_SCANCODE_UP]     = pad & 0x40;
-    Joypad::pressed[SDL_SCANCODE_DOWN]   = pad & 0x80;
+    gb.joypad.held = pad;
 
-    if (special & 0x08) CPU::reset();
+    if (special & 0x08) gb.cpu.reset();
 
 }
 
@@ -107,8 +103,9 @@ uint8_t TAS::getByte()
 {
     if (index >= length)
     {
+        if (running)
+            std::cerr << "TAS has ended\n";
         running = false;
-        std::cout << "TAS has ended" << std::endl;
         return 0;
     }
     return data[index++];
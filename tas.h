@@ -2,9 +2,13 @@
 #define TAS_H
 #include <stdint.h>
 
+class GameBoy;
+
 class TAS
 {
 private:
+    GameBoy& gb;
+
     uint8_t* data = nullptr;
     bool running = false;
 
@@ -15,6 +19,8 @@ private:
     uint8_t getByte();
     uint32_t getInt();
 public:
+    TAS(GameBoy& gb);
+
     int loadVBM(const char* file);
     void step();
 
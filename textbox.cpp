@@ -1,8 +1,8 @@
 #include "textbox.h"
-#include "joypad.h"
+#include "gameboy.h"
+#include "frontend.h"
 #include "debug.h"
 #include <SDL2/SDL.h>
-#include "cpu.h"
 
 TextBox::TextBox(int32_t x, int32_t y, uint32_t w, uint32_t h)
 : Component(x, y)
@@ -13,27 +13,28 @@ TextBox::TextBox(int32_t x, int32_t y, uint32_t w, uint32_t h)
 
 void TextBox::update(Debugger* debugger)
 {
+    Frontend& frontend = debugger->frontend;
     int32_t mousex, mousey;
     SDL_GetMouseState(&mousex, &mousey);
 
-    if ((Joypad::mousedown || Joypad::mouseup) &&
+    if ((frontend.mousedown || frontend.mouseup) &&
         (mousex > x && mousey > y && mousex <= x + (int)width && mousey <= y + (int)height))
     {
-        if (Joypad::mouseup) {
+        if (frontend.mouseup) {
             pressed = true;
-            Joypad::typeStack.clear();
+            frontend.typeStack.clear();
         }
     }
-    else if (Joypad::mousedown) {
+    else if (frontend.mousedown) {
         pressed = false;
     }
 
     // Write and control text from key input
     if (pressed)
     {
-        while (!Joypad::typeStack.empty())
+        while (!frontend.typeStack.empty())
         {
-            char c = Joypad::typeStack.back();
+            char c = frontend.typeStack.back();
             if (text.size() < limit)
             {
                 bool check = false;
@@ -51,7 +52,7 @@ void TextBox::update(Debugger* debugger)
             if (c == SDLK_RETURN)
                 onenter(this, debugger);
 
-            Joypad::typeStack.pop_back();
+            frontend.typeStack.pop_back();
         }
     }
 }
@@ -70,7 +71,7 @@ void TextBox::draw(Debugger* debugger)
     std::string sub = text.substr(start, end);
     debugger->write(sub.c_str(), pressed ? 0x0 : 0x202020, x + 4, y + 4);
 
-    if (pressed && CPU::frameticks / 30 % 2)
+    if (pressed && debugger->gb.cpu.frameticks / 30 % 2)
         debugger->drawChar('_', 0x0, x + 4 + (start+end) * 9, y + 4);
 }
 
@@ -0,0 +1,148 @@
+#include "timer.h"
+#include "gameboy.h"
+#include "state.h"
+
+// Divider bit TIMA follows for each TAC speed, as the period of its falling edges
+const uint32_t periods[4] = { 1024, 16, 64, 256 };
+
+const uint64_t NEVER = ~0ull;
+
+Timer::Timer(GameBoy& gb)
+: gb(gb)
+{
+}
+
+uint16_t Timer::divider()
+{
+    return gb.scheduler.now() - dividerStart;
+}
+
+uint32_t Timer::period()
+{
+    return periods[gb.cpu.RAM[IO_TAC] & 3];
+}
+
+// Input of the falling edge detector that clocks TIMA
+bool Timer::timerSignal()
+{
+    return (gb.cpu.RAM[IO_TAC] & 4) && (divider() & (period() >> 1));
+}
+
+// Time TIMA next overflows, counting edges since timaStart
+uint64_t Timer::overflowTime()
+{
+    if (!(gb.cpu.RAM[IO_TAC] & 4))
+        return NEVER;
+    uint64_t edge = (timaStart - dividerStart) / period() + 0x100 - gb.cpu.RAM[IO_TIMA];
+    return dividerStart + edge * period();
+}
+
+void Timer::increment()
+{
+    if (++gb.cpu.RAM[IO_TIMA] == 0)
+    {
+        gb.cpu.RAM[IO_TIMA] = gb.cpu.RAM[IO_TMA];
+        gb.cpu.RAM[IO_IF] |= INTERRUPT_TIMER;
+    }
+}
+
+// Bring DIV and TIMA in RAM up to the current cycle
+void Timer::catchUp()
+{
+    uint64_t now = gb.scheduler.now();
+    uint64_t overflow;
+    while ((overflow = overflowTime()) <= now)
+    {
+        gb.cpu.RAM[IO_TIMA] = gb.cpu.RAM[IO_TMA];
+        gb.cpu.RAM[IO_IF] |= INTERRUPT_TIMER;
+        timaStart = overflow;
+    }
+
+    if (gb.cpu.RAM[IO_TAC] & 4)
+    {
+        uint32_t p = period();
+        gb.cpu.RAM[IO_TIMA] += (now - dividerStart) / p - (timaStart - dividerStart) / p;
+    }
+    timaStart = now;
+    gb.cpu.RAM[IO_DIV] = divider() >> 8;
+}
+
+void Timer::schedule()
+{
+    uint64_t overflow = overflowTime();
+    if (overflow == NEVER)
+        gb.scheduler.schedule(Scheduler::EVENT_TIMER, Scheduler::NEVER);
+    else
+        gb.scheduler.schedule(Scheduler::EVENT_TIMER, overflow - gb.scheduler.now());
+}
+
+uint8_t Timer::readDIV()
+{
+    return divider() >> 8;
+}
+
+uint8_t Timer::readTIMA()
+{
+    catchUp();
+    return gb.cpu.RAM[IO_TIMA];
+}
+
+/* Resetting the divider is a falling edge when the selected bit was set */
+void Timer::writeDIV(uint8_t)
+{
+    catchUp();
+    bool signal = timerSignal();
+    dividerStart = timaStart = gb.scheduler.now();
+    gb.cpu.RAM[IO_DIV] = 0;
+    if (signal)
+        increment();
+    schedule();
+}
+
+void Timer::writeTIMA(uint8_t)
+{
+    timaStart = gb.scheduler.now();
+    schedule();
+}
+
+void Timer::writeTMA(uint8_t byte)
+{
+    catchUp();
+    gb.cpu.RAM[IO_TMA] = byte;
+}
+
+/* So is disabling the timer or picking another bit */
+void Timer::writeTAC(uint8_t byte)
+{
+    catchUp();
+    bool signal = timerSignal();
+    gb.cpu.RAM[IO_TAC] = (gb.cpu.RAM[IO_TAC] & ~0x07) | (byte & 0x07);
+    if (signal && !timerSignal())
+        increment();
+    schedule();
+}
+
+void Timer::update()
+{
+    catchUp();
+    schedule();
+}
+
+void Timer::restore(uint8_t subcycles)
+{
+    timaStart = gb.scheduler.now();
+    dividerStart = timaStart - ((gb.cpu.RAM[IO_DIV] << 8) | subcycles);
+    schedule();
+}
+
+void Timer::saveState(StateWriter& state)
+{
+    state.put64(dividerStart);
+    state.put64(timaStart);
+}
+
+void Timer::loadState(StateReader& state)
+{
+    dividerStart = state.get64();
+    timaStart = state.get64();
+}
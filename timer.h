@@ -0,0 +1,54 @@
+#ifndef TIMER_H
+#define TIMER_H
+#include <stdint.h>
+
+class GameBoy;
+class StateWriter;
+class StateReader;
+
+/* DIV and TIMA, worked out from the time instead of counted. The
+   timer is a 16-bit divider running since it was last reset, DIV is
+   its upper byte, and TIMA counts falling edges of the divider bit
+   selected by TAC. Only the TIMA overflow is a scheduler event. */
+class Timer
+{
+public:
+    Timer(GameBoy& gb);
+
+    // Internal divider at the current cycle
+    uint16_t divider();
+
+    /* Register hooks */
+    uint8_t readDIV();
+    uint8_t readTIMA();
+    void writeDIV(uint8_t byte);
+    void writeTIMA(uint8_t byte);
+    void writeTMA(uint8_t byte);
+    void writeTAC(uint8_t byte);
+
+    // Scheduler event: catch up and schedule the next overflow
+    void update();
+
+    // Start the divider from DIV and its low byte, with TIMA from RAM
+    void restore(uint8_t subcycles);
+
+    void saveState(StateWriter& state);
+    void loadState(StateReader& state);
+
+private:
+    GameBoy& gb;
+
+    // Time the divider was last 0
+    uint64_t dividerStart = 0;
+    // Time the TIMA value in RAM was current
+    uint64_t timaStart = 0;
+
+    uint32_t period();
+    bool timerSignal();
+    uint64_t overflowTime();
+    void increment();
+    void catchUp();
+    void schedule();
+};
+
+#endif // TIMER_H